@@ -1,6 +1,8 @@
 #include <bgce.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 #include "bgtk.h"
 
@@ -14,13 +16,17 @@ void button_callback(void) {
 
 	if (counter_label && counter_label->type == BGTK_WIDGET_LABEL) {
 		puts(" setting new label");
-		char counter_text[32];
-		sprintf(counter_text, "Counter: %d", counter);
-		printf("calling set_label: %p\n", counter_label->set_label);
-		counter_label->set_label(counter_label, counter_text);
+		bgtk_set_textf(counter_label, "Counter: %d", counter);
 	}
 }
 
+// Whether another message is already waiting, so presenting can wait for
+// the frame that includes it.
+static int message_waiting(int fd) {
+	struct pollfd p = {.fd = fd, .events = POLLIN};
+	return poll(&p, 1, 0) > 0;
+}
+
 int main(void) {
 	setvbuf(stdout, NULL, _IONBF, 0);  // Disable buffering for stdout
 	setvbuf(stderr, NULL, _IONBF, 0);  // Disable buffering for stderr
@@ -61,7 +67,9 @@ int main(void) {
 
 	// 4. Create Widgets
 
-	// Create a list of widgets for the scrollable container
+	// Create a list of widgets for the scrollable container, the first
+	// one is a heading in a larger font
+	struct BGTK_Font* heading_font = bgtk_font(ctx, NULL, 20);
 	struct BGTK_Widget* scrollable_widgets[21];
 	for (int i = 0; i < 20; i++) {
 		char label_text[32];
@@ -70,6 +78,7 @@ int main(void) {
 			.flags = 0,
 			.padding = 5,
 			.margin = 2,
+			.font = i == 0 ? heading_font : NULL,
 		});
 	}
 
@@ -99,11 +108,14 @@ int main(void) {
 	// 5. draw widgets
 	ctx->root_widget = scrollable;
 	bgtk_draw_widgets(ctx);
+	bgtk_dump_startup(ctx, stdout);
 
 	// 6. start loop to listen for input events
 	printf("Starting BGTK main loop (%dx%d)...\n", ctx->width, ctx->height);
 	struct BGCEMessage msg;
 	ssize_t bytes;
+	size_t buffer_size = (size_t)req.width * req.height * sizeof(uint32_t);
+	int dirty = 0;
 	while (1) {
 		bytes = bgce_recv_msg(ctx->conn_fd, &msg);
 		if (bytes <= 0) {
@@ -123,17 +135,47 @@ int main(void) {
 				res = bgtk_handle_input_event(
 				    ctx, msg.data.input_event);
 				break;
-			case MSG_BUFFER_CHANGE:
-				// TODO: Handle buffer
-				// resize/move
-				break;	// Redraw
+			case MSG_BUFFER_CHANGE: {
+				// The window was resized, map a buffer of the
+				// new size. Drags send many, the loop presents
+				// once they stop queueing up.
+				struct BufferRequest size =
+				    msg.data.buffer_request;
+				void* resized = bgce_get_buffer(conn_fd, size);
+				if (!resized) {
+					fprintf(stderr,
+						"bgtk_main_loop: Failed to get "
+						"resized buffer.\n");
+					break;
+				}
+				size_t resized_size = (size_t)size.width *
+						      size.height *
+						      sizeof(uint32_t);
+				if (bgtk_resize(ctx, resized, size.width,
+						size.height) < 0) {
+					// BGTK still draws into the old one
+					munmap(resized, resized_size);
+					break;
+				}
+				scrollable->w = size.width;
+				scrollable->h = size.height;
+				res = 1;
+
+				// BGTK no longer writes the old buffer
+				munmap(buffer, buffer_size);
+				buffer = resized;
+				buffer_size = resized_size;
+				break;
+			}
 			default:
 				// Ignore other messages for now
 				printf("Ignoring message\n");
 				break;
 		}
-		if (res) {
-			bgce_draw(conn_fd);
+		dirty |= res;
+		if (dirty && !message_waiting(conn_fd)) {
+			bgtk_present(ctx);
+			dirty = 0;
 		}
 	}
 
@@ -0,0 +1,300 @@
+#include <bgce.h>
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Microbenchmarks of the drawing, text, layout and hit-test hot paths.
+// Results are printed as JSON, one entry per case:
+//
+//   ./bgtk_bench [--filter <substring>] [--time <ms per case>] > bench.json
+
+// Compiler and flags, so results from different builds are not mixed up
+#ifndef BGTK_BUILD_FLAGS
+#define BGTK_BUILD_FLAGS "unknown"
+#endif
+
+struct Bench {
+	const char* filter;
+	uint64_t budget_ns;  // Time each case runs for
+	int first;	     // No result printed yet
+};
+
+// Calls fn until the time budget is spent and prints the rate of `unit`,
+// with `work` units done per call.
+static void bench_run(struct Bench* b, const char* name, const char* params,
+		      const char* unit, double work,
+		      void (*fn)(void* arg), void* arg) {
+	if (b->filter && !strstr(name, b->filter)) {
+		return;
+	}
+
+	// Warm caches and lazily loaded state first
+	fn(arg);
+
+	uint64_t iterations = 0;
+	uint64_t start = now_ns();
+	uint64_t elapsed;
+	do {
+		for (int i = 0; i < 16; i++) {
+			fn(arg);
+		}
+		iterations += 16;
+		elapsed = now_ns() - start;
+	} while (elapsed < b->budget_ns);
+
+	double seconds = elapsed / 1e9;
+	printf("%s\n    {\"name\": \"%s\", \"params\": \"%s\", "
+	       "\"unit\": \"%s\", \"rate\": %.1f, \"iterations\": %llu, "
+	       "\"ns_per_op\": %.1f}",
+	       b->first ? "" : ",", name, params, unit,
+	       iterations * work / seconds, (unsigned long long)iterations,
+	       (double)elapsed / iterations);
+	b->first = 0;
+	fflush(stdout);
+}
+
+// --- Rectangles and images ---
+
+struct Rect_Case {
+	struct BGTK_Surface* dst;
+	int w, h;
+};
+
+static void run_fill(void* arg) {
+	struct Rect_Case* c = arg;
+	draw_rect(c->dst, 0, 0, c->w, c->h, BGTK_COLOR_BTN,
+		  BGTK_BLEND_SRC_OVER);
+}
+
+struct Image_Case {
+	struct BGTK_Surface* dst;
+	struct BGTK_Surface image;
+};
+
+static void run_image(void* arg) {
+	struct Image_Case* c = arg;
+	copy_rect(c->dst, 0, 0, &c->image, 0, 0, c->image.width,
+		  c->image.height);
+}
+
+// The same image faded to half, so every pixel is blended
+static void run_faded_image(void* arg) {
+	struct Image_Case* c = arg;
+	blend_rect(c->dst, 0, 0, &c->image, 0, 0, c->image.width,
+		   c->image.height, BGTK_BLEND_SRC_OVER, 0x80);
+}
+
+// --- Text ---
+
+struct Text_Case {
+	struct BGTK_Font* font;
+	struct BGTK_Surface* dst;
+	struct BGTK_Widget* widget;
+	const char* text;
+};
+
+static void run_draw_text(void* arg) {
+	struct Text_Case* c = arg;
+	draw_text(c->font, c->dst, c->text, 0, 0, BGTK_COLOR_TEXT);
+}
+
+static void run_measure_text(void* arg) {
+	struct Text_Case* c = arg;
+	c->widget->data.text.pen_valid = 0;
+	text_advance(c->widget);
+}
+
+static int glyph_count(const char* text) {
+	int n = 0;
+	for (const char* p = text; *p; p++) {
+		n += ((unsigned char)*p & 0xC0) != 0x80;
+	}
+	return n;
+}
+
+// --- Layout and hit testing ---
+
+struct Tree_Case {
+	struct BGTK_Context* ctx;
+	struct BGTK_Widget** leaves;
+	int count;
+	int next;
+	int ox, oy;  // Window position of the leaves' coordinate space
+};
+
+static void run_layout(void* arg) {
+	struct Tree_Case* c = arg;
+	for (int i = 0; i < c->count; i++) {
+		bgtk_invalidate_layout(c->leaves[i]);
+	}
+	layout_widgets(c->ctx);
+}
+
+// The same with every text measured again from its glyph advances, as
+// after a font or string change
+static void run_layout_cold(void* arg) {
+	struct Tree_Case* c = arg;
+	for (int i = 0; i < c->count; i++) {
+		c->leaves[i]->data.text.pen_valid = 0;
+		c->leaves[i]->measured.valid = 0;
+		bgtk_invalidate_layout(c->leaves[i]);
+	}
+	layout_widgets(c->ctx);
+}
+
+static void run_hit_test(void* arg) {
+	struct Tree_Case* c = arg;
+	struct BGTK_Widget* target = c->leaves[c->next];
+	c->next = (c->next + 7) % c->count;
+
+	// Leaves are labels, so the click is resolved but does nothing
+	struct InputEvent ev = {.code = BTN_LEFT,
+				.value = 1,
+				.x = c->ox + target->x + 1,
+				.y = c->oy + target->y + 1};
+	bgtk_handle_input_event(c->ctx, ev);
+}
+
+int main(int argc, char** argv) {
+	struct Bench b = {.budget_ns = 200 * 1000000ull, .first = 1};
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			b.filter = argv[++i];
+		} else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+			b.budget_ns =
+			    strtoull(argv[++i], NULL, 10) * 1000000ull;
+		} else {
+			fprintf(stderr,
+				"usage: %s [--filter <name>] [--time <ms>]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	struct BGTK_Context* ctx = bgtk_init_headless(1920, 1080);
+	if (!ctx) {
+		return 1;
+	}
+	struct BGTK_Surface* dst = &ctx->back_buffer;
+
+	printf("{\n  \"build\": \"%s\",\n  \"benchmarks\": [",
+	       BGTK_BUILD_FLAGS);
+
+	char params[64];
+	static const int fills[][2] = {{1920, 1080}, {256, 256}, {16, 16}};
+	for (size_t i = 0; i < sizeof(fills) / sizeof(fills[0]); i++) {
+		struct Rect_Case c = {dst, fills[i][0], fills[i][1]};
+		snprintf(params, sizeof(params), "%dx%d", c.w, c.h);
+		bench_run(&b, i == 0 ? "clear" : "fill_rect", params,
+			  "pixels/s", (double)c.w * c.h, run_fill, &c);
+	}
+
+	// The same clear into a frame in each pixel format
+	static const char* format_names[BGTK_FORMATS] = {
+	    "argb8888", "xrgb8888", "abgr8888", "rgb565"};
+	for (int f = 0; f < BGTK_FORMATS; f++) {
+		struct BGTK_Surface frame = {
+		    .pixels = calloc((size_t)1920 * 1080, pixel_size(f)),
+		    .format = f,
+		    .width = 1920,
+		    .height = 1080,
+		    .stride = 1920};
+		if (!frame.pixels) {
+			perror("calloc");
+			continue;
+		}
+		struct Rect_Case c = {&frame, 1920, 1080};
+		bench_run(&b, "clear_format", format_names[f], "pixels/s",
+			  (double)c.w * c.h, run_fill, &c);
+		free(frame.pixels);
+	}
+
+	static const int images[] = {32, 256, 1024};
+	for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+		int size = images[i];
+		uint32_t* pixels =
+		    malloc((size_t)size * size * sizeof(uint32_t));
+		if (!pixels) {
+			perror("malloc");
+			continue;
+		}
+		for (int p = 0; p < size * size; p++) {
+			pixels[p] = 0xFF000000u | (uint32_t)p * 2654435761u;
+		}
+		struct Image_Case c = {
+		    dst, {.pixels = pixels, .width = size, .height = size,
+			  .stride = size}};
+		snprintf(params, sizeof(params), "%dx%d", size, size);
+		bench_run(&b, "draw_image", params, "images/s", 1, run_image,
+			  &c);
+		bench_run(&b, "blend_image", params, "images/s", 1,
+			  run_faded_image, &c);
+		free(pixels);
+	}
+
+	static const char* strings[] = {
+	    "The quick brown fox jumps over the lazy dog 0123456789",
+	    "Grüße aus Köln, Ελληνικά и кириллица — ✓ €",
+	};
+	static const char* string_names[] = {"ascii", "utf8"};
+	for (int i = 0; i < 2; i++) {
+		struct BGTK_Widget* widget =
+		    bgtk_text(ctx, (char*)strings[i], (BGTK_Options){0});
+		if (!widget) {
+			continue;
+		}
+		struct Text_Case c = {ctx->font, dst, widget, strings[i]};
+		bench_run(&b, "draw_text", string_names[i], "glyphs/s",
+			  glyph_count(strings[i]), run_draw_text, &c);
+		bench_run(&b, "measure_text", string_names[i], "strings/s", 1,
+			  run_measure_text, &c);
+		widget_free(widget);
+	}
+
+	// A scrollable list of labels, as in the demo app
+	enum { ITEMS = 200 };
+	struct BGTK_Widget* items[ITEMS];
+	struct BGTK_Widget* leaves[ITEMS];
+	for (int i = 0; i < ITEMS; i++) {
+		char label[32];
+		snprintf(label, sizeof(label), "Item %d", i);
+		items[i] =
+		    bgtk_label(ctx, label, (BGTK_Options){.padding = 4});
+		leaves[i] = items[i]->data.label.text;
+	}
+	struct BGTK_Widget* list = bgtk_scrollable(
+	    ctx, items, ITEMS, (BGTK_Options){.padding = 10, .margin = 5});
+	list->w = 600;
+	list->h = 1000;
+	ctx->root_widget = list;
+	bgtk_draw_widgets(ctx);
+
+	struct Tree_Case tree = {ctx, leaves, ITEMS, 0, 0, 0};
+	snprintf(params, sizeof(params), "%d labels", ITEMS);
+	bench_run(&b, "layout", params, "widgets/s", ITEMS * 2, run_layout,
+		  &tree);
+	bench_run(&b, "layout_cold", params, "widgets/s", ITEMS * 2,
+		  run_layout_cold, &tree);
+
+	// Only the visible items can be hit
+	tree.leaves = items;
+	tree.ox = list->x;
+	tree.oy = list->y;
+	tree.count = 0;
+	while (tree.count < ITEMS &&
+	       items[tree.count]->y + items[tree.count]->h < list->h) {
+		tree.count++;
+	}
+	if (tree.count > 0) {
+		bench_run(&b, "hit_test", params, "lookups/s", 1, run_hit_test,
+			  &tree);
+	}
+
+	printf("\n  ]\n}\n");
+	bgtk_destroy(ctx);
+	return 0;
+}
@@ -4,18 +4,20 @@
 #include <linux/input.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "internal.h"
 
-// The font path is hardcoded for simplicity.
-#define DEFAULT_FONT_PATH                                 \
-	"/usr/share/fonts/ttf-input/InputMono/InputMono/" \
-	"InputMono-Regular.ttf"
-#define DEFAULT_FONT_SIZE 12
-
 // --- Core Functions ---
 
+// Monotonic timestamp in nanoseconds.
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 struct BGTK_Context* bgtk_init(int conn_fd, void* buffer, int width,
 			       int height) {
 	struct BGTK_Context* ctx =
@@ -27,33 +29,50 @@ struct BGTK_Context* bgtk_init(int conn_fd, void* buffer, int width,
 
 	ctx->conn_fd = conn_fd;
 	ctx->shm_buffer = buffer;
-	ctx->font_size = DEFAULT_FONT_SIZE;
 	ctx->width = width;
 	ctx->height = height;
 	ctx->root_widget = NULL;
 
-	// 1. Initialize FreeType
-	if (FT_Init_FreeType(&ctx->ft_library)) {
-		fprintf(stderr,
-			"bgtk_init: Could not init FreeType library.\n");
+	trace_init();
+	trace_thread_name("main");
+	if (memory_init(ctx) != 0) {
+		free(ctx);
+		return NULL;
+	}
+	layers_init(ctx);
+	scroll_cache_init(ctx);
+	if (startup_init(ctx) != 0) {
+		memory_free(ctx);
 		free(ctx);
 		return NULL;
 	}
+	int id = startup_begin(ctx, "bgtk_init", NULL);
 
-	// 2. Load Font
-	if (FT_New_Face(ctx->ft_library, DEFAULT_FONT_PATH, 0, &ctx->ft_face)) {
-		fprintf(stderr,
-			"bgtk_init: Could not load font %s. Falling back "
-			"to simple "
-			"drawing.\n",
-			DEFAULT_FONT_PATH);
+	if (present_init(ctx) != 0) {
+		startup_free(ctx);
+		memory_free(ctx);
+		free(ctx);
+		return NULL;
+	}
+	if (frame_stats_init(ctx) != 0) {
+		present_free(ctx);
+		startup_free(ctx);
+		memory_free(ctx);
 		free(ctx);
 		return NULL;
 	}
 
-	// Set font size
-	FT_Set_Pixel_Sizes(ctx->ft_face, 0, ctx->font_size);
+	// FreeType and the default font are opened in the background
+	if (fonts_init(ctx) != 0) {
+		frame_stats_free(ctx);
+		present_free(ctx);
+		startup_free(ctx);
+		memory_free(ctx);
+		free(ctx);
+		return NULL;
+	}
 
+	startup_end(ctx, id);
 	return ctx;
 }
 
@@ -62,151 +81,257 @@ void bgtk_destroy(struct BGTK_Context* ctx) {
 		return;
 	}
 
-	// Free the root widget and its children recursively
-	if (ctx->root_widget) {
-		if (ctx->root_widget->type == BGTK_WIDGET_SCROLLABLE) {
-			if (ctx->root_widget->data.scrollable.widgets) {
-				for (int i = 0;
-				     i < ctx->root_widget->data.scrollable
-					     .widget_count;
-				     i++) {
-					free(ctx->root_widget->data.scrollable
-						 .widgets[i]);
-				}
-				free(ctx->root_widget->data.scrollable.widgets);
-			}
-			if (ctx->root_widget->data.scrollable.tmp) {
-				free(ctx->root_widget->data.scrollable.tmp);
-			}
-		} else if (ctx->root_widget->type == BGTK_WIDGET_LABEL) {
-			if (ctx->root_widget->data.label.text) {
-				free(ctx->root_widget->data.label.text->data
-					 .text.text);
-				free(ctx->root_widget->data.label.text);
-			}
-		} else if (ctx->root_widget->type == BGTK_WIDGET_BUTTON) {
-			if (ctx->root_widget->data.button.label) {
-				if (ctx->root_widget->data.button.label->data
-					.label.text) {
-					free(ctx->root_widget->data.button
-						 .label->data.label.text->data
-						 .text.text);
-					free(ctx->root_widget->data.button
-						 .label->data.label.text);
-				}
-				free(ctx->root_widget->data.button.label);
-			}
-		} else if (ctx->root_widget->type == BGTK_WIDGET_TEXT) {
-			free(ctx->root_widget->data.text.text);
-		}
-		free(ctx->root_widget);
-	}
+	// Startup workers still write into fonts and widgets
+	startup_free(ctx);
 
-	// Free FreeType resources
-	if (ctx->ft_face) {
-		FT_Done_Face(ctx->ft_face);
-	}
-	if (ctx->ft_library) {
-		FT_Done_FreeType(ctx->ft_library);
+	// Layers point back at their widgets
+	layers_free(ctx);
+
+	widget_free(ctx->root_widget);
+
+	mem_free(ctx, ctx->layout_queue);
+	raster_free(ctx);
+	display_list_free(ctx->display_list);
+	display_list_free(ctx->prev_display_list);
+	present_free(ctx);
+	fonts_free(ctx);
+	frame_stats_free(ctx);
+	if (ctx->headless) {
+		mem_free(ctx, ctx->shm_buffer);
 	}
+	memory_free(ctx);
 
 	free(ctx);
+
+	// Every thread that recorded events is joined by now
+	trace_shutdown();
 }
 
 // --- Drawing Primitives & Widgets ---
 
 void bgtk_draw_widgets(struct BGTK_Context* ctx) {
-	puts("got draw widgets request");
-	clear_buffer(ctx);
-	calculate_widget_size(ctx, ctx->root_widget);
-	draw_widget(ctx, ctx->root_widget, ctx->shm_buffer);
-	bgce_draw(ctx->conn_fd);
+	BGTK_TRACE_SCOPE("draw_widgets");
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "got draw widgets request");
+
+	// The first frame ends the startup timeline
+	int first = ctx->frame_count == 0;
+	int id = first ? startup_begin(ctx, "first layout", NULL) : -1;
+	present_resize(ctx);
+	layout_widgets(ctx);
+	startup_end(ctx, id);
+	id = first ? startup_begin(ctx, "first paint", NULL) : -1;
+	render_frame(ctx, 1);
+	startup_end(ctx, id);
+	id = first ? startup_begin(ctx, "first present", NULL) : -1;
+	bgtk_present(ctx);
+	startup_end(ctx, id);
 }
 
-// TODO: implement descending into child widgets
-int bgtk_handle_input_event(struct BGTK_Context* ctx, struct InputEvent ev) {
-	// Handle mouse wheel for scrolling (REL_WHEEL)
-	if (ev.code == REL_WHEEL) {
-		printf("handling mouse wheel: val=%d at (%u, %u)\n", ev.value,
-		       ev.x, ev.y);
-		struct BGTK_Widget* w = ctx->root_widget;
-
-		// TODO: descend to the last scrollable widget
-		// while (1) {
-		if (w->type == BGTK_WIDGET_SCROLLABLE) {
-			puts("found scroll widget");
-
-			// Check if mouse is over the scrollable
-			// widget
-			if (ev.x >= w->x && ev.x < (w->x + w->w) &&
-			    ev.y >= w->y && ev.y < (w->y + w->h)) {
-				puts("updating scroll");
-				w->data.scrollable.scroll_y -=
-				    ev.value * 10;  // Scroll speed
-
-				// Clamp scroll_y to valid range
-				if (w->data.scrollable.scroll_y < 0) {
-					w->data.scrollable.scroll_y = 0;
-				}
-				if (w->data.scrollable.scroll_y >
-				    w->data.scrollable.content_height - w->h) {
-					w->data.scrollable.scroll_y =
-					    w->data.scrollable.content_height -
-					    w->h;
-				}
-				if (w->data.scrollable.scroll_y < 0) {
-					w->data.scrollable.scroll_y = 0;
-				}
-				printf(
-				    "updated scroll position: "
-				    "%d\n",
-				    w->data.scrollable.scroll_y);
-				draw_widget(ctx, w, ctx->shm_buffer);
+// Brings the screen up to date after a mutation, or leaves that to the
+// end of the current transaction. Mutations made during layout are
+// already part of the frame being built.
+void request_frame(struct BGTK_Context* ctx) {
+	if (ctx->in_layout) {
+		return;
+	}
+	if (ctx->update_depth > 0) {
+		ctx->update_pending = 1;
+		return;
+	}
+	int resized = present_resize(ctx);
+	layout_widgets(ctx);
+	render_frame(ctx, resized);
+}
+
+void bgtk_begin_update(struct BGTK_Context* ctx) {
+	ctx->update_depth++;
+}
 
-				return 1;  // Redraw
+void bgtk_end_update(struct BGTK_Context* ctx) {
+	if (ctx->update_depth == 0) {
+		fprintf(stderr, "BGTK end_update without begin_update\n");
+		return;
+	}
+	if (--ctx->update_depth > 0 || !ctx->update_pending) {
+		return;
+	}
+	ctx->update_pending = 0;
+	int resized = present_resize(ctx);
+	layout_widgets(ctx);
+	render_frame(ctx, resized);
+	bgtk_present(ctx);
+}
+
+// Finds the innermost scrollable or list under (px, py), which are in
+// the coordinate space of w's parent.
+static struct BGTK_Widget* wheel_target(struct BGTK_Widget* w, int px,
+					int py) {
+	struct BGTK_Widget* target = NULL;
+	while (w && px >= w->x && px < (w->x + w->w) && py >= w->y &&
+	       py < (w->y + w->h)) {
+		struct BGTK_Widget** items;
+		int count;
+		switch (w->type) {
+			case BGTK_WIDGET_SCROLLABLE:
+				// Children are laid out in content coordinates
+				target = w;
+				px -= w->x;
+				py += w->data.scrollable.scroll_y - w->y;
+				items = w->data.scrollable.widgets;
+				count = w->data.scrollable.widget_count;
+				break;
+			case BGTK_WIDGET_LIST:
+				target = w;
+				px -= w->x;
+				py += w->data.list.scroll_y - w->y;
+				items = w->data.list.rows;
+				count = w->data.list.row_count;
+				break;
+			case BGTK_WIDGET_BOX:
+				items = w->data.box.widgets;
+				count = w->data.box.widget_count;
+				break;
+			default:
+				return target;
+		}
+
+		// Descend into the child under the pointer, if any
+		struct BGTK_Widget* parent = w;
+		w = NULL;
+		for (int i = 0; i < count; i++) {
+			struct BGTK_Widget* item = items[i];
+			if (parent->type == BGTK_WIDGET_LIST &&
+			    parent->data.list.row_items[i] < 0) {
+				continue;
 			}
+			if (px >= item->x && px < (item->x + item->w) &&
+			    py >= item->y && py < (item->y + item->h)) {
+				w = item;
+				break;
+			}
+		}
+	}
+	return target;
+}
+
+// Routes an input event to the widget under the pointer.
+static int dispatch_event(struct BGTK_Context* ctx, struct InputEvent ev) {
+	// Mouse wheel scrolls the innermost scrollable under the pointer
+	if (ev.code == REL_WHEEL) {
+		BGTK_LOG(BGTK_LEVEL_DEBUG,
+			 "handling mouse wheel: val=%d at (%u, %u)", ev.value,
+			 ev.x, ev.y);
+		struct BGTK_Widget* w =
+		    wheel_target(ctx->root_widget, ev.x, ev.y);
+		if (!w) {
+			return 0;
+		}
+		if (w->type == BGTK_WIDGET_LIST) {
+			return list_wheel(w, ev.value);
 		}
-		//}
+		w->data.scrollable.scroll_y -= ev.value * 10;  // Scroll speed
+		scroll_clamp(w);
+		BGTK_LOG(BGTK_LEVEL_DEBUG, "updated scroll position: %d",
+			 w->data.scrollable.scroll_y);
+		request_frame(ctx);
+		return 1;  // Redraw
 	}
 
 	// Only handle mouse button presses for now
 	if (ev.code != BTN_LEFT || ev.value != 1) {
 		return 0;
 	}
-	printf("BGTK Got click: (%d, %d)\n", ev.x, ev.y);
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "got click: (%d, %d)", ev.x, ev.y);
 
-	// Hit-testing for buttons
+	// Hit-testing for buttons, px/py are in the coordinate space of
+	// the current widget's parent
+	int px = ev.x;
+	int py = ev.y;
 	struct BGTK_Widget* w = ctx->root_widget;
 	while (w) {
 		switch (w->type) {
 			case BGTK_WIDGET_BUTTON:
 				// Check if click coordinates
 				// are within button bounds
-				if (ev.x >= w->x && ev.x < (w->x + w->w) &&
-				    ev.y >= w->y && ev.y < (w->y + w->h)) {
-					printf("BGTK Clicked in button\n");
+				if (px >= w->x && px < (w->x + w->w) &&
+				    py >= w->y && py < (w->y + w->h)) {
+					BGTK_LOG(BGTK_LEVEL_DEBUG,
+						 "clicked in button");
 
-					// Trigger callback
+					// Trigger callback, everything it
+					// changes lands in one frame
 					if (w->data.button.callback) {
+						bgtk_begin_update(ctx);
 						w->data.button.callback();
+						bgtk_end_update(ctx);
 						return 1;
 					}
 				}
 				return 0;
 			case BGTK_WIDGET_SCROLLABLE: {
-				printf("clicked in a scrollable widget\n");
+				BGTK_LOG(BGTK_LEVEL_DEBUG,
+					 "clicked in a scrollable widget");
+
+				// Children are laid out in content coordinates
+				px -= w->x;
+				py += w->data.scrollable.scroll_y - w->y;
 				int found = 0;
 				for (int i = 0;
 				     i < w->data.scrollable.widget_count; i++) {
 					struct BGTK_Widget* item =
 					    w->data.scrollable.widgets[i];
-					if (ev.x >= item->x &&
-					    ev.x < (item->x + item->w) &&
-					    ev.y >= item->y &&
-					    ev.y < (item->y + item->h)) {
-						printf(
-						    "clicked in the %d item\n",
-						    i);
+					if (px >= item->x &&
+					    px < (item->x + item->w) &&
+					    py >= item->y &&
+					    py < (item->y + item->h)) {
+						BGTK_LOG(BGTK_LEVEL_DEBUG,
+							 "clicked in the %d item",
+							 i);
+						w = item;
+						found = 1;
+						break;
+					}
+				}
+				if (!found) {
+					return 0;
+				}
+				break;
+			}
+			case BGTK_WIDGET_LIST: {
+				// Only bound rows are laid out, in content
+				// coordinates like a scrollable's children
+				px -= w->x;
+				py += w->data.list.scroll_y - w->y;
+				struct BGTK_Widget* hit = NULL;
+				for (int i = 0; i < w->data.list.row_count;
+				     i++) {
+					struct BGTK_Widget* row =
+					    w->data.list.rows[i];
+					if (w->data.list.row_items[i] >= 0 &&
+					    px >= row->x &&
+					    px < (row->x + row->w) &&
+					    py >= row->y &&
+					    py < (row->y + row->h)) {
+						hit = row;
+						break;
+					}
+				}
+				if (!hit) {
+					return 0;
+				}
+				w = hit;
+				break;
+			}
+			case BGTK_WIDGET_BOX: {
+				int found = 0;
+				for (int i = 0; i < w->data.box.widget_count;
+				     i++) {
+					struct BGTK_Widget* item =
+					    w->data.box.widgets[i];
+					if (px >= item->x &&
+					    px < (item->x + item->w) &&
+					    py >= item->y &&
+					    py < (item->y + item->h)) {
 						w = item;
 						found = 1;
 						break;
@@ -218,9 +343,25 @@ int bgtk_handle_input_event(struct BGTK_Context* ctx, struct InputEvent ev) {
 				break;
 			}
 			default:
-				printf("clicked on a widget without action\n");
+				BGTK_LOG(BGTK_LEVEL_DEBUG,
+					 "clicked on a widget without action");
 				return 0;
 		}
 	}
 	return 0;
 }
+
+int bgtk_handle_input_event(struct BGTK_Context* ctx, struct InputEvent ev) {
+	return bgtk_handle_input_event_at(ctx, ev, now_ns());
+}
+
+int bgtk_handle_input_event_at(struct BGTK_Context* ctx, struct InputEvent ev,
+			       uint64_t received_ns) {
+	BGTK_TRACE_SCOPE("input_event");
+	struct Frame_Mark mark = frame_phase_begin(ctx);
+	frame_input(ctx, received_ns);
+	int redraw = dispatch_event(ctx, ev);
+	frame_input_done(ctx, received_ns, redraw);
+	frame_phase_end(ctx, BGTK_PHASE_EVENT, mark);
+	return redraw;
+}
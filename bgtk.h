@@ -4,26 +4,183 @@
 #include <ft2build.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include FT_FREETYPE_H
 #include <bgce.h>
 
 // Function pointer for button callbacks
 typedef void (*BGTK_Callback)(void);
 
+// BGTK_Rect: Axis-aligned rectangle in pixels
+struct BGTK_Rect {
+	int x, y, w, h;
+};
+
+// BGTK_Pixel_Format: How a surface stores its pixels. Names give the
+// channels from the most to the least significant bit of a pixel.
+enum BGTK_Pixel_Format {
+	BGTK_FORMAT_ARGB8888,  // The default
+	BGTK_FORMAT_XRGB8888,  // No alpha, reads as opaque
+	BGTK_FORMAT_ABGR8888,  // Bytes R, G, B, A, as decoded images
+	BGTK_FORMAT_RGB565,
+	BGTK_FORMATS
+};
+
+// BGTK_Blend_Mode: How a widget is composited onto what is behind it.
+// Pixels are premultiplied by their alpha.
+enum BGTK_Blend_Mode {
+	BGTK_BLEND_SRC_OVER,  // The default, translucent parts show through
+	BGTK_BLEND_COPY,      // Replaces what is behind, alpha included
+	BGTK_BLEND_ADD,	      // Sums the channels, saturating
+	BGTK_BLEND_MULTIPLY,  // Darkens by the widget's colors
+	BGTK_BLENDS
+};
+
+// BGTK_Surface: A pixel buffer the renderer draws into, premultiplied
+struct BGTK_Surface {
+	void* pixels;
+	int format;  // BGTK_Pixel_Format
+	int width;
+	int height;
+	int stride;  // Pixels per row
+	struct BGTK_Rect clip;	// Drawing is limited to this, zero = whole
+};
+
+// Paint modes
+#define BGTK_PAINT_IMMEDIATE 0  // Walk the tree and draw on the UI thread
+#define BGTK_PAINT_TILED 1      // Rasterize tiles in parallel on a pool
+
+// BGTK_Present_Stats: Timings of frames handed to the server
+struct BGTK_Present_Stats {
+	uint64_t frames;
+	uint64_t copied_pixels;	 // Pixels copied from the back buffer
+	uint64_t last_stall_ns;	 // Time spent in bgce_draw
+	uint64_t max_stall_ns;
+	uint64_t total_stall_ns;
+};
+
+// BGTK_Frame_Histogram: Distribution of one frame phase, in nanoseconds
+struct BGTK_Frame_Histogram {
+	uint64_t min;
+	uint64_t avg;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
+// BGTK_Frame_Stats: Where the time of the most recent frames went. A frame
+// ends at bgtk_present() and each phase is charged only its own time.
+struct BGTK_Frame_Stats {
+	uint64_t frames;  // Frames finished since bgtk_init
+	int samples;	  // Recent frames the histograms cover
+	struct BGTK_Frame_Histogram event;    // Input dispatch and callbacks
+	struct BGTK_Frame_Histogram layout;   // Measure and arrange
+	struct BGTK_Frame_Histogram raster;   // Record, diff and paint
+	struct BGTK_Frame_Histogram scroll;   // Scroll content and its copy
+	struct BGTK_Frame_Histogram present;  // Copy out and bgce_draw
+	struct BGTK_Frame_Histogram total;    // First phase to present
+
+	// Input receive to the return of bgce_draw, for the frames that
+	// answered input
+	int latency_samples;
+	struct BGTK_Frame_Histogram latency;
+};
+
+// Kinds of memory BGTK accounts for
+enum BGTK_Memory_Category {
+	BGTK_MEM_WIDGETS,  // Widget structs and child arrays
+	BGTK_MEM_STRINGS,  // Text, pen positions and paths
+	BGTK_MEM_IMAGES,   // Decoded image pixels
+	BGTK_MEM_SCROLL,   // Off-screen content of scrollables
+	BGTK_MEM_GLYPHS,   // Rendered glyph caches
+	BGTK_MEM_LAYERS,   // Retained widget layers
+	BGTK_MEM_ARENAS,   // Display lists, raster bins and the layout queue
+	BGTK_MEM_BUFFERS,  // The back buffer, and the front one when headless
+	BGTK_MEM_CATEGORIES,
+};
+
+// BGTK_Memory_Stats: Bytes held per category now, at most since bgtk_init,
+// in how many blocks, and the budget (0 = none)
+struct BGTK_Memory_Stats {
+	size_t bytes[BGTK_MEM_CATEGORIES];
+	size_t peak[BGTK_MEM_CATEGORIES];
+	size_t blocks[BGTK_MEM_CATEGORIES];
+	size_t budget[BGTK_MEM_CATEGORIES];
+	size_t total;
+	size_t limit;	      // Cap on the total, 0 = none
+	size_t cached;	      // Part of the total caches could give back
+	uint64_t evictions;  // Cache entries evicted since bgtk_init
+};
+
+// Low-memory hints for bgtk_memory_pressure()
+enum BGTK_Memory_Pressure {
+	BGTK_MEMORY_PRESSURE_NONE,
+	BGTK_MEMORY_PRESSURE_MODERATE,	// Give back about half of the caches
+	BGTK_MEMORY_PRESSURE_CRITICAL,	// Give back everything that can be
+};
+
 // BGTK_Context: Holds the state of the BGTK application
 struct BGTK_Context {
 	int conn_fd;  // File descriptor for BGCE connection
 	void* shm_buffer;
+	int headless;  // No server, shm_buffer is owned by the context
 	int width;
 	int height;
+	int format;  // BGTK_Pixel_Format of shm_buffer and all drawing
+
+	// Buffers and size of the last bgtk_resize(), switched to at the
+	// next frame so a burst of resizes costs one relayout
+	void* resize_buffer;
+	void* resize_back;  // Allocated up front, the switch cannot fail
+	int resize_width;
+	int resize_height;
+	int resize_pending;  // bgtk_resize() calls since the last switch
 
-	// FreeType data
-	FT_Library ft_library;
-	FT_Face ft_face;
-	int font_size;
+	// Private back buffer, the server only sees it after a present
+	struct BGTK_Surface back_buffer;
+	struct BGTK_Rect damage;  // Region changed since the last present
+	struct BGTK_Present_Stats present_stats;
+	struct BGTK_Frame_Ring* frame_ring;  // Timings of recent frames
+	struct BGTK_Memory* memory;	     // Allocation accounting
+
+	// Opened faces and sizes, and the font of widgets without one
+	struct BGTK_Font_Registry* fonts;
+	struct BGTK_Font* font;
+
+	// Rasterization
+	int paint_mode;	   // BGTK_PAINT_IMMEDIATE or BGTK_PAINT_TILED
+	int raster_threads;  // Workers used in tiled mode, 0 = one per CPU
+	struct BGTK_Raster_Pool* raster_pool;
+
+	// Display lists of the current and the previous frame
+	struct BGTK_Display_List* display_list;
+	struct BGTK_Display_List* prev_display_list;
+	unsigned long frame_count;
+
+	// Retained widget layers, most recently used first
+	struct BGTK_Layer* layers;
+	size_t layer_bytes;
+	size_t layer_budget;  // Cap on layer pixel memory
 
 	// Single root widget for the widget tree
 	struct BGTK_Widget* root_widget;
+
+	// Relayout boundaries waiting for the next layout pass
+	struct BGTK_Widget** layout_queue;
+	int layout_count;
+	int layout_capacity;
+
+	// Open bgtk_begin_update() calls, and whether a mutation inside
+	// them is waiting for the frame at the outermost bgtk_end_update()
+	int update_depth;
+	int update_pending;
+
+	// Set while layout_widgets() runs; mutations made by layout itself
+	// (list row binding) land in the frame being laid out
+	int in_layout;
+
+	// Timeline of startup work and the background tasks doing it
+	struct BGTK_Startup* startup;
 };
 
 // BGTK_Widget_Type
@@ -33,27 +190,70 @@ enum BGTK_Widget_Type {
 	BGTK_WIDGET_TEXT,
 	BGTK_WIDGET_SCROLLABLE,
 	BGTK_WIDGET_IMAGE,
+	BGTK_WIDGET_BOX,
+	BGTK_WIDGET_LIST,
 	// Add more types as needed
 };
 
 // Widget flags
 #define BGTK_FLAG_CENTER (1 << 0)  // Center widgets horizontally
+#define BGTK_FLAG_FIXED_SIZE (1 << 1)  // Size is set by the app (relayout boundary)
+#define BGTK_FLAG_LAYER (1 << 2)  // Keep the rendered widget in its own layer
+
+// Box orientations
+#define BGTK_BOX_VERTICAL 0
+#define BGTK_BOX_HORIZONTAL 1
+
+// BGTK_List_Source: Where a virtualized list gets its rows from. Only the
+// visible rows and a few around them exist as widgets, they are reused for
+// other items as the list scrolls.
+struct BGTK_List_Source {
+	int count;	 // Number of items
+	int row_height;	 // Height of every row, 0 to ask height()
+	int (*height)(int index, void* user);
+	// Makes an empty row widget, NULL for labels
+	struct BGTK_Widget* (*create)(struct BGTK_Context* ctx, void* user);
+	// Shows item index in a row made by create(), e.g. with bgtk_set_text()
+	void (*bind)(struct BGTK_Widget* row, int index, void* user);
+	void* user;  // Passed to the callbacks
+};
 
 // BGTK_Options: Options for widget creation (replaces flags).
 typedef struct {
 	int flags;      // Flags for widget behavior (e.g., BGTK_FLAG_CENTER).
 	int padding;   // Internal spacing (pixels).
 	int margin;    // External spacing (pixels).
+	int flex;      // Share of the free space in a box (0 = natural size).
+	struct BGTK_Font* font;  // Font for text, NULL for the context default.
 } BGTK_Options;
 
 // BGTK_Widget: Base structure for all widgets
 struct BGTK_Widget {
 	struct BGTK_Context* ctx;
+	struct BGTK_Widget* parent;  // Containing widget, NULL for the root
 	enum BGTK_Widget_Type type;
 	int x, y, w, h;	 // Absolute position and size
 	int flags;	 // Flags for widget behavior
 	int padding;      // Internal spacing (pixels)
 	int margin;       // External spacing (pixels)
+	int flex;	  // Share of the free space in a box
+	int opacity;	  // 0 (hidden) to 255, fades the whole subtree
+	int blend;	  // BGTK_Blend_Mode onto what is behind
+	struct BGTK_Font* font;  // Font for text, NULL for the context default
+	int needs_layout;  // Size must be recomputed in the next layout pass
+	struct BGTK_Layer* layer;  // Retained rendering, NULL if none
+	int stable_frames;  // Frames painted since the content last changed
+	int layer_refused;  // Content overflows the box, cannot be layered
+
+	// Last measure result, keyed on the constraints it was computed for
+	struct {
+		int valid;
+		int max_w, max_h;
+		int w, h;
+	} measured;
+
+	// Replaces the text of a label widget
+	void (*set_label)(struct BGTK_Widget* widget, char* label);
 
 	// Union for specific widget data
 	union {
@@ -66,6 +266,11 @@ struct BGTK_Widget {
 		} button;
 		struct {
 			char* text;
+			int length;	// Bytes in text
+			int capacity;	// Bytes allocated for text and spare
+			int* pen;	// Pen x before each glyph, 26.6 units
+			int pen_valid;	// Bytes the pen is computed for
+			char* spare;	// Formatting buffer of bgtk_set_textf
 		} text;
 		struct {
 			struct BGTK_Widget** widgets;  // List of child widgets
@@ -74,12 +279,41 @@ struct BGTK_Widget {
 			int scroll_y;	     // Current scroll position
 			int content_height;  // Total height of all
 					     // child widgets
-			uint32_t* tmp;	     // off-screen buffer
+			void* tmp;	     // off-screen buffer
+			int tmp_valid;	     // tmp holds the current content
+			unsigned tmp_version;  // Bumped each time tmp is redrawn
+			unsigned long tmp_used;  // Frame tmp was last shown in
+			int content_width;  // Width the children were laid
+					    // out for
 		} scrollable;
 		struct {
-			uint32_t* pixels;  // Pixel buffer (RGBA)
+			struct BGTK_Widget** widgets;  // List of child widgets
+			int widget_count;
+			int orientation;  // BGTK_BOX_VERTICAL or _HORIZONTAL
+		} box;
+		struct {
+			struct BGTK_List_Source source;
+			int* offsets;  // Item tops and the end, NULL with a
+				       // fixed row height
+			int scroll_y;
+			int content_height;
+			struct BGTK_Widget** rows;  // Pool of row widgets
+			int* row_items;	 // Item each row shows, -1 if free
+			int row_count;
+			int row_capacity;
+			int first, last;  // Items [first, last) have rows
+			void* tmp;	  // The bound rows, drawn off-screen
+			int tmp_valid;
+			unsigned tmp_version;
+			unsigned long tmp_used;
+		} list;
+		struct {
+			uint32_t* pixels;  // Pixel buffer (BGTK_FORMAT_ABGR8888)
 			int img_w;	   // Image width
 			int img_h;	   // Image height
+			int opaque;	   // No pixel has alpha below 0xFF
+			char* path;	   // Set until the decode is waited on
+			struct BGTK_Task* decode;
 		} image;
 	} data;
 };
@@ -89,9 +323,152 @@ struct BGTK_Widget {
 // Initializes BGTK with given dimensions.
 struct BGTK_Context* bgtk_init(int conn_fd, void* buffer, int width, int height);
 
-// Handles a single event and returns whether a redraw is needed.
+// Initializes BGTK without a server, drawing into a buffer it allocates.
+// Presenting only updates that buffer, so frames can be dumped with
+// bgtk_write_ppm()/bgtk_write_png() and driven with bgtk_inject_*().
+struct BGTK_Context* bgtk_init_headless(int width, int height);
+
+// Frees the context and its widget tree.
+void bgtk_destroy(struct BGTK_Context* ctx);
+
+// Runs a layout pass over dirty widgets, paints and presents the frame.
+void bgtk_draw_widgets(struct BGTK_Context* ctx);
+
+// Writes the startup timeline (bgtk_init, font and image loading, the
+// first frame) to out.
+void bgtk_dump_startup(struct BGTK_Context* ctx, FILE* out);
+
+// Returns a font handle for the face at path (NULL for the default face) at
+// the given pixel size. Each face and size is opened once per context, and
+// the handle stays valid until bgtk_destroy(). Returns NULL on failure.
+struct BGTK_Font* bgtk_font(struct BGTK_Context* ctx, const char* path,
+			    int pixel_size);
+
+// Groups widget mutations into one frame. Inside a transaction mutations
+// only record what they invalidated; the outermost bgtk_end_update() runs a
+// single layout, paint and present. Calls nest.
+void bgtk_begin_update(struct BGTK_Context* ctx);
+void bgtk_end_update(struct BGTK_Context* ctx);
+
+// Copies the damaged region of the back buffer to the shared buffer and
+// notifies the server. Does nothing if nothing changed.
+void bgtk_present(struct BGTK_Context* ctx);
+
+// Switches to a new shared buffer of the given size, after the server sent
+// MSG_BUFFER_CHANGE. The old buffer is no longer written once this returns
+// 1. The switch happens at the next frame, so only the last of several calls
+// between presents is laid out. Headless contexts pass NULL and reallocate
+// their own buffer. Returns 1 as a frame is needed, -1 on a bad size or if
+// the new back buffer cannot be allocated; the old buffer then stays in use
+// and must be kept mapped.
+int bgtk_resize(struct BGTK_Context* ctx, void* buffer, int width,
+		int height);
+
+// Sets the pixel format the server buffer is in, which all drawing then
+// uses too. Must be called before the first frame. Returns 0 on success,
+// -1 on an unknown format or once a frame was drawn.
+int bgtk_set_pixel_format(struct BGTK_Context* ctx, int format);
+
+// Selects how frames are rasterized. In BGTK_PAINT_TILED mode the frame is
+// split into tiles painted by `threads` workers (0 = one per CPU).
+void bgtk_set_paint_mode(struct BGTK_Context* ctx, int mode, int threads);
+
+// Marks a widget whose content or style changed, so cached renderings of
+// it and its ancestors are redrawn.
+void bgtk_invalidate_paint(struct BGTK_Widget* w);
+
+// Caps the memory used by retained widget layers; least recently used
+// layers are dropped to stay under it.
+void bgtk_set_layer_budget(struct BGTK_Context* ctx, size_t bytes);
+
+// Memory held by BGTK per category. Safe to call from any thread as long as
+// no budget or limit is being changed at the same time.
+struct BGTK_Memory_Stats bgtk_get_memory_stats(struct BGTK_Context* ctx);
+
+// Bytes held by a widget and its subtree: structs, strings, pixels,
+// scroll content and layers.
+size_t bgtk_widget_memory(struct BGTK_Widget* w);
+
+// Writes the per-category totals and the largest widgets to out.
+void bgtk_memory_report(struct BGTK_Context* ctx, FILE* out);
+
+// Caps a category, 0 removes the cap. Caches over their cap are trimmed
+// between frames: rendered glyphs are dropped and layers are evicted least
+// recently used first. Other categories are only reported against it.
+void bgtk_set_memory_budget(struct BGTK_Context* ctx,
+			    enum BGTK_Memory_Category category, size_t bytes);
+
+// Caps the memory of the whole context, 0 removes the cap (the default, or
+// BGTK_MEMORY_LIMIT_MB). Over it, the least valuable entries of all caches
+// (glyphs, layers and scroll contents) are evicted between frames, weighing
+// what an entry costs to rebuild against how long it went unused.
+void bgtk_set_memory_limit(struct BGTK_Context* ctx, size_t bytes);
+
+// Tells BGTK the system is low on memory. Cache entries are evicted right
+// away, least valuable first, and are rebuilt when next drawn. Call from
+// the UI thread.
+void bgtk_memory_pressure(struct BGTK_Context* ctx, int level);
+
+// Writes the commands recorded for the last frame, with their pixel cost,
+// to out.
+void bgtk_dump_display_list(struct BGTK_Context* ctx, FILE* out);
+
+// Writes the scoped events recorded so far as Chrome trace JSON (load it in
+// chrome://tracing or ui.perfetto.dev). Recording is enabled by setting
+// BGTK_TRACE=<file>, which bgtk_destroy() writes the trace to.
+void bgtk_dump_trace(FILE* out);
+
+// Returns the accumulated presentation timings.
+struct BGTK_Present_Stats bgtk_get_present_stats(struct BGTK_Context* ctx);
+
+// Returns timing histograms of the last 256 frames. Safe to call from any
+// thread while the UI thread keeps drawing.
+struct BGTK_Frame_Stats bgtk_get_frame_stats(struct BGTK_Context* ctx);
+
+// Handles a single event and returns whether a redraw is needed. The
+// event's latency is counted from the call.
 int bgtk_handle_input_event(struct BGTK_Context* ctx, struct InputEvent ev);
 
+// The same, for an event received earlier, at received_ns on the
+// CLOCK_MONOTONIC clock (e.g. when it sat in the app's own queue).
+int bgtk_handle_input_event_at(struct BGTK_Context* ctx, struct InputEvent ev,
+			       uint64_t received_ns);
+
+// Logs frames whose input latency exceeds ns, 0 turns it off. The
+// BGTK_LATENCY_BUDGET_MS environment variable sets it at startup.
+void bgtk_set_latency_budget(struct BGTK_Context* ctx, uint64_t ns);
+
+// Feed synthetic input as if it came from the server, presenting when the
+// event changed something. Return whether it did.
+int bgtk_inject_event(struct BGTK_Context* ctx, struct InputEvent ev);
+int bgtk_inject_click(struct BGTK_Context* ctx, int x, int y);
+int bgtk_inject_scroll(struct BGTK_Context* ctx, int x, int y, int delta);
+
+// Write the last presented frame as binary PPM or as an 8-bit RGB PNG.
+// Return 0 on success, -1 on failure.
+int bgtk_write_ppm(struct BGTK_Context* ctx, const char* path);
+int bgtk_write_png(struct BGTK_Context* ctx, const char* path);
+
+// Marks a widget whose size-affecting properties changed. Ancestors are
+// marked up to the nearest relayout boundary, so the next layout pass only
+// visits the affected subtree.
+void bgtk_invalidate_layout(struct BGTK_Widget* w);
+
+// Replaces the string shown by a label, button or text widget in place and
+// repaints only the glyphs that changed. The widget's storage is reused, so
+// updates that fit in it do not allocate.
+void bgtk_set_text(struct BGTK_Widget* widget, const char* text);
+void bgtk_set_textf(struct BGTK_Widget* widget, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Fades a widget and its children, from 0 (invisible) to 255 (opaque, the
+// default). Labels and buttons fade as a whole through a layer.
+void bgtk_set_opacity(struct BGTK_Widget* w, int opacity);
+
+// Sets how a widget and its children are composited onto what is behind
+// them, one of BGTK_Blend_Mode.
+void bgtk_set_blend_mode(struct BGTK_Widget* w, int mode);
+
 // --- Widget Creation Functions ---
 // Creates a label widget.
 struct BGTK_Widget* bgtk_label(struct BGTK_Context* ctx, char* text, BGTK_Options options);
@@ -106,4 +483,29 @@ struct BGTK_Widget* bgtk_scrollable(struct BGTK_Context* ctx, struct BGTK_Widget
 // Creates an image widget.
 struct BGTK_Widget* bgtk_image(struct BGTK_Context* ctx, const char* path, BGTK_Options options);
 
+// Creates a scrolling list of source->count items that only builds widgets
+// for the rows in view, binding them to items as it scrolls. Returns NULL
+// if the rows add up to more than INT_MAX pixels.
+struct BGTK_Widget* bgtk_list(struct BGTK_Context* ctx, const struct BGTK_List_Source* source, BGTK_Options options);
+
+// Changes the number of items, all rows are bound again. A count whose rows
+// would add up to more than INT_MAX pixels is refused.
+void bgtk_list_set_count(struct BGTK_Widget* list, int count);
+
+// Binds the rows in view again after the items changed.
+void bgtk_list_refresh(struct BGTK_Widget* list);
+
+// Scrolls so that item index is at the top, as far as the content allows.
+void bgtk_list_scroll_to(struct BGTK_Widget* list, int index);
+
+// Creates a container that stacks its children along one axis. Children with
+// a non-zero flex share the space left over after natural sizes.
+struct BGTK_Widget* bgtk_box(struct BGTK_Context* ctx, int orientation,
+			     struct BGTK_Widget** items, int widget_count,
+			     BGTK_Options options);
+struct BGTK_Widget* bgtk_vbox(struct BGTK_Context* ctx, struct BGTK_Widget** items,
+			      int widget_count, BGTK_Options options);
+struct BGTK_Widget* bgtk_hbox(struct BGTK_Context* ctx, struct BGTK_Widget** items,
+			      int widget_count, BGTK_Options options);
+
 #endif
@@ -0,0 +1,956 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Glyph runs gathered into one batch by the executor
+#define GLYPH_BATCH 32
+
+// Limits of the occlusion pass: opaque rectangles tracked, and pieces a
+// partly covered fill may be split into
+#define MAX_OCCLUDERS 32
+#define MAX_FRAGMENTS 64
+
+// Commands the diff looks ahead to pair up the same widget again after one
+// frame recorded more commands than the other
+#define DIFF_LOOKAHEAD 16
+
+static void display_list_reset(struct BGTK_Display_List* list) {
+	list->count = 0;
+	list->text_length = 0;
+	list->exec_count = 0;
+	list->opacity = 0xFF;
+	list->blend = BGTK_BLEND_SRC_OVER;
+	list->owner = NULL;
+	list->shadow = 0;
+	atomic_store_explicit(&list->copy_ns, 0, memory_order_relaxed);
+}
+
+// Frees the arrays of a list, not the list itself.
+static void display_list_release(struct BGTK_Display_List* list) {
+	mem_free(list->ctx, list->commands);
+	mem_free(list->ctx, list->text);
+	mem_free(list->ctx, list->exec);
+}
+
+void display_list_free(struct BGTK_Display_List* list) {
+	if (!list) {
+		return;
+	}
+	display_list_release(list);
+	free(list);
+}
+
+// Appends a zeroed command, or returns NULL if the list cannot grow.
+static struct BGTK_Command* push_command(struct BGTK_Display_List* list) {
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? list->capacity * 2 : 64;
+		struct BGTK_Command* commands =
+		    mem_realloc(list->ctx, BGTK_MEM_ARENAS, list->commands,
+				capacity * sizeof(struct BGTK_Command));
+		if (!commands) {
+			perror("realloc");
+			return NULL;
+		}
+		list->commands = commands;
+		list->capacity = capacity;
+	}
+	struct BGTK_Command* c = &list->commands[list->count++];
+	memset(c, 0, sizeof(*c));
+	c->owner = list->owner;
+	c->shadow = list->shadow;
+	return c;
+}
+
+// Scales the alpha of a straight 0xAARRGGBB color by the list's opacity.
+static uint32_t fade_color(struct BGTK_Display_List* list, uint32_t color) {
+	if (list->opacity == 0xFF) {
+		return color;
+	}
+	uint32_t alpha = ((color >> 24) * list->opacity + 127) / 255;
+	return alpha << 24 | (color & 0xFFFFFF);
+}
+
+static void record_fill(struct BGTK_Display_List* list, int x, int y, int w,
+			int h, uint32_t color) {
+	if (w <= 0 || h <= 0) {
+		return;
+	}
+	struct BGTK_Command* c = push_command(list);
+	if (!c) {
+		return;
+	}
+	c->type = BGTK_CMD_FILL_RECT;
+	c->bounds = (struct BGTK_Rect){x, y, w, h};
+	c->color = fade_color(list, color);
+	c->blend = list->blend;
+	c->opaque = c->blend == BGTK_BLEND_COPY ||
+		    (c->blend == BGTK_BLEND_SRC_OVER && (c->color >> 24) == 0xFF);
+}
+
+static void record_glyphs(struct BGTK_Display_List* list,
+			  struct BGTK_Font* font, const char* text, int x,
+			  int y, uint32_t color) {
+	int length = strlen(text);
+	if (list->text_length + length + 1 > list->text_capacity) {
+		int capacity = list->text_capacity ? list->text_capacity : 256;
+		while (capacity < list->text_length + length + 1) {
+			capacity *= 2;
+		}
+		char* grown = mem_realloc(list->ctx, BGTK_MEM_ARENAS,
+					  list->text, capacity);
+		if (!grown) {
+			perror("realloc");
+			return;
+		}
+		list->text = grown;
+		list->text_capacity = capacity;
+	}
+
+	struct BGTK_Command* c = push_command(list);
+	if (!c) {
+		return;
+	}
+	c->type = BGTK_CMD_GLYPH_RUN;
+	font->last_used = list->ctx->frame_count;
+	c->bounds = text_bounds(font, text, length, x, y);
+	c->color = fade_color(list, color);
+	c->blend = list->blend;
+	c->font = font;
+	c->x = x;
+	c->y = y;
+	c->text = list->text_length;
+	c->length = length;
+	memcpy(list->text + list->text_length, text, length + 1);
+	list->text_length += length + 1;
+}
+
+// Records a blit of a w x h block of src at (sx, sy) to (x, y).
+void record_blit(struct BGTK_Display_List* list, enum BGTK_Command_Type type,
+		 struct BGTK_Surface src, int sx, int sy, int x, int y, int w,
+		 int h, unsigned version, int opaque) {
+	if (sx + w > src.width) {
+		w = src.width - sx;
+	}
+	if (sy + h > src.height) {
+		h = src.height - sy;
+	}
+	if (w <= 0 || h <= 0) {
+		return;
+	}
+	struct BGTK_Command* c = push_command(list);
+	if (!c) {
+		return;
+	}
+	c->type = type;
+	c->bounds = (struct BGTK_Rect){x, y, w, h};
+	c->src = src;
+	c->sx = sx;
+	c->sy = sy;
+	c->version = version;
+	c->blend = list->blend;
+	c->opacity = list->opacity;
+	c->opaque = c->blend == BGTK_BLEND_COPY ||
+		    (c->blend == BGTK_BLEND_SRC_OVER && opaque &&
+		     c->opacity == 0xFF);
+}
+
+// Records w itself, ignoring any layer it may have.
+static void record_widget_content(struct BGTK_Context* ctx,
+				  struct BGTK_Display_List* list,
+				  struct BGTK_Widget* w) {
+	switch (w->type) {
+		case BGTK_WIDGET_LABEL:
+			// Label background
+			record_fill(list, w->x + w->margin, w->y + w->margin,
+				    w->w - 2 * w->margin, w->h - 2 * w->margin,
+				    BGTK_COLOR_BG);
+			record_widget(ctx, list, w->data.label.text);
+			break;
+		case BGTK_WIDGET_TEXT:
+			if (w->data.text.text) {
+				record_glyphs(list, widget_font(w),
+					      w->data.text.text,
+					      w->x + w->margin + w->padding,
+					      w->y + w->margin + w->padding,
+					      BGTK_COLOR_TEXT);
+			}
+			break;
+		case BGTK_WIDGET_BUTTON: {
+			int x = w->x + w->margin;
+			int y = w->y + w->margin;
+			int bw = w->w - 2 * w->margin;
+			int bh = w->h - 2 * w->margin;
+
+			// Button background and 1px border
+			record_fill(list, x, y, bw, bh, BGTK_COLOR_BTN);
+			record_fill(list, x, y, bw, 1, BGTK_COLOR_TEXT);
+			record_fill(list, x, y + bh - 1, bw, 1, BGTK_COLOR_TEXT);
+			record_fill(list, x, y, 1, bh, BGTK_COLOR_TEXT);
+			record_fill(list, x + bw - 1, y, 1, bh, BGTK_COLOR_TEXT);
+			record_widget(ctx, list, w->data.button.label);
+			break;
+		}
+		case BGTK_WIDGET_SCROLLABLE: {
+			struct BGTK_Surface content;
+			if (!w->data.scrollable.tmp ||
+			    scroll_content_surface(w, &content) != 0) {
+				break;
+			}
+			// Window onto the off-screen buffer at the scroll position
+			w->data.scrollable.tmp_used = ctx->frame_count;
+			record_blit(list, BGTK_CMD_COPY, content, 0,
+				    w->data.scrollable.scroll_y, w->x, w->y, w->w,
+				    w->h, w->data.scrollable.tmp_version, 1);
+			break;
+		}
+		case BGTK_WIDGET_LIST: {
+			struct BGTK_Surface content;
+			if (!w->data.list.tmp ||
+			    list_content_surface(w, &content) != 0) {
+				break;
+			}
+			// The buffer starts at the first bound row
+			w->data.list.tmp_used = ctx->frame_count;
+			record_blit(list, BGTK_CMD_COPY, content, 0,
+				    w->data.list.scroll_y -
+					list_item_top(w, w->data.list.first),
+				    w->x, w->y, w->w, w->h,
+				    w->data.list.tmp_version, 1);
+			break;
+		}
+		case BGTK_WIDGET_IMAGE: {
+			image_wait(w);
+			if (!w->data.image.pixels) {
+				break;
+			}
+			int inset = w->margin + w->padding;
+			struct BGTK_Surface image = {
+			    .pixels = w->data.image.pixels,
+			    .format = BGTK_FORMAT_ABGR8888,
+			    .width = w->data.image.img_w,
+			    .height = w->data.image.img_h,
+			    .stride = w->data.image.img_w,
+			};
+			record_blit(list, BGTK_CMD_IMAGE, image, 0, 0,
+				    w->x + inset, w->y + inset, w->w - 2 * inset,
+				    w->h - 2 * inset, 0, w->data.image.opaque);
+			break;
+		}
+		case BGTK_WIDGET_BOX:
+			for (int i = 0; i < w->data.box.widget_count; i++) {
+				record_widget(ctx, list, w->data.box.widgets[i]);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+// Records the content of a widget drawn by its layer, for the diff only.
+// Inside a faded or blended layer the content differs from what a direct
+// paint would show.
+static void record_shadow(struct BGTK_Context* ctx,
+			  struct BGTK_Display_List* list,
+			  struct BGTK_Widget* w) {
+	int grouped = list->opacity != 0xFF ||
+		      list->blend != BGTK_BLEND_SRC_OVER;
+	list->shadow = grouped ? 2 : 1;
+	record_widget_content(ctx, list, w);
+	list->shadow = 0;
+}
+
+// The paint pass: records the commands that draw w and its children, back
+// to front. A scrollable's off-screen buffer must already be up to date.
+// The widget's opacity and blend mode apply to its whole subtree.
+void record_widget(struct BGTK_Context* ctx, struct BGTK_Display_List* list,
+		   struct BGTK_Widget* w) {
+	if (!w) {
+		return;
+	}
+	unsigned opacity = list->opacity;
+	int blend = list->blend;
+	struct BGTK_Widget* owner = list->owner;
+	list->owner = w;
+	list->opacity = (opacity * w->opacity + 127) / 255;
+	if (w->blend != BGTK_BLEND_SRC_OVER) {
+		list->blend = w->blend;
+	}
+	// Nothing to draw once faded out, unless it clears what is behind
+	if (list->opacity > 0 || list->blend == BGTK_BLEND_COPY) {
+		if (record_layer(ctx, list, w)) {
+			record_shadow(ctx, list, w);
+		} else {
+			record_widget_content(ctx, list, w);
+		}
+	}
+	list->opacity = opacity;
+	list->blend = blend;
+	list->owner = owner;
+}
+
+// Runs the prepared commands of list in dst, restricted to region. The
+// tiled mode splits this across the raster pool.
+static void execute_list(struct BGTK_Context* ctx,
+			 struct BGTK_Display_List* list,
+			 struct BGTK_Surface* dst, struct BGTK_Rect region) {
+	BGTK_TRACE_SCOPE("execute");
+	if (ctx->paint_mode == BGTK_PAINT_TILED) {
+		raster_tiled(ctx, list, dst, region);
+		return;
+	}
+	struct BGTK_Surface clipped = *dst;
+	clipped.clip = region;
+	execute_commands(list, NULL, list->exec_count, &clipped);
+}
+
+// Appends a copy of c to the prepared commands.
+static int push_exec(struct BGTK_Display_List* list, struct BGTK_Command* c) {
+	if (list->exec_count == list->exec_capacity) {
+		int capacity = list->exec_capacity ? list->exec_capacity * 2 : 64;
+		struct BGTK_Command* exec =
+		    mem_realloc(list->ctx, BGTK_MEM_ARENAS, list->exec,
+				capacity * sizeof(struct BGTK_Command));
+		if (!exec) {
+			perror("realloc");
+			return -1;
+		}
+		list->exec = exec;
+		list->exec_capacity = capacity;
+	}
+	list->exec[list->exec_count++] = *c;
+	return 0;
+}
+
+// Splits a minus b into up to four rectangles. Returns how many.
+static int subtract_rect(struct BGTK_Rect a, struct BGTK_Rect b,
+			 struct BGTK_Rect out[4]) {
+	struct BGTK_Rect i = rect_intersect(a, b);
+	if (i.w == 0) {
+		out[0] = a;
+		return 1;
+	}
+	int n = 0;
+	if (i.y > a.y) {
+		out[n++] = (struct BGTK_Rect){a.x, a.y, a.w, i.y - a.y};
+	}
+	if (i.y + i.h < a.y + a.h) {
+		out[n++] = (struct BGTK_Rect){a.x, i.y + i.h, a.w,
+					      a.y + a.h - i.y - i.h};
+	}
+	if (i.x > a.x) {
+		out[n++] = (struct BGTK_Rect){a.x, i.y, i.x - a.x, i.h};
+	}
+	if (i.x + i.w < a.x + a.w) {
+		out[n++] = (struct BGTK_Rect){i.x + i.w, i.y,
+					      a.x + a.w - i.x - i.w, i.h};
+	}
+	return n;
+}
+
+static int rect_contains(struct BGTK_Rect outer, struct BGTK_Rect inner) {
+	return inner.x >= outer.x && inner.y >= outer.y &&
+	       inner.x + inner.w <= outer.x + outer.w &&
+	       inner.y + inner.h <= outer.y + outer.h;
+}
+
+// Opaque areas painted by later commands, keeping the largest ones.
+struct Occluders {
+	struct BGTK_Rect rects[MAX_OCCLUDERS];
+	int count;
+};
+
+static void add_occluder(struct Occluders* o, struct BGTK_Rect r) {
+	if (o->count < MAX_OCCLUDERS) {
+		o->rects[o->count++] = r;
+		return;
+	}
+	int smallest = 0;
+	for (int i = 1; i < o->count; i++) {
+		if ((long)o->rects[i].w * o->rects[i].h <
+		    (long)o->rects[smallest].w * o->rects[smallest].h) {
+			smallest = i;
+		}
+	}
+	if ((long)r.w * r.h >
+	    (long)o->rects[smallest].w * o->rects[smallest].h) {
+		o->rects[smallest] = r;
+	}
+}
+
+// Emits the parts of a fill not hidden by the occluders, back to front
+// order reversed like the rest of the occlusion pass.
+static void push_visible_fill(struct BGTK_Display_List* list,
+			      struct BGTK_Command* c, struct BGTK_Rect visible,
+			      struct Occluders* o) {
+	struct BGTK_Rect frags[MAX_FRAGMENTS];
+	int count = 1;
+	frags[0] = visible;
+	for (int i = 0; i < o->count && count > 0; i++) {
+		struct BGTK_Rect next[MAX_FRAGMENTS];
+		int next_count = 0;
+		for (int f = 0; f < count; f++) {
+			struct BGTK_Rect parts[4];
+			int n = subtract_rect(frags[f], o->rects[i], parts);
+			if (next_count + n > MAX_FRAGMENTS) {
+				// Too fragmented, paint the rest unsplit
+				next_count = -1;
+				break;
+			}
+			for (int p = 0; p < n; p++) {
+				next[next_count++] = parts[p];
+			}
+		}
+		if (next_count < 0) {
+			break;
+		}
+		memcpy(frags, next, next_count * sizeof(struct BGTK_Rect));
+		count = next_count;
+	}
+
+	struct BGTK_Command piece = *c;
+	for (int f = 0; f < count; f++) {
+		piece.bounds = frags[f];
+		push_exec(list, &piece);
+	}
+}
+
+// Keeps the commands that touch damage and are not hidden behind later
+// opaque commands, then merges runs of same-colored fills that form a
+// single rectangle.
+static void prepare_commands(struct BGTK_Display_List* list,
+			     struct BGTK_Rect damage) {
+	BGTK_TRACE_SCOPE("prepare_commands");
+
+	// Occlusion pass, front to back: the output is reversed
+	struct Occluders occluders = {.count = 0};
+	list->exec_count = 0;
+	for (int i = list->count - 1; i >= 0; i--) {
+		struct BGTK_Command* c = &list->commands[i];
+		struct BGTK_Rect visible = rect_intersect(c->bounds, damage);
+		if (visible.w == 0 || c->shadow) {
+			continue;
+		}
+
+		int hidden = 0;
+		for (int o = 0; o < occluders.count && !hidden; o++) {
+			hidden = rect_contains(occluders.rects[o], visible);
+		}
+		if (hidden) {
+			continue;
+		}
+
+		if (c->type == BGTK_CMD_FILL_RECT) {
+			push_visible_fill(list, c, visible, &occluders);
+		} else {
+			push_exec(list, c);
+		}
+		if (c->opaque) {
+			add_occluder(&occluders, visible);
+		}
+	}
+
+	// Back to paint order
+	for (int i = 0, j = list->exec_count - 1; i < j; i++, j--) {
+		struct BGTK_Command tmp = list->exec[i];
+		list->exec[i] = list->exec[j];
+		list->exec[j] = tmp;
+	}
+
+	int count = 0;
+	for (int i = 0; i < list->exec_count; i++) {
+		struct BGTK_Command* c = &list->exec[i];
+		if (c->type == BGTK_CMD_FILL_RECT && count > 0) {
+			struct BGTK_Command* last = &list->exec[count - 1];
+			struct BGTK_Rect a = last->bounds;
+			struct BGTK_Rect b = c->bounds;
+			if (last->type == BGTK_CMD_FILL_RECT &&
+			    last->color == c->color &&
+			    last->blend == c->blend &&
+			    ((a.y == b.y && a.h == b.h &&
+			      (a.x + a.w == b.x || b.x + b.w == a.x)) ||
+			     (a.x == b.x && a.w == b.w &&
+			      (a.y + a.h == b.y || b.y + b.h == a.y)))) {
+				last->bounds = rect_union(a, b);
+				continue;
+			}
+		}
+		list->exec[count++] = *c;
+	}
+	list->exec_count = count;
+}
+
+// Moves every recorded command by (-ox, -oy), into the coordinates of an
+// off-screen surface.
+static void offset_commands(struct BGTK_Display_List* list, int ox, int oy) {
+	for (int i = 0; i < list->count; i++) {
+		struct BGTK_Command* c = &list->commands[i];
+		c->bounds.x -= ox;
+		c->bounds.y -= oy;
+		c->x -= ox;
+		c->y -= oy;
+	}
+}
+
+// Draws w and its children into dst with the widget's (x, y) mapped to
+// (x - ox, y - oy). Used to fill offscreen layers. Returns the area the
+// recorded commands cover, in window coordinates.
+struct BGTK_Rect paint_widget_to(struct BGTK_Context* ctx,
+				 struct BGTK_Widget* w, struct BGTK_Surface* dst,
+				 int ox, int oy) {
+	BGTK_TRACE_SCOPE("paint_offscreen");
+	struct BGTK_Display_List list = {.ctx = ctx, .opacity = 0xFF};
+	struct BGTK_Rect bounds = {0};
+	record_widget_content(ctx, &list, w);
+	for (int i = 0; i < list.count; i++) {
+		bounds = rect_union(bounds, list.commands[i].bounds);
+	}
+	offset_commands(&list, ox, oy);
+	prepare_commands(&list,
+			 (struct BGTK_Rect){0, 0, dst->width, dst->height});
+	execute_commands(&list, NULL, list.exec_count, dst);
+	display_list_release(&list);
+	return bounds;
+}
+
+static int commands_equal(struct BGTK_Display_List* pa,
+			  struct BGTK_Command* a,
+			  struct BGTK_Display_List* pb,
+			  struct BGTK_Command* b) {
+	if (a->type != b->type || a->color != b->color ||
+	    a->blend != b->blend || a->opacity != b->opacity ||
+	    (a->shadow == 2) != (b->shadow == 2) ||
+	    memcmp(&a->bounds, &b->bounds, sizeof(a->bounds)) != 0) {
+		return 0;
+	}
+	switch (a->type) {
+		case BGTK_CMD_GLYPH_RUN:
+			return a->x == b->x && a->y == b->y &&
+			       a->font == b->font && a->length == b->length &&
+			       memcmp(pa->text + a->text, pb->text + b->text,
+				      a->length) == 0;
+		case BGTK_CMD_IMAGE:
+		case BGTK_CMD_COPY:
+			return a->src.pixels == b->src.pixels &&
+			       a->src.stride == b->src.stride &&
+			       a->sx == b->sx && a->sy == b->sy &&
+			       a->version == b->version;
+		default:
+			return 1;
+	}
+}
+
+// Returns the width in pixels the glyphs of text advance the pen by.
+static int run_width(struct BGTK_Font* font, const char* text, int length) {
+	int width = 0;
+	struct BGTK_Text_Iter it;
+	text_iter_init(&it, font, text, length);
+	const struct BGTK_Glyph* glyph;
+	while ((glyph = text_iter_next(&it))) {
+		width += glyph->advance >> 6;
+	}
+	return width;
+}
+
+// Returns the area of the glyphs that differ between two runs drawn at the
+// same origin. Matching glyphs are skipped from the start, and from the end
+// when both runs are as wide, so a ticking counter only damages the digits
+// that changed. Both ends are moved to code point boundaries.
+static struct BGTK_Rect diff_glyph_runs(struct BGTK_Font* font,
+					const char* a, int a_length,
+					const char* b, int b_length, int x,
+					int y) {
+	int min = a_length < b_length ? a_length : b_length;
+	int start = 0;
+	while (start < min && a[start] == b[start]) {
+		start++;
+	}
+	if (start < a_length) {
+		start = utf8_boundary(a, start);
+	}
+	if (start < b_length) {
+		start = utf8_boundary(b, start);
+	}
+	int pen_x = x + run_width(font, a, start);
+
+	int end = 0;
+	if (run_width(font, a + start, a_length - start) ==
+	    run_width(font, b + start, b_length - start)) {
+		while (end < min - start &&
+		       a[a_length - 1 - end] == b[b_length - 1 - end]) {
+			end++;
+		}
+		while (end > 0 &&
+		       ((unsigned char)a[a_length - end] & 0xC0) == 0x80) {
+			end--;
+		}
+	}
+
+	struct BGTK_Rect damage =
+	    text_bounds(font, a + start, a_length - end - start, pen_x, y);
+	return rect_union(damage, text_bounds(font, b + start,
+					      b_length - end - start, pen_x,
+					      y));
+}
+
+// Returns the area two commands of the same widget differ in, or an empty
+// rectangle.
+static struct BGTK_Rect diff_commands(struct BGTK_Display_List* prev,
+				      struct BGTK_Command* a,
+				      struct BGTK_Display_List* cur,
+				      struct BGTK_Command* b) {
+	if (a->type == BGTK_CMD_GLYPH_RUN && b->type == BGTK_CMD_GLYPH_RUN &&
+	    a->x == b->x && a->y == b->y && a->color == b->color &&
+	    a->blend == b->blend && a->font == b->font) {
+		return diff_glyph_runs(a->font, prev->text + a->text,
+				       a->length, cur->text + b->text,
+				       b->length, a->x, a->y);
+	}
+	if (!commands_equal(prev, a, cur, b)) {
+		return rect_union(a->bounds, b->bounds);
+	}
+	return (struct BGTK_Rect){0};
+}
+
+// Offset of the next command of owner in list from i, or -1 if none is
+// within DIFF_LOOKAHEAD commands.
+static int find_owner(struct BGTK_Display_List* list, int i,
+		      struct BGTK_Widget* owner) {
+	for (int k = 0; k < DIFF_LOOKAHEAD && i + k < list->count; k++) {
+		if (list->commands[i + k].owner == owner) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+// Compares two frames widget by widget and returns the area covered by
+// commands that differ. Commands are paired in order while they belong to
+// the same widget. Where one frame has commands the other lacks, both
+// sides skip ahead to the next widget they share, so an extra or missing
+// command only damages itself rather than everything painted after it.
+static struct BGTK_Rect diff_lists(struct BGTK_Display_List* prev,
+				   struct BGTK_Display_List* cur) {
+	BGTK_TRACE_SCOPE("diff");
+	struct BGTK_Rect damage = {0};
+	int i = 0;
+	int j = 0;
+	while (i < prev->count && j < cur->count) {
+		struct BGTK_Command* a = &prev->commands[i];
+		struct BGTK_Command* b = &cur->commands[j];
+		// Layers are compared through their shadows
+		if (a->layer || b->layer) {
+			i += a->layer;
+			j += b->layer;
+			continue;
+		}
+		if (a->owner == b->owner) {
+			damage = rect_union(damage, diff_commands(prev, a, cur, b));
+			i++;
+			j++;
+			continue;
+		}
+
+		// Skip the shorter run of unmatched commands
+		int added = find_owner(cur, j, a->owner);
+		int removed = find_owner(prev, i, b->owner);
+		if (added >= 0 && (removed < 0 || added <= removed)) {
+			for (; added > 0; added--, j++) {
+				damage = rect_union(damage,
+						    cur->commands[j].bounds);
+			}
+		} else if (removed >= 0) {
+			for (; removed > 0; removed--, i++) {
+				damage = rect_union(damage,
+						    prev->commands[i].bounds);
+			}
+		} else {
+			damage = rect_union(damage, a->bounds);
+			damage = rect_union(damage, b->bounds);
+			i++;
+			j++;
+		}
+	}
+	for (; i < prev->count; i++) {
+		if (!prev->commands[i].layer) {
+			damage = rect_union(damage, prev->commands[i].bounds);
+		}
+	}
+	for (; j < cur->count; j++) {
+		if (!cur->commands[j].layer) {
+			damage = rect_union(damage, cur->commands[j].bounds);
+		}
+	}
+	return damage;
+}
+
+// Redraws the off-screen buffers of stale scrollables below w, innermost
+// first, and bumps their version so copies of them are seen as changed.
+static void prepare_scrollables(struct BGTK_Context* ctx,
+				struct BGTK_Widget* w) {
+	if (!w) {
+		return;
+	}
+
+	switch (w->type) {
+		case BGTK_WIDGET_LABEL:
+			prepare_scrollables(ctx, w->data.label.text);
+			break;
+		case BGTK_WIDGET_BUTTON:
+			prepare_scrollables(ctx, w->data.button.label);
+			break;
+		case BGTK_WIDGET_BOX:
+			for (int i = 0; i < w->data.box.widget_count; i++) {
+				prepare_scrollables(ctx, w->data.box.widgets[i]);
+			}
+			break;
+		case BGTK_WIDGET_SCROLLABLE: {
+			for (int i = 0; i < w->data.scrollable.widget_count;
+			     i++) {
+				prepare_scrollables(ctx,
+						    w->data.scrollable.widgets[i]);
+			}
+
+			// A resize may have replaced the buffer
+			struct BGTK_Surface content;
+			if (scroll_content_surface(w, &content) != 0 ||
+			    w->data.scrollable.tmp_valid) {
+				break;
+			}
+
+			// Children are laid out in content coordinates
+			struct BGTK_Display_List list = {.ctx = ctx,
+							  .opacity = 0xFF};
+			struct BGTK_Rect all = {0, 0, content.width,
+						content.height};
+			record_fill(&list, 0, 0, content.width, content.height,
+				    BGTK_COLOR_BG);
+			for (int i = 0; i < w->data.scrollable.widget_count;
+			     i++) {
+				record_widget(ctx, &list,
+					      w->data.scrollable.widgets[i]);
+			}
+			prepare_commands(&list, all);
+			execute_list(ctx, &list, &content, all);
+			display_list_release(&list);
+
+			w->data.scrollable.tmp_valid = 1;
+			w->data.scrollable.tmp_version++;
+			break;
+		}
+		case BGTK_WIDGET_LIST: {
+			for (int i = 0; i < w->data.list.row_count; i++) {
+				if (w->data.list.row_items[i] >= 0) {
+					prepare_scrollables(
+					    ctx, w->data.list.rows[i]);
+				}
+			}
+
+			struct BGTK_Surface content;
+			if (list_content_surface(w, &content) != 0 ||
+			    w->data.list.tmp_valid) {
+				break;
+			}
+
+			// Rows are laid out in content coordinates, the
+			// buffer only holds the bound ones
+			int top = list_item_top(w, w->data.list.first);
+			struct BGTK_Display_List list = {.ctx = ctx,
+							  .opacity = 0xFF};
+			struct BGTK_Rect all = {0, 0, content.width,
+						content.height};
+			record_fill(&list, 0, top, content.width,
+				    content.height, BGTK_COLOR_BG);
+			for (int i = 0; i < w->data.list.row_count; i++) {
+				if (w->data.list.row_items[i] >= 0) {
+					record_widget(ctx, &list,
+						      w->data.list.rows[i]);
+				}
+			}
+			offset_commands(&list, 0, top);
+			prepare_commands(&list, all);
+			execute_list(ctx, &list, &content, all);
+			display_list_release(&list);
+
+			w->data.list.tmp_valid = 1;
+			w->data.list.tmp_version++;
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+// Runs an image or copy command. A source that covers every pixel at full
+// opacity is copied without reading dst.
+static void blit_command(struct BGTK_Surface* dst, struct BGTK_Command* c) {
+	if (c->opaque && c->opacity == 0xFF) {
+		copy_rect(dst, c->bounds.x, c->bounds.y, &c->src, c->sx, c->sy,
+			  c->bounds.w, c->bounds.h);
+		return;
+	}
+	blend_rect(dst, c->bounds.x, c->bounds.y, &c->src, c->sx, c->sy,
+		   c->bounds.w, c->bounds.h, c->blend, c->opacity);
+}
+
+void execute_commands(struct BGTK_Display_List* list, const int* order,
+		      int count, struct BGTK_Surface* dst) {
+	for (int i = 0; i < count; i++) {
+		struct BGTK_Command* c = &list->exec[order ? order[i] : i];
+		switch (c->type) {
+			case BGTK_CMD_FILL_RECT:
+				draw_rect(dst, c->bounds.x, c->bounds.y,
+					  c->bounds.w, c->bounds.h, c->color,
+					  c->blend);
+				break;
+			case BGTK_CMD_GLYPH_RUN: {
+				// Batch the following runs sharing this color
+				// and mode
+				struct BGTK_Glyph_Run runs[GLYPH_BATCH];
+				int n = 0;
+				while (1) {
+					runs[n++] = (struct BGTK_Glyph_Run){
+					    list->text + c->text, c->length,
+					    c->font, c->x, c->y};
+					if (n == GLYPH_BATCH || i + 1 >= count) {
+						break;
+					}
+					struct BGTK_Command* next =
+					    &list->exec[order ? order[i + 1]
+							      : i + 1];
+					if (next->type != BGTK_CMD_GLYPH_RUN ||
+					    next->color != c->color ||
+					    next->blend != c->blend) {
+						break;
+					}
+					c = next;
+					i++;
+				}
+				draw_glyph_runs(dst, runs, n, c->color,
+						c->blend);
+				break;
+			}
+			case BGTK_CMD_IMAGE:
+				blit_command(dst, c);
+				break;
+			case BGTK_CMD_COPY: {
+				uint64_t start = now_ns();
+				blit_command(dst, c);
+				atomic_fetch_add_explicit(&list->copy_ns,
+							  now_ns() - start,
+							  memory_order_relaxed);
+				break;
+			}
+		}
+	}
+}
+
+// Records the frame, diffs it against the previous one and executes only
+// what changed into the back buffer. With full set the whole window is
+// repainted.
+void render_frame(struct BGTK_Context* ctx, int full) {
+	BGTK_TRACE_SCOPE("render_frame");
+	if (!ctx->root_widget) {
+		return;
+	}
+	if (!ctx->display_list) {
+		ctx->display_list = calloc(1, sizeof(struct BGTK_Display_List));
+		ctx->prev_display_list =
+		    calloc(1, sizeof(struct BGTK_Display_List));
+		if (!ctx->display_list || !ctx->prev_display_list) {
+			perror("calloc");
+			free(ctx->display_list);
+			free(ctx->prev_display_list);
+			ctx->display_list = NULL;
+			ctx->prev_display_list = NULL;
+			return;
+		}
+		ctx->display_list->ctx = ctx;
+		ctx->prev_display_list->ctx = ctx;
+	}
+
+	struct Frame_Mark raster = frame_phase_begin(ctx);
+	ctx->frame_count++;
+	struct BGTK_Display_List* list = ctx->prev_display_list;
+	ctx->prev_display_list = ctx->display_list;
+	ctx->display_list = list;
+	display_list_reset(list);
+
+	struct Frame_Mark scroll = frame_phase_begin(ctx);
+	prepare_scrollables(ctx, ctx->root_widget);
+	frame_phase_end(ctx, BGTK_PHASE_SCROLL, scroll);
+	record_fill(list, 0, 0, ctx->width, ctx->height, BGTK_COLOR_BG);
+	record_widget(ctx, list, ctx->root_widget);
+
+	struct BGTK_Rect window = {0, 0, ctx->width, ctx->height};
+	struct BGTK_Rect damage =
+	    full ? window : diff_lists(ctx->prev_display_list, list);
+	damage = rect_intersect(damage, window);
+	if (damage.w > 0) {
+		prepare_commands(list, damage);
+		execute_list(ctx, list, &ctx->back_buffer, damage);
+		damage_rect(ctx, damage.x, damage.y, damage.w, damage.h);
+		frame_phase_add(ctx, BGTK_PHASE_SCROLL,
+				atomic_load_explicit(&list->copy_ns,
+						     memory_order_relaxed));
+	}
+	frame_phase_end(ctx, BGTK_PHASE_RASTER, raster);
+
+	// The raster workers are idle until the next frame
+	memory_trim(ctx);
+}
+
+void bgtk_dump_display_list(struct BGTK_Context* ctx, FILE* out) {
+	static const char* names[] = {
+	    [BGTK_CMD_FILL_RECT] = "fill",
+	    [BGTK_CMD_GLYPH_RUN] = "glyphs",
+	    [BGTK_CMD_IMAGE] = "image",
+	    [BGTK_CMD_COPY] = "copy",
+	};
+	struct BGTK_Display_List* list = ctx->display_list;
+	if (!list) {
+		fprintf(out, "display list: empty\n");
+		return;
+	}
+
+	long long total = 0;
+	for (int i = 0; i < list->count; i++) {
+		struct BGTK_Command* c = &list->commands[i];
+		long long pixels = (long long)c->bounds.w * c->bounds.h;
+		if (!c->shadow) {
+			total += pixels;
+		}
+		fprintf(out, "%4d %-6s %5d,%-5d %5dx%-5d %8lld px%s", i,
+			names[c->type], c->bounds.x, c->bounds.y, c->bounds.w,
+			c->bounds.h, pixels, c->shadow ? " shadow" : "");
+		switch (c->type) {
+			case BGTK_CMD_FILL_RECT:
+				fprintf(out, "  color=0x%08x\n", c->color);
+				break;
+			case BGTK_CMD_GLYPH_RUN:
+				fprintf(out, "  color=0x%08x \"%s\"\n", c->color,
+					list->text + c->text);
+				break;
+			default:
+				fprintf(out, "  src=%p+%d,%d v%u\n",
+					(void*)c->src.pixels, c->sx, c->sy,
+					c->version);
+				break;
+		}
+	}
+	long long executed = 0;
+	struct BGTK_Rect area = {0};
+	for (int i = 0; i < list->exec_count; i++) {
+		struct BGTK_Command* c = &list->exec[i];
+		executed += (long long)c->bounds.w * c->bounds.h;
+		area = rect_union(area, c->bounds);
+	}
+	fprintf(out,
+		"display list: %d commands, %lld px recorded, %d executed "
+		"last frame (%lld px, overdraw %.2fx)\n",
+		list->count, total, list->exec_count, executed,
+		area.w > 0 ? (double)executed / ((long long)area.w * area.h)
+			   : 0.0);
+}
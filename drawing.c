@@ -1,21 +1,18 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "bgtk.h"
 #include "internal.h"
 
-// A few basic colors (0xAARRGGBB)
-#define BGTK_COLOR_BG 0xFFCCCCCC     // Light Gray
-#define BGTK_COLOR_BTN 0xFF007BFF    // Blue
-#define BGTK_COLOR_TEXT 0xFF000000   // Black
-#define BGTK_COLOR_WHITE 0xFFFFFFFF  // White
 // Define STB_IMAGE_IMPLEMENTATION in one source file
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-// Loads an image file into a pixel buffer (RGBA format).
-// Returns 0 on success, -1 on failure.
-int load_image(const char* path, uint32_t** out_pixels, int* out_w,
-	       int* out_h) {
+// Loads an image file into a pixel buffer (RGBA format), freed with
+// image_free(). Returns 0 on success, -1 on failure.
+int load_image(struct BGTK_Context* ctx, const char* path,
+	       uint32_t** out_pixels, int* out_w, int* out_h, int* out_opaque) {
 	int w, h, channels;
 	unsigned char* pixels = stbi_load(path, &w, &h, &channels, 4);
 	if (!pixels) {
@@ -23,309 +20,264 @@ int load_image(const char* path, uint32_t** out_pixels, int* out_w,
 		return -1;
 	}
 
-	// Convert to uint32_t (RGBA)
+	// stb_image allocates the pixels itself, they are accounted here
+	mem_adopt(ctx, BGTK_MEM_IMAGES, (size_t)w * h * sizeof(uint32_t));
+
+	// Kept in the decoded byte order, BGTK_FORMAT_ABGR8888
 	*out_pixels = (uint32_t*)pixels;
 	*out_w = w;
 	*out_h = h;
+
+	// Premultiplied in place for compositing. Fully opaque images hide
+	// whatever is painted under them.
+	*out_opaque = 1;
+	for (size_t i = 0; i < (size_t)w * h; i++) {
+		unsigned char* p = pixels + i * 4;
+		if (p[3] != 0xFF) {
+			*out_opaque = 0;
+			p[0] = (p[0] * p[3] + 127) / 255;
+			p[1] = (p[1] * p[3] + 127) / 255;
+			p[2] = (p[2] * p[3] + 127) / 255;
+		}
+	}
 	return 0;
 }
 
-void clear_buffer(struct BGTK_Context* ctx) {
-	uint32_t* pixels = (uint32_t*)ctx->shm_buffer;
-	size_t size = (size_t)ctx->width * ctx->height;
-	for (size_t i = 0; i < size; i++) {
-		pixels[i] = BGTK_COLOR_BG;
+void image_free(struct BGTK_Context* ctx, uint32_t* pixels, int w, int h) {
+	if (pixels) {
+		mem_disown(ctx, BGTK_MEM_IMAGES,
+			   (size_t)w * h * sizeof(uint32_t));
+		stbi_image_free(pixels);
+	}
+}
+
+// Smallest rectangle containing both, an empty rectangle is ignored.
+struct BGTK_Rect rect_union(struct BGTK_Rect a, struct BGTK_Rect b) {
+	if (a.w <= 0 || a.h <= 0) {
+		return b;
+	}
+	if (b.w <= 0 || b.h <= 0) {
+		return a;
+	}
+	int x2 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+	int y2 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+	a.x = a.x < b.x ? a.x : b.x;
+	a.y = a.y < b.y ? a.y : b.y;
+	a.w = x2 - a.x;
+	a.h = y2 - a.y;
+	return a;
+}
+
+// Overlap of both rectangles, zero-sized if they are disjoint.
+struct BGTK_Rect rect_intersect(struct BGTK_Rect a, struct BGTK_Rect b) {
+	int x1 = a.x > b.x ? a.x : b.x;
+	int y1 = a.y > b.y ? a.y : b.y;
+	int x2 = a.x + a.w < b.x + b.w ? a.x + a.w : b.x + b.w;
+	int y2 = a.y + a.h < b.y + b.h ? a.y + a.h : b.y + b.h;
+	if (x2 <= x1 || y2 <= y1) {
+		return (struct BGTK_Rect){0};
 	}
+	return (struct BGTK_Rect){x1, y1, x2 - x1, y2 - y1};
 }
 
-void draw_rect(struct BGTK_Context* ctx, uint32_t* pixels, int x, int y, int w,
-	       int h, uint32_t color) {
-	// Basic clipping and drawing
+// Returns the box covered by the glyph bitmaps of the first length bytes of
+// text drawn at (x, y).
+struct BGTK_Rect text_bounds(struct BGTK_Font* font, const char* text,
+			     int length, int x, int y) {
+	// The iterator opens the font, so metrics are read after it
+	struct BGTK_Text_Iter it;
+	text_iter_init(&it, font, text, length);
+	int pen_x = x;
+	int pen_y = y + font->ascender;
 	int x1 = x;
 	int y1 = y;
-	int x2 = x + w;
-	int y2 = y + h;
+	int x2 = x;
+	int y2 = y;
+	const struct BGTK_Glyph* glyph;
+	while ((glyph = text_iter_next(&it))) {
+		if (glyph->width > 0 && glyph->rows > 0) {
+			int gx = pen_x + glyph->left;
+			int gy = pen_y - glyph->top;
+			x1 = gx < x1 ? gx : x1;
+			y1 = gy < y1 ? gy : y1;
+			x2 = gx + glyph->width > x2 ? gx + glyph->width : x2;
+			y2 = gy + glyph->rows > y2 ? gy + glyph->rows : y2;
+		}
+		pen_x += glyph->advance >> 6;
+	}
+	return (struct BGTK_Rect){x1, y1, x2 - x1, y2 - y1};
+}
 
-	// TODO: stride can be of a tmp buffer != from ctx
-	int stride = ctx->width;
-	for (int j = y1; j < y2; j++) {
-		for (int i = x1; i < x2; i++) {
-			pixels[j * stride + i] = color;
+static void blend_glyphs(struct BGTK_Surface* dst,
+			 const struct BGTK_Glyph_Run* run, uint32_t color,
+			 int mode) {
+	struct BGTK_Text_Iter it;
+	text_iter_init(&it, run->font, run->text, run->length);
+	int pen_x = run->x;
+	int pen_y = run->y + run->font->ascender;
+	const struct BGTK_Glyph* glyph;
+	while ((glyph = text_iter_next(&it))) {
+		if (glyph->bitmap) {
+			draw_glyph(dst, glyph, pen_x + glyph->left,
+				   pen_y - glyph->top, color, mode);
 		}
+		pen_x += glyph->advance >> 6;
 	}
 }
 
-void measure_text(FT_Face face, const char* text, int* out_width,
-		  int* out_height) {
-	int width = 0;
+void draw_text(struct BGTK_Font* font, struct BGTK_Surface* dst,
+	       const char* text, int x, int y, uint32_t color) {
+	struct BGTK_Glyph_Run run = {text, strlen(text), font, x, y};
+	draw_glyph_runs(dst, &run, 1, color, BGTK_BLEND_SRC_OVER);
+}
+
+// Draws several strings sharing one color and blend mode. The runs may
+// use different fonts.
+void draw_glyph_runs(struct BGTK_Surface* dst,
+		     const struct BGTK_Glyph_Run* runs, int count,
+		     uint32_t color, int mode) {
+	for (int i = 0; i < count; i++) {
+		blend_glyphs(dst, &runs[i], color, mode);
+	}
+}
 
-	for (const char* p = text; *p; p++) {
-		if (FT_Load_Char(face, *p, FT_LOAD_DEFAULT)) {
-			continue;
-		}
+// Wraps the scrollable's off-screen buffer in a surface, allocating it on
+// first use and again when the widget was resized. Returns 0 on success,
+// -1 on failure.
+int scroll_content_surface(struct BGTK_Widget* w, struct BGTK_Surface* out) {
+	int content_height = w->data.scrollable.content_height;
+	if (w->h > content_height) {
+		content_height = w->h;
+	}
 
-		width += face->glyph->advance.x;  // 26.6 units
+	int bpp = pixel_size(w->ctx->format);
+	size_t bytes = (size_t)w->w * content_height * bpp;
+	if (w->data.scrollable.tmp &&
+	    mem_size(w->data.scrollable.tmp) != bytes) {
+		mem_free(w->ctx, w->data.scrollable.tmp);
+		w->data.scrollable.tmp = NULL;
+	}
+	if (!w->data.scrollable.tmp) {
+		w->data.scrollable.tmp =
+		    mem_calloc(w->ctx, BGTK_MEM_SCROLL,
+			       (size_t)w->w * content_height, bpp);
+		if (!w->data.scrollable.tmp) {
+			fprintf(stderr, "Failed to allocate off-screen buffer\n");
+			return -1;
+		}
+		w->data.scrollable.tmp_valid = 0;
+		BGTK_LOG(BGTK_LEVEL_DEBUG, "allocated temp buffer %ux%u", w->w,
+			 content_height);
 	}
 
-	width >>= 6;
+	*out = (struct BGTK_Surface){
+	    .pixels = w->data.scrollable.tmp,
+	    .format = w->ctx->format,
+	    .width = w->w,
+	    .height = content_height,
+	    .stride = w->w,
+	};
+	return 0;
+}
 
-	int ascent = face->size->metrics.ascender >> 6;
-	int descent = -face->size->metrics.descender >> 6;
-	int height = ascent + descent;
+// Relative cost of redrawing a byte of scroll content, see mem_score()
+#define SCROLL_COST 2
 
-	*out_width = width;
-	*out_height = height;
+// The off-screen buffers are all the category holds
+static size_t scroll_cache_size(struct BGTK_Context* ctx) {
+	return mem_bytes(ctx, BGTK_MEM_SCROLL);
 }
 
-void calculate_widget_size(struct BGTK_Context* ctx, struct BGTK_Widget* w) {
-	if (!w) {
+// Makes the buffer tmp of w the victim if it was shown longer ago.
+static void scroll_consider(struct BGTK_Context* ctx, struct BGTK_Widget* w,
+			    void* tmp, unsigned long used,
+			    struct Mem_Victim* victim) {
+	if (!tmp) {
 		return;
 	}
+	uint64_t score = mem_score(SCROLL_COST, ctx->frame_count - used);
+	if (!victim->entry || score < victim->score) {
+		*victim = (struct Mem_Victim){
+		    .entry = w,
+		    .bytes = mem_size(tmp),
+		    .score = score,
+		    .in_use = used == ctx->frame_count,
+		};
+	}
+}
 
+// Picks the buffer under w shown longest ago, if older than the victim.
+static void scroll_victim(struct BGTK_Context* ctx, struct BGTK_Widget* w,
+			  struct Mem_Victim* victim) {
+	if (!w) {
+		return;
+	}
 	switch (w->type) {
 		case BGTK_WIDGET_LABEL:
-			if (w->data.label.text) {
-				calculate_widget_size(ctx, w->data.label.text);
-				w->w = w->data.label.text->w + 2 * w->padding;
-				w->h = w->data.label.text->h + 2 * w->padding;
-			}
-			break;
-		case BGTK_WIDGET_TEXT:
-			if (w->data.text.text) {
-				measure_text(ctx->ft_face, w->data.text.text,
-					     &w->w, &w->h);
-				// Add padding to the text widget
-				w->w += 2 * w->padding;
-				w->h += 2 * w->padding;
-			}
-			printf("calculated text size: %ux%u\n", w->w, w->h);
+			scroll_victim(ctx, w->data.label.text, victim);
 			break;
 		case BGTK_WIDGET_BUTTON:
-			if (w->data.button.label) {
-				calculate_widget_size(ctx, w->data.button.label);
-				w->w = w->data.button.label->w + 2 * w->padding;
-				w->h = w->data.button.label->h + 2 * w->padding;
+			scroll_victim(ctx, w->data.button.label, victim);
+			break;
+		case BGTK_WIDGET_BOX:
+			for (int i = 0; i < w->data.box.widget_count; i++) {
+				scroll_victim(ctx, w->data.box.widgets[i],
+					      victim);
 			}
-			printf("calculated button size: %ux%u\n", w->w, w->h);
 			break;
-		case BGTK_WIDGET_SCROLLABLE:
-			w->data.scrollable.content_height = 0;
+		case BGTK_WIDGET_SCROLLABLE: {
 			for (int i = 0; i < w->data.scrollable.widget_count;
 			     i++) {
-				struct BGTK_Widget* child =
-				    w->data.scrollable.items[i];
-				calculate_widget_size(ctx, child);
-				w->data.scrollable.content_height += child->h + 2 * w->margin;
-			}
-
-			// Subtract the last margin (no margin after the last widget)
-			if (w->data.scrollable.widget_count > 0) {
-				w->data.scrollable.content_height -= 2 * w->margin;
+				scroll_victim(ctx,
+					      w->data.scrollable.widgets[i],
+					      victim);
 			}
-			printf("calculated scrollable size: %ux%u\n", w->w,
-		       w->data.scrollable.content_height);
+			scroll_consider(ctx, w, w->data.scrollable.tmp,
+					w->data.scrollable.tmp_used, victim);
 			break;
-		case BGTK_WIDGET_IMAGE:
-			// the widget must have a definite size
-			printf("calculated image size: %ux%u\n", w->w, w->h);
+		}
+		case BGTK_WIDGET_LIST:
+			for (int i = 0; i < w->data.list.row_count; i++) {
+				scroll_victim(ctx, w->data.list.rows[i],
+					      victim);
+			}
+			scroll_consider(ctx, w, w->data.list.tmp,
+					w->data.list.tmp_used, victim);
 			break;
 		default:
 			break;
 	}
 }
 
-void draw_text(struct BGTK_Context* ctx, uint32_t* pixels, const char* text,
-	       int x, int y, uint32_t color) {
-	if (!ctx->ft_face) {
-		// Fallback to simple placeholder if font didn't load
-		draw_rect(ctx, pixels, x, y, 5, 5, color);
-		return;
-	}
-
-	// Set font size for drawing context
-	FT_Set_Pixel_Sizes(ctx->ft_face, 0, ctx->font_size);
-
-	int pen_x = x;
-	int pen_y = y + (ctx->ft_face->size->metrics.ascender >> 6);
-
-	int stride = ctx->width;
-	for (const char* p = text; *p; p++) {
-		FT_UInt index = FT_Get_Char_Index(ctx->ft_face, *p);
-
-		if (FT_Load_Glyph(ctx->ft_face, index,
-				  FT_LOAD_DEFAULT | FT_LOAD_TARGET_LIGHT)) {
-			continue;
-		}
-
-		FT_Render_Glyph(ctx->ft_face->glyph, FT_RENDER_MODE_NORMAL);
-
-		FT_GlyphSlot slot = ctx->ft_face->glyph;
-		FT_Bitmap* bitmap = &slot->bitmap;
-
-		int gx = pen_x + slot->bitmap_left;
-		int gy = pen_y - slot->bitmap_top;
-
-		for (unsigned int row = 0; row < bitmap->rows; row++) {
-			for (unsigned int col = 0; col < bitmap->width; col++) {
-				uint8_t a =
-				    bitmap->buffer[row * bitmap->pitch + col];
-				if (a == 0) {
-					continue;
-				}
-
-				int32_t dx = gx + col;
-				int32_t dy = gy + row;
-
-				// Blend
-				uint32_t dst = pixels[dy * stride + dx];
-				uint8_t inv = 255 - a;
-
-				uint8_t r_dst = (dst >> 16) & 0xFF;
-				uint8_t g_dst = (dst >> 8) & 0xFF;
-				uint8_t b_dst = (dst) & 0xFF;
-
-				uint8_t r_src = (color >> 16) & 0xFF;
-				uint8_t g_src = (color >> 8) & 0xFF;
-				uint8_t b_src = (color) & 0xFF;
-
-				uint8_t r = (r_src * a + r_dst * inv) / 255;
-				uint8_t g = (g_src * a + g_dst * inv) / 255;
-				uint8_t b = (b_src * a + b_dst * inv) / 255;
-
-				pixels[dy * stride + dx] =
-				    (r << 16) | (g << 8) | b;
-			}
-		}
-
-		pen_x += slot->advance.x >> 6;
-	}
+// The scrollable or list shown longest ago, redrawn when next shown
+static int scroll_cache_victim(struct BGTK_Context* ctx,
+			       struct Mem_Victim* victim) {
+	*victim = (struct Mem_Victim){0};
+	scroll_victim(ctx, ctx->root_widget, victim);
+	return victim->entry != NULL;
 }
 
-static void draw_image(struct BGTK_Context* ctx, struct BGTK_Widget w,
-		       uint32_t* pixels) {
-	int stride = ctx->width;
-	for (int j = 0; j < w.h; j++) {
-		for (int i = 0; i < w.w; i++) {
-			int dx = w.x + i;
-			int dy = w.y + j;
-			pixels[dy * stride + dx] =
-			    w.data.image.pixels[j * w.data.image.img_w + i];
-		}
+static void scroll_cache_evict(struct BGTK_Context* ctx, void* entry) {
+	struct BGTK_Widget* w = entry;
+	if (w->type == BGTK_WIDGET_LIST) {
+		mem_free(ctx, w->data.list.tmp);
+		w->data.list.tmp = NULL;
+		w->data.list.tmp_valid = 0;
+		return;
 	}
+	mem_free(ctx, w->data.scrollable.tmp);
+	w->data.scrollable.tmp = NULL;
+	w->data.scrollable.tmp_valid = 0;
 }
 
-void draw_widget(struct BGTK_Context* ctx, struct BGTK_Widget* w,
-		 uint32_t* pixels) {
-	switch (w->type) {
-		case BGTK_WIDGET_LABEL:
-			// Draw label background
-			draw_rect(ctx, pixels, w->x + w->margin, w->y + w->margin, 
-				  w->w - 2 * w->margin, w->h - 2 * w->margin, BGTK_COLOR_BG);
-			// Draw text widget (offset for padding and margin)
-			if (w->data.label.text) {
-				w->data.label.text->x = w->x + w->margin + w->padding;
-				w->data.label.text->y = w->y + w->margin + w->padding;
-				draw_widget(ctx, w->data.label.text, pixels);
-			}
-			break;
-		case BGTK_WIDGET_TEXT:
-			puts("drawing text widget");
-			draw_text(ctx, pixels, w->data.text.text, 
-				  w->x + w->margin + w->padding, 
-				  w->y + w->margin + w->padding, 
-				  BGTK_COLOR_TEXT);
-			break;
-		case BGTK_WIDGET_BUTTON:
-			puts("drawing button widget");
-			// Draw button background
-			draw_rect(ctx, pixels, w->x + w->margin, w->y + w->margin,
-				  w->w - 2 * w->margin, w->h - 2 * w->margin, BGTK_COLOR_BTN);
-
-			// Draw button border (1px black)
-			draw_rect(ctx, pixels, w->x + w->margin, w->y + w->margin, 
-				  w->w - 2 * w->margin, 1, BGTK_COLOR_TEXT);  // Top
-			draw_rect(ctx, pixels, w->x + w->margin, 
-				  w->y + w->h - 1 - w->margin, w->w - 2 * w->margin, 1,
-				  BGTK_COLOR_TEXT);  // Bottom
-			draw_rect(ctx, pixels, w->x + w->margin, w->y + w->margin, 1,
-				  w->h - 2 * w->margin, BGTK_COLOR_TEXT);  // Left
-			draw_rect(ctx, pixels, w->x + w->w - 1 - w->margin, 
-				  w->y + w->margin, 1, w->h - 2 * w->margin,
-				  BGTK_COLOR_TEXT);  // Right
-
-			// Draw label widget (offset for padding and margin)
-			if (w->data.button.label) {
-				w->data.button.label->x = w->x + w->margin + w->padding;
-				w->data.button.label->y = w->y + w->margin + w->padding;
-				draw_widget(ctx, w->data.button.label, pixels);
-			}
-			break;
-		case BGTK_WIDGET_SCROLLABLE:
-			puts("drawing scrollable widget");
-			int content_height = w->data.scrollable.content_height;
-			if (w->h > content_height) {
-				content_height = w->h;
-			}
-
-			// Allocate or update the off-screen buffer if needed
-			if (!w->data.scrollable.tmp) {
-				// Allocate the off-screen buffer
-				w->data.scrollable.tmp = calloc(
-				    w->w * content_height, sizeof(uint32_t));
-				if (!w->data.scrollable.tmp) {
-					fprintf(stderr,
-						"Failed to allocate off-screen buffer\n");
-					break;
-				}
-				draw_rect(ctx, w->data.scrollable.tmp, 0, 0,
-					  w->w, content_height, BGTK_COLOR_BG);
-				printf("allocated temp buffer %ux%u\n", w->w,
-				       content_height);
-
-				// Draw child widgets into the off-screen buffer
-				int current_y = 0;
-				for (int i = 0;
-				     i < w->data.scrollable.widget_count; i++) {
-					struct BGTK_Widget* child =
-					    w->data.scrollable.widgets[i];
-
-					child->x = w->x + w->margin + w->padding;
-					if (w->flags & BGTK_FLAG_CENTER) {
-						child->x = w->x + w->margin +
-						    (w->w - 2 * w->margin - child->w) / 2;
-					}
-					child->y = current_y + w->margin;
-					printf(
-					    "drawing child widget %d at %u\n",
-					    i, current_y);
-					draw_widget(ctx, child,
-						   w->data.scrollable.tmp);
-					current_y += child->h + 2 * w->margin;
-				}
-			}
+static const struct Mem_Cache scroll_cache = {
+    .name = "scroll",
+    .category = BGTK_MEM_SCROLL,
+    .size = scroll_cache_size,
+    .victim = scroll_cache_victim,
+    .evict = scroll_cache_evict,
+};
 
-			// Copy the off-screen buffer to the framebuffer
-			// according to scroll position
-			uint32_t* buff = ctx->shm_buffer;
-			uint32_t* tmp = w->data.scrollable.tmp;
-			for (int row = 0; row < w->h; row++) {
-				int src_row = w->data.scrollable.scroll_y + row;
-				if (src_row < content_height) {
-					memcpy(&buff[(w->y + row) * ctx->width + w->x],
-					       &tmp[src_row * w->w], w->w * 4);
-				}
-			}
-
-			break;
-		case BGTK_WIDGET_IMAGE:
-			puts("drawing image widget");
-			// Adjust the widget's x/y to account for margin and padding
-			struct BGTK_Widget adjusted_widget = *w;
-			adjusted_widget.x += w->margin + w->padding;
-			adjusted_widget.y += w->margin + w->padding;
-			adjusted_widget.w -= 2 * (w->margin + w->padding);
-			adjusted_widget.h -= 2 * (w->margin + w->padding);
-			draw_image(ctx, adjusted_widget, pixels);
-			break;
-	}
+void scroll_cache_init(struct BGTK_Context* ctx) {
+	mem_register_cache(ctx, &scroll_cache);
 }
@@ -0,0 +1,152 @@
+#include <bgce.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+
+// The app the end-to-end benchmark drives, started by bgce_server:
+//
+//   client scroll <items>   a full-window scrollable list of labels
+//   client list <items>     the same list virtualized with bgtk_list()
+//   client click            a button at the top left and a counter label
+
+#define WIDTH 600
+#define HEIGHT 400
+
+static int counter = 0;
+static struct BGTK_Widget* counter_label = NULL;
+
+static void button_callback(void) {
+	counter++;
+	bgtk_set_textf(counter_label, "Clicks: %d", counter);
+}
+
+static int message_waiting(int fd) {
+	struct pollfd p = {.fd = fd, .events = POLLIN};
+	return poll(&p, 1, 0) > 0;
+}
+
+static struct BGTK_Widget* build_list(struct BGTK_Context* ctx, int items) {
+	struct BGTK_Widget** labels = malloc(items * sizeof(*labels));
+	if (!labels) {
+		perror("malloc");
+		return NULL;
+	}
+	for (int i = 0; i < items; i++) {
+		char text[32];
+		snprintf(text, sizeof(text), "Item %d", i + 1);
+		labels[i] =
+		    bgtk_label(ctx, text, (BGTK_Options){.padding = 2});
+	}
+	struct BGTK_Widget* list =
+	    bgtk_scrollable(ctx, labels, items, (BGTK_Options){0});
+	free(labels);
+	if (list) {
+		list->w = WIDTH;
+		list->h = HEIGHT;
+	}
+	return list;
+}
+
+static void bind_item(struct BGTK_Widget* row, int index, void* user) {
+	(void)user;
+	bgtk_set_textf(row, "Item %d", index + 1);
+}
+
+static struct BGTK_Widget* build_virtual_list(struct BGTK_Context* ctx,
+					      int items) {
+	struct BGTK_List_Source source = {
+	    .count = items, .row_height = 20, .bind = bind_item};
+	struct BGTK_Widget* list = bgtk_list(ctx, &source, (BGTK_Options){0});
+	if (list) {
+		list->w = WIDTH;
+		list->h = HEIGHT;
+	}
+	return list;
+}
+
+static struct BGTK_Widget* build_counter(struct BGTK_Context* ctx) {
+	struct BGTK_Widget* children[2];
+	struct BGTK_Widget* text =
+	    bgtk_text(ctx, "Click me", (BGTK_Options){0});
+	children[0] = bgtk_button(ctx, text, button_callback,
+				  (BGTK_Options){.padding = 10});
+	counter_label =
+	    bgtk_label(ctx, "Clicks: 0", (BGTK_Options){.padding = 10});
+	children[1] = counter_label;
+	return bgtk_vbox(ctx, children, 2, (BGTK_Options){0});
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr,
+			"usage: %s scroll <items> | list <items> | click\n",
+			argv[0]);
+		return 1;
+	}
+
+	int conn_fd = bgce_connect();
+	if (conn_fd < 0) {
+		return 1;
+	}
+	struct ServerInfo s_info;
+	if (bgce_get_server_info(conn_fd, &s_info) != 0) {
+		bgce_disconnect(conn_fd);
+		return 1;
+	}
+	struct BufferRequest req = {.width = WIDTH, .height = HEIGHT};
+	void* buffer = bgce_get_buffer(conn_fd, req);
+	if (!buffer) {
+		bgce_disconnect(conn_fd);
+		return 1;
+	}
+	struct BGTK_Context* ctx = bgtk_init(conn_fd, buffer, WIDTH, HEIGHT);
+	if (!ctx) {
+		return 1;
+	}
+
+	if (strcmp(argv[1], "scroll") == 0) {
+		int items = argc > 2 ? atoi(argv[2]) : 10000;
+		ctx->root_widget = build_list(ctx, items > 0 ? items : 1);
+	} else if (strcmp(argv[1], "list") == 0) {
+		int items = argc > 2 ? atoi(argv[2]) : 1000000;
+		ctx->root_widget =
+		    build_virtual_list(ctx, items > 0 ? items : 1);
+	} else {
+		ctx->root_widget = build_counter(ctx);
+	}
+	if (!ctx->root_widget) {
+		bgtk_destroy(ctx);
+		return 1;
+	}
+	bgtk_draw_widgets(ctx);
+
+	// The same loop as app.c
+	struct BGCEMessage msg;
+	ssize_t bytes;
+	int dirty = 0;
+	while (1) {
+		bytes = bgce_recv_msg(ctx->conn_fd, &msg);
+		if (bytes <= 0) {
+			if (bytes < 0 && errno != EINTR) {
+				perror("bgce_recv_msg");
+			}
+			break;
+		}
+		int res = 0;
+		if (msg.type == MSG_INPUT_EVENT) {
+			res = bgtk_handle_input_event(ctx, msg.data.input_event);
+		}
+		dirty |= res;
+		if (dirty && !message_waiting(ctx->conn_fd)) {
+			bgtk_present(ctx);
+			dirty = 0;
+		}
+	}
+
+	bgtk_destroy(ctx);
+	return 0;
+}
@@ -0,0 +1,107 @@
+#include <bgce.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+// The bgce.h calls BGTK and its apps make, over the stand-in protocol.
+// Linked in place of libbgce by the end-to-end benchmark client.
+
+static int send_msg(int fd, const struct Stub_Msg* m) {
+	return send(fd, m, sizeof(*m), MSG_NOSIGNAL) == sizeof(*m) ? 0 : -1;
+}
+
+static int recv_msg(int fd, struct Stub_Msg* m, uint32_t type) {
+	while (1) {
+		ssize_t n = recv(fd, m, sizeof(*m), 0);
+		if (n != sizeof(*m)) {
+			return -1;
+		}
+		if (m->type == type) {
+			return 0;
+		}
+	}
+}
+
+int bgce_connect(void) {
+	const char* path = getenv(STUB_SOCKET_ENV);
+	if (!path) {
+		fprintf(stderr, "bgce stub: %s is not set\n", STUB_SOCKET_ENV);
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void bgce_disconnect(int fd) {
+	close(fd);
+}
+
+int bgce_get_server_info(int fd, struct ServerInfo* info) {
+	struct Stub_Msg m = {.type = STUB_GET_SERVER_INFO};
+	if (send_msg(fd, &m) != 0 || recv_msg(fd, &m, STUB_SERVER_INFO) != 0) {
+		return -1;
+	}
+	// BGTK does not read the server info, it is left zeroed
+	memset(info, 0, sizeof(*info));
+	return 0;
+}
+
+void* bgce_get_buffer(int fd, struct BufferRequest req) {
+	struct Stub_Msg m = {
+	    .type = STUB_GET_BUFFER, .width = req.width, .height = req.height};
+	if (send_msg(fd, &m) != 0 || recv_msg(fd, &m, STUB_BUFFER_REPLY) != 0) {
+		return NULL;
+	}
+	int shm = shm_open(m.shm_name, O_RDWR, 0);
+	if (shm < 0) {
+		perror(m.shm_name);
+		return NULL;
+	}
+	size_t size = (size_t)m.width * m.height * sizeof(uint32_t);
+	void* buffer =
+	    mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+	close(shm);
+	return buffer == MAP_FAILED ? NULL : buffer;
+}
+
+int bgce_draw(int fd) {
+	struct Stub_Msg m = {.type = STUB_DRAW};
+	return send_msg(fd, &m);
+}
+
+ssize_t bgce_recv_msg(int fd, struct BGCEMessage* msg) {
+	struct Stub_Msg m;
+	ssize_t n;
+	do {
+		n = recv(fd, &m, sizeof(m), 0);
+		if (n <= 0) {
+			return n;
+		}
+	} while (m.type != STUB_INPUT_EVENT);
+
+	memset(msg, 0, sizeof(*msg));
+	msg->type = MSG_INPUT_EVENT;
+	msg->data.input_event.code = m.code;
+	msg->data.input_event.value = m.value;
+	msg->data.input_event.x = m.x;
+	msg->data.input_event.y = m.y;
+	return sizeof(*msg);
+}
@@ -0,0 +1,31 @@
+#ifndef E2E_PROTOCOL_H
+#define E2E_PROTOCOL_H
+
+#include <stdint.h>
+
+// Wire protocol between the stand-in server (server.c) and the stand-in
+// client library (libbgce_stub.c). It is not the real BGCE protocol: the
+// client library implements the bgce.h calls BGTK makes on top of it, so
+// BGTK itself runs unchanged over a real socket and shared memory.
+//
+// Each message is one SOCK_SEQPACKET packet holding a Stub_Msg.
+
+#define STUB_SOCKET_ENV "BGCE_STUB_SOCKET"
+
+enum Stub_Type {
+	STUB_GET_SERVER_INFO = 1,
+	STUB_SERVER_INFO,
+	STUB_GET_BUFFER,
+	STUB_BUFFER_REPLY,  // shm_name holds width * height 32-bit pixels
+	STUB_DRAW,
+	STUB_INPUT_EVENT,
+};
+
+struct Stub_Msg {
+	uint32_t type;
+	int32_t width, height;
+	int32_t code, value, x, y;  // Input event
+	char shm_name[64];
+};
+
+#endif
@@ -0,0 +1,260 @@
+#include <fcntl.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+// A stand-in BGCE server that also drives the benchmark. It starts the
+// client, answers its server info and buffer requests, then sends scripted
+// input events and timestamps the draw each one causes:
+//
+//   bgce_server [--events <n>] <client> scroll <items>
+//   bgce_server [--events <n>] <client> list <items>
+//   bgce_server [--events <n>] <client> click
+//
+// An event is sent once the previous one's frame arrived, so latency is
+// event to bgce_draw() and fps is the rate the client keeps up with.
+// Results are printed as JSON.
+
+// Compiler and flags of the build, printed with the results
+#ifndef BGTK_BUILD_FLAGS
+#define BGTK_BUILD_FLAGS "unknown"
+#endif
+
+// An event with no frame after this long counts as dropped
+#define FRAME_TIMEOUT_MS 1000
+
+struct Server {
+	int fd;
+	uint32_t* pixels;
+	size_t size;
+	char shm_name[64];
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int send_msg(int fd, const struct Stub_Msg* m) {
+	return send(fd, m, sizeof(*m), MSG_NOSIGNAL) == sizeof(*m) ? 0 : -1;
+}
+
+// Creates the shared buffer the client asked for and tells it the name.
+static int reply_buffer(struct Server* s, const struct Stub_Msg* req) {
+	s->size = (size_t)req->width * req->height * sizeof(uint32_t);
+	int shm = shm_open(s->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (shm < 0 || ftruncate(shm, s->size) != 0) {
+		perror(s->shm_name);
+		return -1;
+	}
+	s->pixels =
+	    mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+	close(shm);
+	if (s->pixels == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	struct Stub_Msg reply = {.type = STUB_BUFFER_REPLY,
+				 .width = req->width,
+				 .height = req->height};
+	snprintf(reply.shm_name, sizeof(reply.shm_name), "%s", s->shm_name);
+	return send_msg(s->fd, &reply);
+}
+
+// Serves requests until the next draw, returns 1 on a draw, 0 on timeout
+// and -1 when the client is gone.
+static int wait_draw(struct Server* s, int timeout_ms) {
+	struct pollfd p = {.fd = s->fd, .events = POLLIN};
+	while (1) {
+		int ready = poll(&p, 1, timeout_ms);
+		if (ready <= 0) {
+			return ready == 0 ? 0 : -1;
+		}
+		struct Stub_Msg m;
+		if (recv(s->fd, &m, sizeof(m), 0) != sizeof(m)) {
+			return -1;
+		}
+		switch (m.type) {
+			case STUB_DRAW:
+				return 1;
+			case STUB_GET_SERVER_INFO:
+				m.type = STUB_SERVER_INFO;
+				if (send_msg(s->fd, &m) != 0) {
+					return -1;
+				}
+				break;
+			case STUB_GET_BUFFER:
+				if (reply_buffer(s, &m) != 0) {
+					return -1;
+				}
+				break;
+		}
+	}
+}
+
+static int u64_cmp(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t* sorted, int count, int p) {
+	return count ? sorted[(count - 1) * p / 100] / 1e3 : 0;
+}
+
+// The i-th event of a scenario. Scrolling goes down for the first half and
+// back up, so the list never hits its end.
+static struct Stub_Msg scenario_event(int click, int i, int events) {
+	struct Stub_Msg m = {.type = STUB_INPUT_EVENT, .x = 20, .y = 20};
+	if (click) {
+		m.code = BTN_LEFT;
+		m.value = 1;
+	} else {
+		m.code = REL_WHEEL;
+		m.value = i < events / 2 ? -1 : 1;
+	}
+	return m;
+}
+
+static pid_t spawn_client(char** argv, const char* socket_path) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		setenv(STUB_SOCKET_ENV, socket_path, 1);
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	if (pid < 0) {
+		perror("fork");
+	}
+	return pid;
+}
+
+int main(int argc, char** argv) {
+	int events = 1000;
+	int arg = 1;
+	if (arg + 1 < argc && strcmp(argv[arg], "--events") == 0) {
+		events = atoi(argv[arg + 1]);
+		arg += 2;
+	}
+	if (arg + 1 >= argc || events <= 0) {
+		fprintf(stderr,
+			"usage: %s [--events <n>] <client> scroll <items> | "
+			"list <items> | click\n",
+			argv[0]);
+		return 1;
+	}
+	char** client_argv = argv + arg;
+	const char* scenario = argv[arg + 1];
+	int click = strcmp(scenario, "click") == 0;
+
+	struct Server s = {.fd = -1};
+	char socket_path[108];
+	snprintf(socket_path, sizeof(socket_path), "/tmp/bgce-stub-%d.sock",
+		 (int)getpid());
+	snprintf(s.shm_name, sizeof(s.shm_name), "/bgce-stub-%d", (int)getpid());
+
+	int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+	unlink(socket_path);
+	if (listener < 0 ||
+	    bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+	    listen(listener, 1) != 0) {
+		perror(socket_path);
+		return 1;
+	}
+
+	uint64_t spawned = now_ns();
+	pid_t pid = spawn_client(client_argv, socket_path);
+	int status = 1;
+	if (pid < 0) {
+		goto out;
+	}
+	struct pollfd p = {.fd = listener, .events = POLLIN};
+	if (poll(&p, 1, 30 * 1000) != 1 ||
+	    (s.fd = accept(listener, NULL, NULL)) < 0) {
+		fprintf(stderr, "bgce_server: client did not connect\n");
+		goto out;
+	}
+
+	// Startup: connect, buffer and the first frame
+	if (wait_draw(&s, 30 * 1000) != 1) {
+		fprintf(stderr, "bgce_server: no first frame from client\n");
+		goto out;
+	}
+	uint64_t first_frame = now_ns() - spawned;
+
+	uint64_t* latency = malloc(events * sizeof(uint64_t));
+	if (!latency) {
+		perror("malloc");
+		goto out;
+	}
+	int frames = 0, dropped = 0;
+	uint64_t start = now_ns();
+	for (int i = 0; i < events; i++) {
+		struct Stub_Msg m = scenario_event(click, i, events);
+		uint64_t sent = now_ns();
+		if (send_msg(s.fd, &m) != 0) {
+			break;
+		}
+		int drawn = wait_draw(&s, FRAME_TIMEOUT_MS);
+		if (drawn < 0) {
+			break;
+		}
+		if (drawn) {
+			latency[frames++] = now_ns() - sent;
+		} else {
+			dropped++;
+		}
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	qsort(latency, frames, sizeof(uint64_t), u64_cmp);
+	uint64_t sum = 0;
+	for (int i = 0; i < frames; i++) {
+		sum += latency[i];
+	}
+	printf("{\"scenario\": \"%s\", \"build\": \"%s\", \"events\": %d, "
+	       "\"frames\": %d, \"dropped\": %d, \"first_frame_ms\": %.2f, "
+	       "\"fps\": %.1f,\n"
+	       " \"latency_us\": {\"min\": %.1f, \"avg\": %.1f, \"p50\": %.1f, "
+	       "\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+	       scenario, BGTK_BUILD_FLAGS, events, frames, dropped,
+	       first_frame / 1e6, frames / (elapsed / 1e9),
+	       frames ? latency[0] / 1e3 : 0, frames ? sum / 1e3 / frames : 0,
+	       percentile_us(latency, frames, 50),
+	       percentile_us(latency, frames, 90),
+	       percentile_us(latency, frames, 99),
+	       frames ? latency[frames - 1] / 1e3 : 0);
+	free(latency);
+	status = dropped == events;
+
+out:
+	// Closing the connection ends the client's main loop
+	if (s.fd >= 0) {
+		close(s.fd);
+	}
+	if (pid > 0) {
+		int client_status;
+		waitpid(pid, &client_status, 0);
+	}
+	if (s.pixels && s.pixels != MAP_FAILED) {
+		munmap(s.pixels, s.size);
+	}
+	shm_unlink(s.shm_name);
+	close(listener);
+	unlink(socket_path);
+	return status;
+}
@@ -0,0 +1,286 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+#include FT_SIZES_H
+
+// The font path is hardcoded for simplicity.
+#define DEFAULT_FONT_PATH                                 \
+	"/usr/share/fonts/ttf-input/InputMono/InputMono/" \
+	"InputMono-Regular.ttf"
+#define DEFAULT_FONT_SIZE 12
+
+// Opens a face once per path, starting FreeType on first use. Called with
+// the registry lock held.
+static struct BGTK_Face* face_get(struct BGTK_Font_Registry* reg,
+				  const char* path) {
+	for (struct BGTK_Face* face = reg->faces; face; face = face->next) {
+		if (strcmp(face->path, path) == 0) {
+			return face;
+		}
+	}
+
+	if (!reg->library) {
+		int id = startup_begin(reg->ctx, "freetype init", NULL);
+		FT_Error err = FT_Init_FreeType(&reg->library);
+		startup_end(reg->ctx, id);
+		if (err) {
+			fprintf(stderr, "BGTK could not init FreeType library.\n");
+			reg->library = NULL;
+			return NULL;
+		}
+	}
+
+	struct BGTK_Face* face = calloc(1, sizeof(struct BGTK_Face));
+	if (!face) {
+		perror("calloc");
+		return NULL;
+	}
+	face->path = mem_strdup(reg->ctx, BGTK_MEM_STRINGS, path);
+	if (!face->path) {
+		perror("strdup");
+		free(face);
+		return NULL;
+	}
+	int id = startup_begin(reg->ctx, "face open", path);
+	FT_Error err = FT_New_Face(reg->library, path, 0, &face->ft);
+	startup_end(reg->ctx, id);
+	if (err) {
+		fprintf(stderr, "BGTK could not load font %s\n", path);
+		mem_free(reg->ctx, face->path);
+		free(face);
+		return NULL;
+	}
+	face->next = reg->faces;
+	reg->faces = face;
+	return face;
+}
+
+// Opens the sized instance of the face. Each one owns an FT_Size, so
+// switching between sizes never resets the scaler. Called with the
+// registry lock held.
+static int font_open(struct BGTK_Font* font) {
+	BGTK_TRACE_SCOPE("font_open");
+	struct BGTK_Face* face = face_get(font->registry, font->path);
+	if (!face) {
+		return -1;
+	}
+	if (FT_New_Size(face->ft, &font->size)) {
+		fprintf(stderr, "BGTK could not create font size %d\n",
+			font->pixel_size);
+		return -1;
+	}
+	FT_Activate_Size(font->size);
+	face->active = font->size;
+	if (FT_Set_Pixel_Sizes(face->ft, 0, font->pixel_size)) {
+		fprintf(stderr, "BGTK font has no size %d\n", font->pixel_size);
+		FT_Done_Size(font->size);
+		font->size = NULL;
+		face->active = NULL;
+		return -1;
+	}
+	font->face = face;
+	font->ascender = font->size->metrics.ascender >> 6;
+	font->descender = -font->size->metrics.descender >> 6;
+
+	int id = startup_begin(font->registry->ctx, "glyph cache load",
+			       font->path);
+	glyph_disk_load(font);
+	startup_end(font->registry->ctx, id);
+	return 0;
+}
+
+int font_load(struct BGTK_Font* font) {
+	if (!atomic_load_explicit(&font->ready, memory_order_acquire)) {
+		pthread_mutex_lock(&font->registry->lock);
+		if (!atomic_load_explicit(&font->ready, memory_order_relaxed)) {
+			// A font that fails to open draws nothing
+			font_open(font);
+			atomic_store_explicit(&font->ready, 1,
+					      memory_order_release);
+		}
+		pthread_mutex_unlock(&font->registry->lock);
+	}
+	return font->face ? 0 : -1;
+}
+
+// Opens the default font and renders printable ASCII while the caller
+// builds its widgets.
+static void font_prewarm(void* arg) {
+	struct BGTK_Font* font = arg;
+	if (font_load(font) != 0) {
+		return;
+	}
+	for (uint32_t c = ' '; c <= '~'; c++) {
+		glyph_get(font, c);
+	}
+}
+
+// Relative cost of rendering a byte of glyph bitmap, see mem_score()
+#define GLYPH_COST 8
+
+static size_t glyph_cache_size(struct BGTK_Context* ctx) {
+	struct BGTK_Font_Registry* reg = ctx->fonts;
+	size_t bytes = 0;
+	pthread_mutex_lock(&reg->lock);
+	for (struct BGTK_Font* font = reg->fonts; font; font = font->next) {
+		bytes += atomic_load_explicit(&font->glyph_bytes,
+					      memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&reg->lock);
+	return bytes;
+}
+
+// The font whose rendered glyphs are worth the least. Its glyphs are all
+// dropped at once, a font is rarely used for only part of its text.
+static int glyph_cache_victim(struct BGTK_Context* ctx,
+			      struct Mem_Victim* victim) {
+	struct BGTK_Font_Registry* reg = ctx->fonts;
+	*victim = (struct Mem_Victim){0};
+	pthread_mutex_lock(&reg->lock);
+	for (struct BGTK_Font* font = reg->fonts; font; font = font->next) {
+		size_t bytes = atomic_load_explicit(&font->glyph_bytes,
+						    memory_order_relaxed);
+		uint64_t score =
+		    mem_score(GLYPH_COST, ctx->frame_count - font->last_used);
+		if (bytes && (!victim->entry || score < victim->score)) {
+			*victim = (struct Mem_Victim){
+			    font, bytes, score,
+			    font->last_used == ctx->frame_count};
+		}
+	}
+	pthread_mutex_unlock(&reg->lock);
+	return victim->entry != NULL;
+}
+
+// Called by the UI thread between frames, the prewarm task is the only
+// other reader.
+static void glyph_cache_evict(struct BGTK_Context* ctx, void* entry) {
+	struct BGTK_Font_Registry* reg = ctx->fonts;
+	task_wait(reg->prewarm);
+	pthread_mutex_lock(&reg->lock);
+	glyph_cache_trim(entry);
+	pthread_mutex_unlock(&reg->lock);
+}
+
+static const struct Mem_Cache glyph_cache = {
+    .name = "glyphs",
+    .category = BGTK_MEM_GLYPHS,
+    .size = glyph_cache_size,
+    .victim = glyph_cache_victim,
+    .evict = glyph_cache_evict,
+};
+
+int fonts_init(struct BGTK_Context* ctx) {
+	struct BGTK_Font_Registry* reg =
+	    calloc(1, sizeof(struct BGTK_Font_Registry));
+	if (!reg) {
+		perror("calloc");
+		return -1;
+	}
+	pthread_mutex_init(&reg->lock, NULL);
+	reg->ctx = ctx;
+	ctx->fonts = reg;
+	mem_register_cache(ctx, &glyph_cache);
+
+	ctx->font = bgtk_font(ctx, NULL, DEFAULT_FONT_SIZE);
+	if (!ctx->font) {
+		fonts_free(ctx);
+		return -1;
+	}
+	reg->prewarm =
+	    task_start(ctx, "font prewarm", NULL, font_prewarm, ctx->font);
+	return 0;
+}
+
+void fonts_free(struct BGTK_Context* ctx) {
+	struct BGTK_Font_Registry* reg = ctx->fonts;
+	if (!reg) {
+		return;
+	}
+
+	struct BGTK_Font* font = reg->fonts;
+	while (font) {
+		struct BGTK_Font* next = font->next;
+		if (font->face) {
+			glyph_disk_save(font);
+		}
+		glyph_cache_free(font);
+		glyph_disk_close(font);
+		mem_free(ctx, font->path);
+		free(font);
+		font = next;
+	}
+
+	// Sizes are released with their face
+	struct BGTK_Face* face = reg->faces;
+	while (face) {
+		struct BGTK_Face* next = face->next;
+		FT_Done_Face(face->ft);
+		mem_free(ctx, face->path);
+		free(face);
+		face = next;
+	}
+
+	if (reg->library) {
+		FT_Done_FreeType(reg->library);
+	}
+	pthread_mutex_destroy(&reg->lock);
+	free(reg);
+	ctx->fonts = NULL;
+	ctx->font = NULL;
+}
+
+struct BGTK_Font* bgtk_font(struct BGTK_Context* ctx, const char* path,
+			    int pixel_size) {
+	struct BGTK_Font_Registry* reg = ctx->fonts;
+	if (!path) {
+		path = DEFAULT_FONT_PATH;
+	}
+
+	pthread_mutex_lock(&reg->lock);
+	struct BGTK_Font* font;
+	for (font = reg->fonts; font; font = font->next) {
+		if (font->pixel_size == pixel_size &&
+		    strcmp(font->path, path) == 0) {
+			break;
+		}
+	}
+	if (!font) {
+		// The face is opened by the first text that needs it
+		font = calloc(1, sizeof(struct BGTK_Font));
+		if (!font) {
+			perror("calloc");
+			pthread_mutex_unlock(&reg->lock);
+			return NULL;
+		}
+		font->registry = reg;
+		font->pixel_size = pixel_size;
+		font->path = mem_strdup(ctx, BGTK_MEM_STRINGS, path);
+		if (!font->path || glyph_cache_init(font) != 0) {
+			mem_free(ctx, font->path);
+			free(font);
+			pthread_mutex_unlock(&reg->lock);
+			return NULL;
+		}
+		font->next = reg->fonts;
+		reg->fonts = font;
+	}
+	pthread_mutex_unlock(&reg->lock);
+	return font;
+}
+
+void font_activate(struct BGTK_Font* font) {
+	if (font->face->active != font->size) {
+		FT_Activate_Size(font->size);
+		font->face->active = font->size;
+	}
+}
+
+struct BGTK_Font* widget_font(struct BGTK_Widget* w) {
+	return w->font ? w->font : w->ctx->font;
+}
@@ -0,0 +1,232 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Code points are cached in pages of 256 glyphs, allocated the first time
+// one of their code points is drawn
+#define GLYPH_PAGE_SIZE 256
+#define GLYPH_PAGES (0x110000 / GLYPH_PAGE_SIZE)
+
+struct BGTK_Glyph_Page {
+	struct BGTK_Glyph glyphs[GLYPH_PAGE_SIZE];
+};
+
+// Rendered glyphs of one font indexed by code point. The first page, which
+// holds ASCII, is always there. FreeType is only entered on a miss, under
+// the registry lock, so the raster workers can share the cache.
+struct BGTK_Glyph_Cache {
+	struct BGTK_Glyph_Page first;
+	struct BGTK_Glyph empty;
+	_Atomic(struct BGTK_Glyph_Page*) pages[GLYPH_PAGES];
+};
+
+int glyph_cache_init(struct BGTK_Font* font) {
+	font->glyphs = mem_calloc(font->registry->ctx, BGTK_MEM_GLYPHS, 1,
+				  sizeof(struct BGTK_Glyph_Cache));
+	if (!font->glyphs) {
+		perror("calloc");
+		return -1;
+	}
+	atomic_store(&font->glyphs->pages[0], &font->glyphs->first);
+	return 0;
+}
+
+void glyph_cache_free(struct BGTK_Font* font) {
+	struct BGTK_Context* ctx = font->registry->ctx;
+	struct BGTK_Glyph_Cache* cache = font->glyphs;
+	if (!cache) {
+		return;
+	}
+	for (int p = 0; p < GLYPH_PAGES; p++) {
+		struct BGTK_Glyph_Page* page = atomic_load(&cache->pages[p]);
+		if (!page) {
+			continue;
+		}
+		for (int i = 0; i < GLYPH_PAGE_SIZE; i++) {
+			// Bitmaps read from the disk cache live in its mapping
+			if (!glyph_disk_owns(font, page->glyphs[i].bitmap)) {
+				mem_free(ctx, page->glyphs[i].bitmap);
+			}
+		}
+		if (page != &cache->first) {
+			mem_free(ctx, page);
+		}
+	}
+	mem_free(ctx, cache);
+	font->glyphs = NULL;
+}
+
+// Drops the glyphs rendered through FreeType, which are rendered again
+// when next drawn. Glyphs in the disk cache mapping stay, as do the pages
+// holding them. Nothing may read the cache meanwhile.
+void glyph_cache_trim(struct BGTK_Font* font) {
+	struct BGTK_Context* ctx = font->registry->ctx;
+	struct BGTK_Glyph_Cache* cache = font->glyphs;
+	for (int p = 0; p < GLYPH_PAGES; p++) {
+		struct BGTK_Glyph_Page* page = atomic_load(&cache->pages[p]);
+		if (!page) {
+			continue;
+		}
+		int kept = 0;
+		for (int i = 0; i < GLYPH_PAGE_SIZE; i++) {
+			struct BGTK_Glyph* g = &page->glyphs[i];
+			if (g->bitmap && glyph_disk_owns(font, g->bitmap)) {
+				kept = 1;
+				continue;
+			}
+			mem_free(ctx, g->bitmap);
+			memset(g, 0, sizeof(*g));
+		}
+		if (!kept && page != &cache->first) {
+			atomic_store(&cache->pages[p], NULL);
+			mem_free(ctx, page);
+		}
+	}
+	atomic_store_explicit(&font->glyph_bytes, 0, memory_order_relaxed);
+}
+
+// Loads and renders one glyph into the cache entry. Called with the
+// registry lock held.
+static void glyph_load(struct BGTK_Font* font, struct BGTK_Glyph* g,
+		       uint32_t c) {
+	BGTK_TRACE_SCOPE("glyph_load");
+	if (!font->face) {
+		return;
+	}
+	FT_Face face = font->face->ft;
+	font_activate(font);
+	FT_UInt index = FT_Get_Char_Index(face, c);
+	font->disk_dirty = 1;
+	if (FT_Load_Glyph(face, index, BGTK_GLYPH_LOAD_FLAGS) ||
+	    FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) {
+		// Cache the failure as an empty glyph
+		return;
+	}
+
+	FT_GlyphSlot slot = face->glyph;
+	FT_Bitmap* bitmap = &slot->bitmap;
+	g->width = bitmap->width;
+	g->rows = bitmap->rows;
+	g->left = slot->bitmap_left;
+	g->top = slot->bitmap_top;
+	g->advance = slot->advance.x;
+
+	// Store the coverage rows tightly packed
+	if (g->width > 0 && g->rows > 0) {
+		g->bitmap = mem_alloc(font->registry->ctx, BGTK_MEM_GLYPHS,
+				      (size_t)g->width * g->rows);
+		if (!g->bitmap) {
+			perror("malloc");
+			g->width = 0;
+			g->rows = 0;
+			return;
+		}
+		atomic_fetch_add_explicit(&font->glyph_bytes,
+					  (size_t)g->width * g->rows,
+					  memory_order_relaxed);
+		for (int row = 0; row < g->rows; row++) {
+			memcpy(g->bitmap + row * g->width,
+			       bitmap->buffer + row * bitmap->pitch, g->width);
+		}
+	}
+}
+
+// Returns the cache entry of c, allocating its page. Called with the
+// registry lock held.
+struct BGTK_Glyph* glyph_slot(struct BGTK_Font* font, uint32_t c) {
+	struct BGTK_Glyph_Cache* cache = font->glyphs;
+	struct BGTK_Glyph_Page* page = atomic_load_explicit(
+	    &cache->pages[c / GLYPH_PAGE_SIZE], memory_order_relaxed);
+	if (!page) {
+		page = mem_calloc(font->registry->ctx, BGTK_MEM_GLYPHS, 1,
+				  sizeof(struct BGTK_Glyph_Page));
+		if (!page) {
+			perror("calloc");
+			return NULL;
+		}
+		atomic_store_explicit(&cache->pages[c / GLYPH_PAGE_SIZE], page,
+				      memory_order_release);
+	}
+	return &page->glyphs[c % GLYPH_PAGE_SIZE];
+}
+
+const struct BGTK_Glyph* glyph_get(struct BGTK_Font* font, uint32_t c) {
+	struct BGTK_Glyph_Cache* cache = font->glyphs;
+	if (c >= 0x110000) {
+		c = 0xFFFD;
+	}
+
+	struct BGTK_Glyph_Page* page = atomic_load_explicit(
+	    &cache->pages[c / GLYPH_PAGE_SIZE], memory_order_acquire);
+	if (page) {
+		struct BGTK_Glyph* g = &page->glyphs[c % GLYPH_PAGE_SIZE];
+		if (atomic_load_explicit(&g->loaded, memory_order_acquire)) {
+			return g;
+		}
+	}
+
+	pthread_mutex_lock(&font->registry->lock);
+	struct BGTK_Glyph* g = glyph_slot(font, c);
+	if (!g) {
+		// Draw nothing for it rather than fail the frame
+		pthread_mutex_unlock(&font->registry->lock);
+		return &cache->empty;
+	}
+	if (!atomic_load_explicit(&g->loaded, memory_order_relaxed)) {
+		glyph_load(font, g, c);
+		atomic_store_explicit(&g->loaded, 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&font->registry->lock);
+	return g;
+}
+
+// Calls fn for every loaded glyph of the font.
+void glyph_cache_foreach(struct BGTK_Font* font,
+			 void (*fn)(void* arg, uint32_t c,
+				    const struct BGTK_Glyph* g),
+			 void* arg) {
+	struct BGTK_Glyph_Cache* cache = font->glyphs;
+	for (int p = 0; p < GLYPH_PAGES; p++) {
+		struct BGTK_Glyph_Page* page = atomic_load(&cache->pages[p]);
+		if (!page) {
+			continue;
+		}
+		for (int i = 0; i < GLYPH_PAGE_SIZE; i++) {
+			if (atomic_load(&page->glyphs[i].loaded)) {
+				fn(arg, p * GLYPH_PAGE_SIZE + i,
+				   &page->glyphs[i]);
+			}
+		}
+	}
+}
+
+void text_iter_init(struct BGTK_Text_Iter* it, struct BGTK_Font* font,
+		    const char* text, int length) {
+	font_load(font);
+	it->font = font;
+	it->p = text;
+	it->end = text + length;
+	it->ascii = utf8_is_ascii(text, length);
+}
+
+const struct BGTK_Glyph* text_iter_next(struct BGTK_Text_Iter* it) {
+	if (it->p >= it->end) {
+		return NULL;
+	}
+
+	// ASCII-only strings index the first page directly
+	if (it->ascii) {
+		struct BGTK_Glyph* g =
+		    &it->font->glyphs->first.glyphs[(unsigned char)*it->p];
+		if (atomic_load_explicit(&g->loaded, memory_order_acquire)) {
+			it->p++;
+			return g;
+		}
+		return glyph_get(it->font, (unsigned char)*it->p++);
+	}
+	return glyph_get(it->font, utf8_next(&it->p, it->end));
+}
@@ -0,0 +1,303 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Rendered glyphs are kept between runs in one file per font file, pixel
+// size and load flags:
+//
+//   header | entries[count] | coverage bitmaps
+//
+// The file is memory-mapped read-only and the cached glyphs point straight
+// into the mapping, so a warm start renders nothing through FreeType.
+//
+// A font file whose device, inode, size and modification time are those in
+// the header is taken as unchanged. Its contents are only hashed when these
+// differ, e.g. after a copy, and the cache is still used if they match.
+#define DISK_MAGIC "BGTKGLY1"
+#define DISK_VERSION 2
+
+// What stat() says about the font file
+struct Disk_Key {
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	int64_t mtime_ns;
+};
+
+struct Disk_Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t pixel_size;
+	uint64_t font_hash;
+	struct Disk_Key font_key;
+	uint32_t load_flags;
+	uint32_t count;
+};
+
+struct Disk_Entry {
+	uint32_t codepoint;
+	int32_t width, rows;
+	int32_t left, top;
+	int32_t advance;
+	uint32_t offset;  // Into the bitmap block
+};
+
+// Hashes the font file contents with 64-bit FNV-1a.
+static uint64_t file_hash(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	const unsigned char* data =
+	    mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (off_t i = 0; i < st.st_size; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	munmap((void*)data, st.st_size);
+	return hash ? hash : 1;
+}
+
+// Hashes the font file's contents once per face, 0 if it cannot be read.
+static uint64_t face_hash(struct BGTK_Face* face) {
+	if (!face->hash) {
+		face->hash = file_hash(face->path);
+	}
+	return face->hash;
+}
+
+// Fills key from the font file's metadata. Returns -1 if it has none.
+static int file_key(const char* path, struct Disk_Key* key) {
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return -1;
+	}
+	*key = (struct Disk_Key){
+	    .device = st.st_dev,
+	    .inode = st.st_ino,
+	    .size = st.st_size,
+	    .mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+			st.st_mtim.tv_nsec,
+	};
+	return 0;
+}
+
+// Writes the cache file path for the font into out, creating the cache
+// directory. Returns -1 when there is nowhere to keep it.
+static int disk_path(struct BGTK_Font* font, char* out, size_t size) {
+	char dir[512];
+	const char* xdg = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	if (xdg && *xdg) {
+		snprintf(dir, sizeof(dir), "%s", xdg);
+	} else if (home && *home) {
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	} else {
+		return -1;
+	}
+	mkdir(dir, 0755);
+	size_t len = strlen(dir);
+	snprintf(dir + len, sizeof(dir) - len, "/bgtk");
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		return -1;
+	}
+
+	// Named after the font's path, which is cheap to hash
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (const char* p = font->face->path; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+	int n = snprintf(out, size, "%s/glyphs-%016llx-%d-%x.bin", dir,
+			 (unsigned long long)hash, font->pixel_size,
+			 (unsigned)BGTK_GLYPH_LOAD_FLAGS);
+	return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+void glyph_disk_load(struct BGTK_Font* font) {
+	char path[640];
+	if (disk_path(font, path, sizeof(path)) != 0) {
+		return;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof(struct Disk_Header)) {
+		close(fd);
+		return;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
+
+	// Anything that does not match exactly is ignored and rewritten
+	size_t size = st.st_size;
+	const struct Disk_Header* h = map;
+	const struct Disk_Entry* entries =
+	    (const void*)((const char*)map + sizeof(*h));
+	if (memcmp(h->magic, DISK_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != DISK_VERSION ||
+	    h->pixel_size != (uint32_t)font->pixel_size ||
+	    h->load_flags != (uint32_t)BGTK_GLYPH_LOAD_FLAGS ||
+	    h->count > (size - sizeof(*h)) / sizeof(struct Disk_Entry)) {
+		munmap(map, size);
+		return;
+	}
+
+	// The contents are only read when the metadata changed
+	struct Disk_Key key;
+	int moved = file_key(font->face->path, &key) != 0 ||
+		    memcmp(&key, &h->font_key, sizeof(key)) != 0;
+	if (moved && face_hash(font->face) != h->font_hash) {
+		munmap(map, size);
+		return;
+	}
+	font->face->hash = h->font_hash;
+	const uint8_t* bitmaps = (const uint8_t*)(entries + h->count);
+	size_t bitmaps_size = size - ((const char*)bitmaps - (const char*)map);
+
+	for (uint32_t i = 0; i < h->count; i++) {
+		const struct Disk_Entry* e = &entries[i];
+		size_t bytes = (size_t)e->width * e->rows;
+		if (e->codepoint >= 0x110000 || e->width < 0 || e->rows < 0 ||
+		    e->offset > bitmaps_size ||
+		    bytes > bitmaps_size - e->offset) {
+			continue;
+		}
+		struct BGTK_Glyph* g = glyph_slot(font, e->codepoint);
+		if (!g) {
+			break;
+		}
+		g->width = e->width;
+		g->rows = e->rows;
+		g->left = e->left;
+		g->top = e->top;
+		g->advance = e->advance;
+		g->bitmap = bytes ? (uint8_t*)bitmaps + e->offset : NULL;
+		atomic_store_explicit(&g->loaded, 1, memory_order_release);
+	}
+	font->disk_map = map;
+	font->disk_size = size;
+	// Written again with the new metadata
+	font->disk_dirty = moved;
+}
+
+struct Disk_Writer {
+	struct Disk_Entry* entries;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t bitmap_size;
+};
+
+static void collect_glyph(void* arg, uint32_t c, const struct BGTK_Glyph* g) {
+	struct Disk_Writer* w = arg;
+	if (w->count == w->capacity) {
+		uint32_t capacity = w->capacity ? w->capacity * 2 : 256;
+		struct Disk_Entry* entries =
+		    realloc(w->entries, capacity * sizeof(struct Disk_Entry));
+		if (!entries) {
+			return;
+		}
+		w->entries = entries;
+		w->capacity = capacity;
+	}
+	w->entries[w->count++] = (struct Disk_Entry){
+	    .codepoint = c,
+	    .width = g->width,
+	    .rows = g->rows,
+	    .left = g->left,
+	    .top = g->top,
+	    .advance = g->advance,
+	    .offset = w->bitmap_size,
+	};
+	w->bitmap_size += g->width * g->rows;
+}
+
+void glyph_disk_save(struct BGTK_Font* font) {
+	if (!font->disk_dirty) {
+		return;
+	}
+	char path[640];
+	struct Disk_Key key;
+	if (disk_path(font, path, sizeof(path)) != 0 ||
+	    file_key(font->face->path, &key) != 0 || !face_hash(font->face)) {
+		return;
+	}
+
+	struct Disk_Writer w = {0};
+	glyph_cache_foreach(font, collect_glyph, &w);
+
+	// Written beside the old file and renamed over it, so a process
+	// mapping the old one never sees a partial file
+	char tmp[660];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	FILE* f = fopen(tmp, "wb");
+	if (!f) {
+		free(w.entries);
+		return;
+	}
+
+	struct Disk_Header h = {
+	    .version = DISK_VERSION,
+	    .pixel_size = font->pixel_size,
+	    .font_hash = font->face->hash,
+	    .font_key = key,
+	    .load_flags = BGTK_GLYPH_LOAD_FLAGS,
+	    .count = w.count,
+	};
+	memcpy(h.magic, DISK_MAGIC, sizeof(h.magic));
+	int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		 fwrite(w.entries, sizeof(struct Disk_Entry), w.count, f) ==
+		     w.count;
+	for (uint32_t i = 0; ok && i < w.count; i++) {
+		const struct BGTK_Glyph* g = glyph_get(font, w.entries[i].codepoint);
+		size_t bytes = (size_t)g->width * g->rows;
+		ok = bytes == 0 || fwrite(g->bitmap, 1, bytes, f) == bytes;
+	}
+	if (fclose(f) != 0) {
+		ok = 0;
+	}
+	if (!ok || rename(tmp, path) != 0) {
+		unlink(tmp);
+	}
+	free(w.entries);
+	font->disk_dirty = 0;
+}
+
+void glyph_disk_close(struct BGTK_Font* font) {
+	if (font->disk_map) {
+		munmap(font->disk_map, font->disk_size);
+		font->disk_map = NULL;
+		font->disk_size = 0;
+	}
+}
+
+int glyph_disk_owns(struct BGTK_Font* font, const void* p) {
+	const char* base = font->disk_map;
+	return base && (const char*)p >= base &&
+	       (const char*)p < base + font->disk_size;
+}
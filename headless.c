@@ -0,0 +1,215 @@
+#include <bgce.h>
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+struct BGTK_Context* bgtk_init_headless(int width, int height) {
+	struct BGTK_Context* ctx = bgtk_init(-1, NULL, width, height);
+	if (!ctx) {
+		return NULL;
+	}
+	ctx->headless = 1;
+	ctx->shm_buffer =
+	    mem_calloc(ctx, BGTK_MEM_BUFFERS, (size_t)width * height,
+		       pixel_size(ctx->format));
+	if (!ctx->shm_buffer) {
+		perror("calloc");
+		bgtk_destroy(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+int bgtk_inject_event(struct BGTK_Context* ctx, struct InputEvent ev) {
+	// The same as the main loop of an app does with a server event
+	int redraw = bgtk_handle_input_event(ctx, ev);
+	if (redraw) {
+		bgtk_present(ctx);
+	}
+	return redraw;
+}
+
+int bgtk_inject_click(struct BGTK_Context* ctx, int x, int y) {
+	struct InputEvent press = {.code = BTN_LEFT, .value = 1, .x = x, .y = y};
+	struct InputEvent release = press;
+	release.value = 0;
+	int redraw = bgtk_inject_event(ctx, press);
+	return bgtk_inject_event(ctx, release) || redraw;
+}
+
+int bgtk_inject_scroll(struct BGTK_Context* ctx, int x, int y, int delta) {
+	struct InputEvent wheel = {
+	    .code = REL_WHEEL, .value = delta, .x = x, .y = y};
+	return bgtk_inject_event(ctx, wheel);
+}
+
+// Converts row y of the presented frame to packed RGB.
+static void frame_row_rgb(struct BGTK_Context* ctx, int y, uint8_t* out) {
+	// Through ARGB8888 in chunks, whatever the frame's format is
+	struct BGTK_Surface front = front_buffer(ctx);
+	uint32_t chunk[256];
+	struct BGTK_Surface argb = {.pixels = chunk,
+				    .format = BGTK_FORMAT_ARGB8888,
+				    .width = 256,
+				    .height = 1,
+				    .stride = 256};
+	for (int x0 = 0; x0 < ctx->width; x0 += 256) {
+		int n = ctx->width - x0 < 256 ? ctx->width - x0 : 256;
+		copy_rect(&argb, 0, 0, &front, x0, y, n, 1);
+		for (int i = 0; i < n; i++) {
+			uint8_t* p = out + (x0 + i) * 3;
+			p[0] = (chunk[i] >> 16) & 0xFF;
+			p[1] = (chunk[i] >> 8) & 0xFF;
+			p[2] = chunk[i] & 0xFF;
+		}
+	}
+}
+
+int bgtk_write_ppm(struct BGTK_Context* ctx, const char* path) {
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	uint8_t* rgb = malloc((size_t)ctx->width * 3);
+	if (!rgb) {
+		perror("malloc");
+		fclose(f);
+		return -1;
+	}
+
+	int ok = fprintf(f, "P6\n%d %d\n255\n", ctx->width, ctx->height) > 0;
+	for (int y = 0; ok && y < ctx->height; y++) {
+		frame_row_rgb(ctx, y, rgb);
+		ok = fwrite(rgb, 3, ctx->width, f) == (size_t)ctx->width;
+	}
+	free(rgb);
+	if (fclose(f) != 0 || !ok) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+// --- PNG ---
+
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t* data, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+static void put_be32(uint8_t* p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// Writes one chunk: length, type, data and the CRC of type and data.
+static int png_chunk(FILE* f, const char* type, const uint8_t* data,
+		     uint32_t length) {
+	uint8_t head[8];
+	put_be32(head, length);
+	memcpy(head + 4, type, 4);
+	uint32_t crc = crc_update(0xFFFFFFFFu, head + 4, 4);
+	crc = crc_update(crc, data, length) ^ 0xFFFFFFFFu;
+	uint8_t tail[4];
+	put_be32(tail, crc);
+	return fwrite(head, 1, 8, f) == 8 &&
+	       (length == 0 || fwrite(data, 1, length, f) == length) &&
+	       fwrite(tail, 1, 4, f) == 4;
+}
+
+// The image data is a zlib stream of stored (uncompressed) deflate blocks,
+// which keeps the writer free of a zlib dependency. Frame dumps are for
+// comparing pixels, not for shipping.
+int bgtk_write_png(struct BGTK_Context* ctx, const char* path) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, crc_init);
+
+	// Each row is a filter type byte (0, none) and the RGB pixels
+	size_t row = 1 + (size_t)ctx->width * 3;
+	size_t raw_size = row * ctx->height;
+	size_t blocks = (raw_size + 65534) / 65535;
+	size_t zlib_size = 2 + blocks * 5 + raw_size + 4;
+	uint8_t* raw = malloc(raw_size);
+	uint8_t* zlib = malloc(zlib_size);
+	if (!raw || !zlib) {
+		perror("malloc");
+		free(raw);
+		free(zlib);
+		return -1;
+	}
+	for (int y = 0; y < ctx->height; y++) {
+		raw[y * row] = 0;
+		frame_row_rgb(ctx, y, raw + y * row + 1);
+	}
+
+	uint8_t* z = zlib;
+	*z++ = 0x78;  // Deflate, 32K window
+	*z++ = 0x01;  // No preset dictionary, check bits
+	uint32_t a = 1, b = 0;
+	for (size_t off = 0; off < raw_size; off += 65535) {
+		size_t n = raw_size - off < 65535 ? raw_size - off : 65535;
+		*z++ = off + n == raw_size;  // BFINAL, BTYPE 00
+		*z++ = n & 0xFF;
+		*z++ = n >> 8;
+		*z++ = ~n & 0xFF;
+		*z++ = (~n >> 8) & 0xFF;
+		memcpy(z, raw + off, n);
+		z += n;
+		for (size_t i = 0; i < n; i++) {
+			a = (a + raw[off + i]) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+	put_be32(z, (b << 16) | a);
+	z += 4;
+	free(raw);
+
+	uint8_t ihdr[13];
+	put_be32(ihdr, ctx->width);
+	put_be32(ihdr + 4, ctx->height);
+	ihdr[8] = 8;	// Bits per channel
+	ihdr[9] = 2;	// Truecolor
+	ihdr[10] = 0;	// Deflate
+	ihdr[11] = 0;	// Adaptive filtering
+	ihdr[12] = 0;	// No interlace
+
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		free(zlib);
+		return -1;
+	}
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G',
+					     '\r', '\n', 0x1A, '\n'};
+	int ok = fwrite(signature, 1, 8, f) == 8 &&
+		 png_chunk(f, "IHDR", ihdr, sizeof(ihdr)) &&
+		 png_chunk(f, "IDAT", zlib, z - zlib) &&
+		 png_chunk(f, "IEND", NULL, 0);
+	free(zlib);
+	if (fclose(f) != 0 || !ok) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
@@ -6,18 +6,399 @@
 #include <stdint.h>
 #include FT_FREETYPE_H
 #include <bgce.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// A few basic colors (0xAARRGGBB)
+#define BGTK_COLOR_BG 0xFFCCCCCC     // Light Gray
+#define BGTK_COLOR_BTN 0xFF007BFF    // Blue
+#define BGTK_COLOR_TEXT 0xFF000000   // Black
+#define BGTK_COLOR_WHITE 0xFFFFFFFF  // White
+
+// Default cap on the pixel memory of retained widget layers
+#define BGTK_DEFAULT_LAYER_BUDGET (4 << 20)
+
+// How glyphs are loaded before being rendered to 8-bit coverage. Part of
+// the on-disk glyph cache key.
+#define BGTK_GLYPH_LOAD_FLAGS (FT_LOAD_DEFAULT | FT_LOAD_TARGET_LIGHT)
+
+// A rendered glyph: 8-bit coverage rows plus metrics in pixels, except the
+// advance which is kept in 26.6 units.
+struct BGTK_Glyph {
+	atomic_int loaded;
+	int width, rows;
+	int left, top;
+	int advance;
+	uint8_t* bitmap;
+};
+
+// An open font file, shared by all its sizes. active is the FT_Size the
+// face currently scales with.
+struct BGTK_Face {
+	char* path;
+	uint64_t hash;	// Hash of the font file, 0 until computed
+	FT_Face ft;
+	FT_Size active;
+	struct BGTK_Face* next;
+};
+
+// One face at one pixel size, with its own glyph cache. Handed out by
+// bgtk_font() and owned by the registry. The face, size and metrics are
+// only valid once font_load() has run.
+struct BGTK_Font {
+	struct BGTK_Font_Registry* registry;
+	char* path;
+	int pixel_size;
+	atomic_int ready;	 // font_load() ran, face is NULL if it failed
+	struct BGTK_Face* face;
+	FT_Size size;
+	int ascender;	// Pixels above the baseline
+	int descender;	// Pixels below the baseline
+	struct BGTK_Glyph_Cache* glyphs;
+	atomic_size_t glyph_bytes;  // Rendered bitmaps, not the disk cache's
+	unsigned long last_used;    // Frame text was last recorded in
+
+	// Glyphs read from the on-disk cache, and whether glyphs were
+	// rendered since, so the file should be written again
+	void* disk_map;
+	size_t disk_size;
+	int disk_dirty;
+
+	struct BGTK_Font* next;
+};
+
+// Faces and sizes opened by a context. FreeType is only entered with the
+// lock held, since the sizes of a face share its glyph slot.
+struct BGTK_Font_Registry {
+	struct BGTK_Context* ctx;
+	pthread_mutex_t lock;
+	FT_Library library;  // Started by the first face opened
+	struct BGTK_Face* faces;
+	struct BGTK_Font* fonts;
+	struct BGTK_Task* prewarm;  // Renders ASCII of the default font
+};
+
+// Display list commands, recorded by the paint pass and replayed by the
+// executor.
+enum BGTK_Command_Type {
+	BGTK_CMD_FILL_RECT,
+	BGTK_CMD_GLYPH_RUN,
+	BGTK_CMD_IMAGE,
+	BGTK_CMD_COPY,
+};
+
+struct BGTK_Command {
+	enum BGTK_Command_Type type;
+	struct BGTK_Rect bounds;  // Every pixel the command may write
+	uint32_t color;		  // Fill and glyph color
+	int x, y;		  // Glyph run pen origin
+	int text, length;	  // Glyph run string in the list's text arena
+	struct BGTK_Font* font;	  // Glyph run font
+	struct BGTK_Surface src;  // Image and copy source
+	int sx, sy;		  // Source pixel mapped to bounds.x/y
+	unsigned version;	  // Changes whenever src is redrawn
+	int opaque;		  // Overwrites every pixel of bounds
+	int blend;		  // BGTK_Blend_Mode
+	unsigned opacity;	  // Image and copy source fade, 0-255
+	struct BGTK_Widget* owner;  // Widget that recorded it, for diffing
+	// A layered widget records its content as shadows after the blit of
+	// its layer. Shadows are only diffed, the blit is only drawn, so a
+	// widget diffs the same whether it has a layer or not.
+	int shadow;  // 2 inside a faded or blended layer
+	int layer;   // Blit of a layer
+};
+
+struct BGTK_Display_List {
+	struct BGTK_Context* ctx;  // Accounts the arrays below
+	struct BGTK_Command* commands;
+	int count;
+	int capacity;
+	char* text;  // NUL-terminated glyph run strings
+	int text_length;
+	int text_capacity;
+
+	// Commands left after culling and merging, ready to execute
+	struct BGTK_Command* exec;
+	int exec_count;
+	int exec_capacity;
+
+	_Atomic uint64_t copy_ns;  // Spent executing scroll copies
+
+	// Applied to what is recorded, set while recording a faded or
+	// blended subtree
+	unsigned opacity;
+	int blend;
+	struct BGTK_Widget* owner;  // Widget being recorded
+	int shadow;		    // Recording the content of a layer
+};
+
+// An entry a cache offers for eviction. Lower scores go first.
+struct Mem_Victim {
+	void* entry;
+	size_t bytes;
+	uint64_t score;
+	int in_use;  // Drawn in the last frame, it would be rebuilt right away
+};
+
+// A cache registered with memory.c, evicted from when its category is over
+// budget, the context over its limit or the app reports memory pressure.
+// victim() returns 0 when nothing is left to evict.
+struct Mem_Cache {
+	const char* name;
+	enum BGTK_Memory_Category category;
+	size_t (*size)(struct BGTK_Context* ctx);
+	int (*victim)(struct BGTK_Context* ctx, struct Mem_Victim* victim);
+	void (*evict)(struct BGTK_Context* ctx, void* entry);
+};
+
+// Parts of a frame timed by stats.c
+enum BGTK_Frame_Phase {
+	BGTK_PHASE_EVENT,
+	BGTK_PHASE_LAYOUT,
+	BGTK_PHASE_RASTER,
+	BGTK_PHASE_SCROLL,
+	BGTK_PHASE_PRESENT,
+	BGTK_PHASE_COUNT,
+};
+
+// Start of a timed phase, and the time already charged to the frame then
+struct Frame_Mark {
+	uint64_t start;
+	uint64_t spent;
+};
+
+// from bgtk.c
+uint64_t now_ns(void);
+void request_frame(struct BGTK_Context* ctx);
+
+// Tracing levels. BGTK_TRACE_LEVEL is the most detailed level compiled in,
+// anything above it compiles to nothing. At run time BGTK_LOG selects the
+// messages printed and BGTK_TRACE=<file> records scoped events, written as
+// Chrome trace JSON by bgtk_destroy().
+#define BGTK_LEVEL_INFO 1
+#define BGTK_LEVEL_DEBUG 2
+#define BGTK_LEVEL_TRACE 3  // Scoped events
+
+#ifndef BGTK_TRACE_LEVEL
+#define BGTK_TRACE_LEVEL BGTK_LEVEL_INFO
+#endif
+
+extern int trace_log_level;
+extern int trace_events_on;
+
+#define BGTK_LOG(level, ...)                                        \
+	do {                                                        \
+		if ((level) <= BGTK_TRACE_LEVEL &&                  \
+		    (level) <= trace_log_level) {                   \
+			trace_log((level), __VA_ARGS__);            \
+		}                                                   \
+	} while (0)
+
+// A named span from here to the end of the enclosing block
+struct Trace_Scope {
+	const char* name;
+	uint64_t start;	 // 0 when tracing was off at the start
+};
+
+#define BGTK_TRACE_CAT_(a, b) a##b
+#define BGTK_TRACE_CAT(a, b) BGTK_TRACE_CAT_(a, b)
+#if BGTK_TRACE_LEVEL >= BGTK_LEVEL_TRACE
+#define BGTK_TRACE_SCOPE(name)                                         \
+	struct Trace_Scope BGTK_TRACE_CAT(trace_scope_, __LINE__)      \
+	    __attribute__((cleanup(trace_scope_end))) = {              \
+		(name), trace_events_on ? now_ns() : 0}
+#else
+#define BGTK_TRACE_SCOPE(name) \
+	do {                   \
+	} while (0)
+#endif
+
+// One string of a batch of glyph runs
+struct BGTK_Glyph_Run {
+	const char* text;
+	int length;
+	struct BGTK_Font* font;
+	int x, y;
+};
+
+// Walks the glyphs of a UTF-8 string. Strings found to be all ASCII skip
+// the decoder.
+struct BGTK_Text_Iter {
+	struct BGTK_Font* font;
+	const char* p;
+	const char* end;
+	int ascii;
+};
+
+// from pixel.c
+int pixel_size(int format);
+int clip_bounds(struct BGTK_Surface* dst, int* x1, int* y1, int* x2,
+		int* y2);
+void draw_rect(struct BGTK_Surface* dst, int x, int y, int w, int h,
+	       uint32_t color, int mode);
+void copy_rect(struct BGTK_Surface* dst, int dx, int dy,
+	       struct BGTK_Surface* src, int sx, int sy, int w, int h);
+void blend_rect(struct BGTK_Surface* dst, int dx, int dy,
+		struct BGTK_Surface* src, int sx, int sy, int w, int h,
+		int mode, unsigned opacity);
+void draw_glyph(struct BGTK_Surface* dst, const struct BGTK_Glyph* glyph,
+		int gx, int gy, uint32_t color, int mode);
 
 // from drawing.c
-void clear_buffer(struct BGTK_Context* ctx);
-void draw_rect(struct BGTK_Context* ctx, uint32_t* pixels, int x, int y, int w,
-	       int h, uint32_t color);
-void measure_text(FT_Face face, const char* text, int* out_width,
-		  int* out_height);
-void calculate_widget_size(struct BGTK_Context* ctx, struct BGTK_Widget* w);
-void draw_text(struct BGTK_Context* ctx, uint32_t* pixels, const char* text,
-	       int x, int y, uint32_t color);
-void draw_widget(struct BGTK_Context* ctx, struct BGTK_Widget* w,
-		 uint32_t* pixels);
-int load_image(const char* path, uint32_t** out_pixels, int* out_w, int* out_h);
+struct BGTK_Rect rect_union(struct BGTK_Rect a, struct BGTK_Rect b);
+struct BGTK_Rect rect_intersect(struct BGTK_Rect a, struct BGTK_Rect b);
+struct BGTK_Rect text_bounds(struct BGTK_Font* font, const char* text,
+			     int length, int x, int y);
+void draw_text(struct BGTK_Font* font, struct BGTK_Surface* dst,
+	       const char* text, int x, int y, uint32_t color);
+void draw_glyph_runs(struct BGTK_Surface* dst,
+		     const struct BGTK_Glyph_Run* runs, int count,
+		     uint32_t color, int mode);
+int scroll_content_surface(struct BGTK_Widget* w, struct BGTK_Surface* out);
+void scroll_cache_init(struct BGTK_Context* ctx);
+int load_image(struct BGTK_Context* ctx, const char* path,
+	       uint32_t** out_pixels, int* out_w, int* out_h, int* out_opaque);
+void image_free(struct BGTK_Context* ctx, uint32_t* pixels, int w, int h);
+
+// from displaylist.c
+void display_list_free(struct BGTK_Display_List* list);
+void record_widget(struct BGTK_Context* ctx, struct BGTK_Display_List* list,
+		   struct BGTK_Widget* w);
+struct BGTK_Rect paint_widget_to(struct BGTK_Context* ctx,
+				 struct BGTK_Widget* w, struct BGTK_Surface* dst,
+				 int ox, int oy);
+void record_blit(struct BGTK_Display_List* list, enum BGTK_Command_Type type,
+		 struct BGTK_Surface src, int sx, int sy, int x, int y, int w,
+		 int h, unsigned version, int opaque);
+void execute_commands(struct BGTK_Display_List* list, const int* order,
+		      int count, struct BGTK_Surface* dst);
+void render_frame(struct BGTK_Context* ctx, int full);
+
+// from font.c
+int fonts_init(struct BGTK_Context* ctx);
+void fonts_free(struct BGTK_Context* ctx);
+int font_load(struct BGTK_Font* font);
+void font_activate(struct BGTK_Font* font);
+struct BGTK_Font* widget_font(struct BGTK_Widget* w);
+
+// from glyphdisk.c
+void glyph_disk_load(struct BGTK_Font* font);
+void glyph_disk_save(struct BGTK_Font* font);
+void glyph_disk_close(struct BGTK_Font* font);
+int glyph_disk_owns(struct BGTK_Font* font, const void* p);
+
+// from glyph.c
+int glyph_cache_init(struct BGTK_Font* font);
+void glyph_cache_free(struct BGTK_Font* font);
+void glyph_cache_trim(struct BGTK_Font* font);
+const struct BGTK_Glyph* glyph_get(struct BGTK_Font* font, uint32_t c);
+struct BGTK_Glyph* glyph_slot(struct BGTK_Font* font, uint32_t c);
+void glyph_cache_foreach(struct BGTK_Font* font,
+			 void (*fn)(void* arg, uint32_t c,
+				    const struct BGTK_Glyph* g),
+			 void* arg);
+void text_iter_init(struct BGTK_Text_Iter* it, struct BGTK_Font* font,
+		    const char* text, int length);
+const struct BGTK_Glyph* text_iter_next(struct BGTK_Text_Iter* it);
+
+// from layer.c
+int record_layer(struct BGTK_Context* ctx, struct BGTK_Display_List* list,
+		 struct BGTK_Widget* w);
+void layers_init(struct BGTK_Context* ctx);
+void layers_free(struct BGTK_Context* ctx);
+size_t layer_memory(struct BGTK_Layer* layer);
+
+// from layout.c
+void measure_widget(struct BGTK_Context* ctx, struct BGTK_Widget* w,
+		    int max_w, int max_h, int* out_w, int* out_h);
+void layout_widgets(struct BGTK_Context* ctx);
+void layout_resize(struct BGTK_Context* ctx);
+void scroll_clamp(struct BGTK_Widget* w);
+
+// from list.c
+int list_init(struct BGTK_Widget* w, const struct BGTK_List_Source* source);
+int list_item_top(struct BGTK_Widget* w, int i);
+int list_update_rows(struct BGTK_Widget* w);
+int list_wheel(struct BGTK_Widget* w, int value);
+int list_content_surface(struct BGTK_Widget* w, struct BGTK_Surface* out);
+
+// from memory.c
+int memory_init(struct BGTK_Context* ctx);
+void memory_free(struct BGTK_Context* ctx);
+void* mem_alloc(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+		size_t size);
+void* mem_calloc(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+		 size_t count, size_t size);
+void* mem_realloc(struct BGTK_Context* ctx,
+		  enum BGTK_Memory_Category category, void* p, size_t size);
+char* mem_strdup(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+		 const char* s);
+void mem_free(struct BGTK_Context* ctx, void* p);
+size_t mem_size(const void* p);
+size_t mem_bytes(struct BGTK_Context* ctx, enum BGTK_Memory_Category category);
+void mem_adopt(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+	       size_t size);
+void mem_disown(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+		size_t size);
+void memory_trim(struct BGTK_Context* ctx);
+void mem_register_cache(struct BGTK_Context* ctx,
+			const struct Mem_Cache* cache);
+uint64_t mem_score(uint64_t cost, unsigned long age);
+
+// from present.c
+int present_init(struct BGTK_Context* ctx);
+int present_resize(struct BGTK_Context* ctx);
+struct BGTK_Surface front_buffer(struct BGTK_Context* ctx);
+void present_free(struct BGTK_Context* ctx);
+void damage_rect(struct BGTK_Context* ctx, int x, int y, int w, int h);
+
+// from raster.c
+void raster_free(struct BGTK_Context* ctx);
+void raster_tiled(struct BGTK_Context* ctx, struct BGTK_Display_List* list,
+		  struct BGTK_Surface* dst, struct BGTK_Rect region);
+
+// from startup.c
+int startup_init(struct BGTK_Context* ctx);
+void startup_free(struct BGTK_Context* ctx);
+int startup_begin(struct BGTK_Context* ctx, const char* name,
+		  const char* detail);
+void startup_end(struct BGTK_Context* ctx, int id);
+struct BGTK_Task* task_start(struct BGTK_Context* ctx, const char* name,
+			     const char* detail, void (*fn)(void* arg),
+			     void* arg);
+void task_wait(struct BGTK_Task* task);
+
+// from stats.c
+int frame_stats_init(struct BGTK_Context* ctx);
+void frame_stats_free(struct BGTK_Context* ctx);
+struct Frame_Mark frame_phase_begin(struct BGTK_Context* ctx);
+void frame_phase_end(struct BGTK_Context* ctx, enum BGTK_Frame_Phase phase,
+		     struct Frame_Mark mark);
+void frame_phase_add(struct BGTK_Context* ctx, enum BGTK_Frame_Phase phase,
+		     uint64_t ns);
+void frame_input(struct BGTK_Context* ctx, uint64_t received);
+void frame_input_done(struct BGTK_Context* ctx, uint64_t received,
+		      int redraw);
+void frame_drawn(struct BGTK_Context* ctx);
+void frame_commit(struct BGTK_Context* ctx);
+
+// from trace.c
+void trace_init(void);
+void trace_log(int level, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void trace_thread_name(const char* name);
+void trace_scope_end(struct Trace_Scope* scope);
+void trace_shutdown(void);
+
+// from utf8.c
+int utf8_is_ascii(const char* text, size_t length);
+uint32_t utf8_next(const char** p, const char* end);
+int utf8_boundary(const char* text, int i);
+
+// from widgets.c
+void text_free(struct BGTK_Widget* w);
+void widget_free(struct BGTK_Widget* w);
+int text_advance(struct BGTK_Widget* w);
+void image_wait(struct BGTK_Widget* w);
 
 #endif
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Labels and buttons painted this many frames without a change get a
+// layer even without BGTK_FLAG_LAYER.
+#define LAYER_AUTO_FRAMES 3
+
+// Relative cost of repainting a byte of layer, see mem_score()
+#define LAYER_COST 1
+
+// An offscreen rendering of one widget, composited with a single blit.
+struct BGTK_Layer {
+	struct BGTK_Surface surface;
+	struct BGTK_Widget* owner;
+	int valid;		   // surface matches the widget's content
+	unsigned version;	   // Frame the surface was last redrawn in
+	unsigned long last_used;   // Frame the layer was last composited in
+	struct BGTK_Layer* prev;
+	struct BGTK_Layer* next;
+};
+
+static void layer_unlink(struct BGTK_Context* ctx, struct BGTK_Layer* layer) {
+	if (layer->prev) {
+		layer->prev->next = layer->next;
+	} else {
+		ctx->layers = layer->next;
+	}
+	if (layer->next) {
+		layer->next->prev = layer->prev;
+	}
+	layer->prev = NULL;
+	layer->next = NULL;
+}
+
+static void layer_push_front(struct BGTK_Context* ctx,
+			     struct BGTK_Layer* layer) {
+	layer->next = ctx->layers;
+	if (ctx->layers) {
+		ctx->layers->prev = layer;
+	}
+	ctx->layers = layer;
+}
+
+static void layer_release(struct BGTK_Context* ctx, struct BGTK_Layer* layer) {
+	layer_unlink(ctx, layer);
+	ctx->layer_bytes -= (size_t)layer->surface.width *
+			    layer->surface.height *
+			    pixel_size(layer->surface.format);
+	layer->owner->layer = NULL;
+	mem_free(ctx, layer->surface.pixels);
+	mem_free(ctx, layer);
+}
+
+// Drops least recently used layers until `needed` more bytes fit in the
+// budget. Layers composited in the current frame are kept unless `any`.
+// Returns 0 if the space is available.
+static int layers_evict(struct BGTK_Context* ctx, size_t needed, int any) {
+	while (ctx->layer_bytes + needed > ctx->layer_budget) {
+		struct BGTK_Layer* lru = ctx->layers;
+		if (!lru) {
+			return -1;
+		}
+		while (lru->next) {
+			lru = lru->next;
+		}
+		if (!any && lru->last_used == ctx->frame_count) {
+			return -1;
+		}
+		layer_release(ctx, lru);
+	}
+	return 0;
+}
+
+static struct BGTK_Layer* layer_alloc(struct BGTK_Context* ctx,
+				      struct BGTK_Widget* w, int width,
+				      int height) {
+	size_t bytes = (size_t)width * height * pixel_size(ctx->format);
+	if (layers_evict(ctx, bytes, 0) != 0) {
+		return NULL;
+	}
+
+	struct BGTK_Layer* layer =
+	    mem_calloc(ctx, BGTK_MEM_LAYERS, 1, sizeof(struct BGTK_Layer));
+	if (!layer) {
+		perror("calloc");
+		return NULL;
+	}
+	layer->surface.pixels = mem_alloc(ctx, BGTK_MEM_LAYERS, bytes);
+	if (!layer->surface.pixels) {
+		perror("malloc");
+		mem_free(ctx, layer);
+		return NULL;
+	}
+	layer->surface.format = ctx->format;
+	layer->surface.width = width;
+	layer->surface.height = height;
+	layer->surface.stride = width;
+	layer->owner = w;
+	w->layer = layer;
+	ctx->layer_bytes += bytes;
+	layer_push_front(ctx, layer);
+	return layer;
+}
+
+// Records w as a blit of its layer, rendering the layer first if needed.
+// Returns 0 if w should be painted directly instead.
+int record_layer(struct BGTK_Context* ctx, struct BGTK_Display_List* list,
+		 struct BGTK_Widget* w) {
+	// Only widgets whose background covers their whole box are opaque
+	// enough to be replaced by a plain copy
+	// The shadow of a layer never needs layers of its own
+	if ((w->type != BGTK_WIDGET_LABEL && w->type != BGTK_WIDGET_BUTTON) ||
+	    w->layer_refused || list->shadow) {
+		return 0;
+	}
+	struct BGTK_Rect r = {w->x + w->margin, w->y + w->margin,
+			      w->w - 2 * w->margin, w->h - 2 * w->margin};
+	if (r.w <= 0 || r.h <= 0) {
+		return 0;
+	}
+
+	if (w->stable_frames < LAYER_AUTO_FRAMES) {
+		w->stable_frames++;
+	}
+	// A faded or blended widget is composited as a whole, or its text
+	// would show its background through
+	int grouped = list->opacity != 0xFF ||
+		      list->blend != BGTK_BLEND_SRC_OVER;
+	if (!(w->flags & BGTK_FLAG_LAYER) && !grouped &&
+	    w->stable_frames < LAYER_AUTO_FRAMES) {
+		return 0;
+	}
+
+	struct BGTK_Layer* layer = w->layer;
+	if (layer &&
+	    (layer->surface.width != r.w || layer->surface.height != r.h)) {
+		layer_release(ctx, layer);
+		layer = NULL;
+	}
+	if (!layer) {
+		layer = layer_alloc(ctx, w, r.w, r.h);
+		if (!layer) {
+			return 0;
+		}
+	}
+
+	if (!layer->valid) {
+		struct BGTK_Rect painted =
+		    paint_widget_to(ctx, w, &layer->surface, r.x, r.y);
+
+		// Glyphs overhanging the background would be cut off
+		struct BGTK_Rect inside = rect_intersect(painted, r);
+		if (memcmp(&inside, &painted, sizeof(inside)) != 0) {
+			w->layer_refused = 1;
+			layer_release(ctx, layer);
+			return 0;
+		}
+		layer->valid = 1;
+		layer->version = ctx->frame_count;
+	}
+	layer->last_used = ctx->frame_count;
+	layer_unlink(ctx, layer);
+	layer_push_front(ctx, layer);
+
+	int blit = list->count;
+	record_blit(list, BGTK_CMD_IMAGE, layer->surface, 0, 0, r.x, r.y, r.w,
+		    r.h, layer->version, 1);
+	if (list->count > blit) {
+		list->commands[blit].layer = 1;
+	}
+	return 1;
+}
+
+void bgtk_invalidate_paint(struct BGTK_Widget* w) {
+	// Ancestors composite this widget into their own layers, or into
+	// the off-screen content of a scrollable or list
+	for (; w; w = w->parent) {
+		w->stable_frames = 0;
+		w->layer_refused = 0;
+		if (w->layer) {
+			w->layer->valid = 0;
+		}
+		if (w->type == BGTK_WIDGET_SCROLLABLE) {
+			w->data.scrollable.tmp_valid = 0;
+		}
+		if (w->type == BGTK_WIDGET_LIST) {
+			w->data.list.tmp_valid = 0;
+		}
+	}
+}
+
+void bgtk_set_layer_budget(struct BGTK_Context* ctx, size_t bytes) {
+	ctx->layer_budget = bytes;
+	layers_evict(ctx, 0, 1);
+}
+
+size_t layer_memory(struct BGTK_Layer* layer) {
+	return layer ? mem_size(layer) + mem_size(layer->surface.pixels) : 0;
+}
+
+// The layers are all the category holds. Read from the atomic counter, as
+// memory stats may be taken on any thread while layers change.
+static size_t layer_cache_size(struct BGTK_Context* ctx) {
+	return mem_bytes(ctx, BGTK_MEM_LAYERS);
+}
+
+// The least recently used layer, it is repainted when next composited
+static int layer_cache_victim(struct BGTK_Context* ctx,
+			      struct Mem_Victim* victim) {
+	struct BGTK_Layer* lru = ctx->layers;
+	if (!lru) {
+		return 0;
+	}
+	while (lru->next) {
+		lru = lru->next;
+	}
+	*victim = (struct Mem_Victim){
+	    .entry = lru,
+	    .bytes = layer_memory(lru),
+	    .score = mem_score(LAYER_COST, ctx->frame_count - lru->last_used),
+	    .in_use = lru->last_used == ctx->frame_count,
+	};
+	return 1;
+}
+
+static void layer_cache_evict(struct BGTK_Context* ctx, void* entry) {
+	layer_release(ctx, entry);
+}
+
+static const struct Mem_Cache layer_cache = {
+    .name = "layers",
+    .category = BGTK_MEM_LAYERS,
+    .size = layer_cache_size,
+    .victim = layer_cache_victim,
+    .evict = layer_cache_evict,
+};
+
+void layers_init(struct BGTK_Context* ctx) {
+	ctx->layer_budget = BGTK_DEFAULT_LAYER_BUDGET;
+	mem_register_cache(ctx, &layer_cache);
+}
+
+void layers_free(struct BGTK_Context* ctx) {
+	while (ctx->layers) {
+		layer_release(ctx, ctx->layers);
+	}
+}
@@ -0,0 +1,385 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Widgets whose size is set by the app rather than by their content.
+static int has_fixed_size(struct BGTK_Widget* w) {
+	return (w->flags & BGTK_FLAG_FIXED_SIZE) ||
+	       w->type == BGTK_WIDGET_SCROLLABLE ||
+	       w->type == BGTK_WIDGET_LIST || w->type == BGTK_WIDGET_IMAGE;
+}
+
+// A relayout boundary is a widget whose own size does not depend on its
+// children, so changes below it never need to propagate further up.
+static int is_relayout_boundary(struct BGTK_Widget* w) {
+	return !w->parent || has_fixed_size(w);
+}
+
+static void queue_layout(struct BGTK_Context* ctx, struct BGTK_Widget* w) {
+	if (ctx->layout_count == ctx->layout_capacity) {
+		int capacity =
+		    ctx->layout_capacity ? ctx->layout_capacity * 2 : 8;
+		struct BGTK_Widget** queue =
+		    mem_realloc(ctx, BGTK_MEM_ARENAS, ctx->layout_queue,
+				capacity * sizeof(struct BGTK_Widget*));
+		if (!queue) {
+			perror("realloc");
+			return;
+		}
+		ctx->layout_queue = queue;
+		ctx->layout_capacity = capacity;
+	}
+	ctx->layout_queue[ctx->layout_count++] = w;
+}
+
+void bgtk_invalidate_layout(struct BGTK_Widget* w) {
+	while (w) {
+		// Everything up to the boundary is already marked
+		if (w->needs_layout) {
+			return;
+		}
+		w->needs_layout = 1;
+		w->measured.valid = 0;
+		if (is_relayout_boundary(w)) {
+			queue_layout(w->ctx, w);
+			return;
+		}
+		w = w->parent;
+	}
+}
+
+// Computes the natural size of w for the given constraints. The result is
+// cached on the widget, so measuring a clean widget again with the same
+// constraints is free.
+void measure_widget(struct BGTK_Context* ctx, struct BGTK_Widget* w,
+		    int max_w, int max_h, int* out_w, int* out_h) {
+	if (w->type == BGTK_WIDGET_IMAGE) {
+		image_wait(w);
+	}
+
+	// Text and fixed-size widgets do not depend on the constraints
+	int any_constraints =
+	    w->type == BGTK_WIDGET_TEXT || has_fixed_size(w);
+	if (w->measured.valid &&
+	    (any_constraints ||
+	     (w->measured.max_w == max_w && w->measured.max_h == max_h))) {
+		*out_w = w->measured.w;
+		*out_h = w->measured.h;
+		return;
+	}
+
+	int mw = 0;
+	int mh = 0;
+	int inner_w = max_w - 2 * w->padding;
+	int inner_h = max_h - 2 * w->padding;
+	switch (w->type) {
+		case BGTK_WIDGET_LABEL:
+			if (w->data.label.text) {
+				measure_widget(ctx, w->data.label.text, inner_w,
+					       inner_h, &mw, &mh);
+			}
+			mw += 2 * w->padding;
+			mh += 2 * w->padding;
+			break;
+		case BGTK_WIDGET_TEXT:
+			if (w->data.text.text) {
+				struct BGTK_Font* font = widget_font(w);
+				mw = text_advance(w) >> 6;  // 26.6 units
+				font_load(font);
+				mh = font->ascender + font->descender;
+			}
+			// Add padding to the text widget
+			mw += 2 * w->padding;
+			mh += 2 * w->padding;
+			BGTK_LOG(BGTK_LEVEL_DEBUG, "calculated text size: %ux%u",
+				 mw, mh);
+			break;
+		case BGTK_WIDGET_BUTTON:
+			if (w->data.button.label) {
+				measure_widget(ctx, w->data.button.label,
+					       inner_w, inner_h, &mw, &mh);
+			}
+			mw += 2 * w->padding;
+			mh += 2 * w->padding;
+			BGTK_LOG(BGTK_LEVEL_DEBUG,
+				 "calculated button size: %ux%u", mw, mh);
+			break;
+		case BGTK_WIDGET_BOX: {
+			int vertical =
+			    w->data.box.orientation == BGTK_BOX_VERTICAL;
+			for (int i = 0; i < w->data.box.widget_count; i++) {
+				struct BGTK_Widget* child =
+				    w->data.box.widgets[i];
+				int cw, ch;
+				measure_widget(ctx, child, inner_w, inner_h,
+					       &cw, &ch);
+				cw += 2 * child->margin;
+				ch += 2 * child->margin;
+				if (vertical) {
+					mh += ch;
+					mw = cw > mw ? cw : mw;
+				} else {
+					mw += cw;
+					mh = ch > mh ? ch : mh;
+				}
+			}
+			mw += 2 * w->padding;
+			mh += 2 * w->padding;
+			break;
+		}
+		default:
+			break;
+	}
+	if (has_fixed_size(w)) {
+		mw = w->w;
+		mh = w->h;
+	}
+
+	w->measured.valid = 1;
+	w->measured.max_w = max_w;
+	w->measured.max_h = max_h;
+	w->measured.w = mw;
+	w->measured.h = mh;
+	*out_w = mw;
+	*out_h = mh;
+}
+
+static void arrange_widget(struct BGTK_Context* ctx, struct BGTK_Widget* w,
+			   int x, int y, int width, int height);
+
+// Distributes the box's main axis: children get their natural size plus
+// a share of the free space proportional to their flex.
+static void arrange_box(struct BGTK_Context* ctx, struct BGTK_Widget* w) {
+	int vertical = w->data.box.orientation == BGTK_BOX_VERTICAL;
+	int inner_w = w->w - 2 * w->padding;
+	int inner_h = w->h - 2 * w->padding;
+	int inner_main = vertical ? inner_h : inner_w;
+	int inner_cross = vertical ? inner_w : inner_h;
+
+	int natural = 0;
+	int total_flex = 0;
+	for (int i = 0; i < w->data.box.widget_count; i++) {
+		struct BGTK_Widget* child = w->data.box.widgets[i];
+		int cw, ch;
+		measure_widget(ctx, child, inner_w, inner_h, &cw, &ch);
+		natural += (vertical ? ch : cw) + 2 * child->margin;
+		total_flex += child->flex;
+	}
+
+	int extra = inner_main - natural;
+	if (extra < 0 || total_flex == 0) {
+		extra = 0;
+	}
+
+	int pos = 0;
+	int flex_left = total_flex;
+	int extra_left = extra;
+	for (int i = 0; i < w->data.box.widget_count; i++) {
+		struct BGTK_Widget* child = w->data.box.widgets[i];
+		int cw, ch;
+		measure_widget(ctx, child, inner_w, inner_h, &cw, &ch);
+
+		// The last flexible child takes the rounding remainder
+		int share = 0;
+		if (child->flex > 0) {
+			share = flex_left == child->flex
+				    ? extra_left
+				    : extra * child->flex / total_flex;
+			flex_left -= child->flex;
+			extra_left -= share;
+		}
+
+		int cross = vertical ? cw : ch;
+		int cross_offset = child->margin;
+		if (w->flags & BGTK_FLAG_CENTER) {
+			cross_offset = (inner_cross - cross) / 2;
+		}
+
+		pos += child->margin;
+		if (vertical) {
+			arrange_widget(ctx, child, w->x + w->padding + cross_offset,
+				       w->y + w->padding + pos, cw, ch + share);
+			pos += ch + share;
+		} else {
+			arrange_widget(ctx, child, w->x + w->padding + pos,
+				       w->y + w->padding + cross_offset, cw + share, ch);
+			pos += cw + share;
+		}
+		pos += child->margin;
+	}
+}
+
+// Keeps the scroll position within the content.
+void scroll_clamp(struct BGTK_Widget* w) {
+	int max = w->data.scrollable.content_height - w->h;
+	if (w->data.scrollable.scroll_y > max) {
+		w->data.scrollable.scroll_y = max;
+	}
+	if (w->data.scrollable.scroll_y < 0) {
+		w->data.scrollable.scroll_y = 0;
+	}
+}
+
+// Stacks the children vertically in content coordinates, relative to the
+// top-left corner of the scrollable's off-screen buffer.
+static void arrange_scrollable(struct BGTK_Context* ctx,
+			       struct BGTK_Widget* w) {
+	// Content coordinates only depend on the width, a scrollable that
+	// was moved or made taller or shorter keeps its content
+	int dirty = w->data.scrollable.content_width != w->w;
+	for (int i = 0; !dirty && i < w->data.scrollable.widget_count; i++) {
+		dirty = w->data.scrollable.widgets[i]->needs_layout;
+	}
+	if (!dirty) {
+		scroll_clamp(w);
+		return;
+	}
+	w->data.scrollable.content_width = w->w;
+
+	int old_height = w->data.scrollable.content_height;
+	int inner_w = w->w - 2 * (w->margin + w->padding);
+	int current_y = 0;
+	for (int i = 0; i < w->data.scrollable.widget_count; i++) {
+		struct BGTK_Widget* child = w->data.scrollable.widgets[i];
+		int cw, ch;
+		measure_widget(ctx, child, inner_w, INT_MAX, &cw, &ch);
+
+		int cx = w->margin + w->padding;
+		if (w->flags & BGTK_FLAG_CENTER) {
+			cx = w->margin + (w->w - 2 * w->margin - cw) / 2;
+		}
+		arrange_widget(ctx, child, cx, current_y + w->margin, cw, ch);
+		current_y += ch + 2 * w->margin;
+	}
+
+	// Subtract the last margin (no margin after the last widget)
+	if (w->data.scrollable.widget_count > 0) {
+		current_y -= 2 * w->margin;
+	}
+	w->data.scrollable.content_height = current_y;
+	scroll_clamp(w);
+
+	// The off-screen buffer no longer matches the content
+	if (w->data.scrollable.content_height != old_height) {
+		mem_free(ctx, w->data.scrollable.tmp);
+		w->data.scrollable.tmp = NULL;
+	}
+	w->data.scrollable.tmp_valid = 0;
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "calculated scrollable size: %ux%u", w->w,
+		 w->data.scrollable.content_height);
+}
+
+// Binds the rows the viewport needs and places them in content
+// coordinates, each as tall as its item. Rows already in place are not
+// visited again.
+static void arrange_list(struct BGTK_Context* ctx, struct BGTK_Widget* w) {
+	int changed = list_update_rows(w);
+	int row_w = w->w - 2 * w->padding;
+	for (int i = 0; i < w->data.list.row_count; i++) {
+		int item = w->data.list.row_items[i];
+		if (item < 0) {
+			continue;
+		}
+		struct BGTK_Widget* row = w->data.list.rows[i];
+		int top = list_item_top(w, item);
+		int height = list_item_top(w, item + 1) - top;
+		changed |= row->needs_layout || row->x != w->padding ||
+			   row->y != top || row->w != row_w ||
+			   row->h != height;
+		arrange_widget(ctx, row, w->padding, top, row_w, height);
+	}
+
+	// The off-screen buffer no longer matches the rows
+	if (changed) {
+		w->data.list.tmp_valid = 0;
+	}
+}
+
+// Assigns the final position and size of w and positions its children.
+// Clean widgets that keep their rectangle are skipped with their subtree.
+static void arrange_widget(struct BGTK_Context* ctx, struct BGTK_Widget* w,
+			   int x, int y, int width, int height) {
+	if (!w->needs_layout && w->x == x && w->y == y && w->w == width &&
+	    w->h == height) {
+		return;
+	}
+	w->x = x;
+	w->y = y;
+	w->w = width;
+	w->h = height;
+
+	struct BGTK_Widget* child = NULL;
+	switch (w->type) {
+		case BGTK_WIDGET_LABEL:
+			child = w->data.label.text;
+			break;
+		case BGTK_WIDGET_BUTTON:
+			child = w->data.button.label;
+			break;
+		case BGTK_WIDGET_BOX:
+			arrange_box(ctx, w);
+			break;
+		case BGTK_WIDGET_SCROLLABLE:
+			arrange_scrollable(ctx, w);
+			break;
+		case BGTK_WIDGET_LIST:
+			arrange_list(ctx, w);
+			break;
+		default:
+			break;
+	}
+
+	// Labels and buttons hold a single child inset by margin and padding
+	if (child) {
+		int cw, ch;
+		measure_widget(ctx, child, width - 2 * w->padding,
+			       height - 2 * w->padding, &cw, &ch);
+		arrange_widget(ctx, child, x + w->margin + w->padding,
+			       y + w->margin + w->padding, cw, ch);
+	}
+	w->needs_layout = 0;
+}
+
+// The window size is the constraint of the root, so it is laid out again
+// after a resize. Below it only widgets whose constraints or rectangle
+// changed are visited.
+void layout_resize(struct BGTK_Context* ctx) {
+	struct BGTK_Widget* root = ctx->root_widget;
+	if (root) {
+		root->needs_layout = 1;
+		root->measured.valid = 0;
+	}
+}
+
+// Lays out every queued relayout boundary and the root. Subtrees that were
+// not invalidated since the last pass are not visited.
+void layout_widgets(struct BGTK_Context* ctx) {
+	BGTK_TRACE_SCOPE("layout");
+	struct Frame_Mark mark = frame_phase_begin(ctx);
+	ctx->in_layout = 1;
+	for (int i = 0; i < ctx->layout_count; i++) {
+		struct BGTK_Widget* w = ctx->layout_queue[i];
+		if (w->needs_layout) {
+			arrange_widget(ctx, w, w->x, w->y, w->w, w->h);
+		}
+	}
+	ctx->layout_count = 0;
+
+	struct BGTK_Widget* root = ctx->root_widget;
+	if (root && root->needs_layout) {
+		int rw, rh;
+		measure_widget(ctx, root, ctx->width, ctx->height, &rw, &rh);
+
+		// A root container fills the whole window
+		if (root->type == BGTK_WIDGET_BOX) {
+			rw = ctx->width;
+			rh = ctx->height;
+		}
+		arrange_widget(ctx, root, root->x, root->y, rw, rh);
+	}
+	ctx->in_layout = 0;
+	frame_phase_end(ctx, BGTK_PHASE_LAYOUT, mark);
+}
@@ -0,0 +1,325 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Rows kept bound above and below the visible ones, so short scrolls move
+// the window over content that is already drawn
+#define LIST_OVERSCAN 8
+
+// Pixels scrolled per wheel step, as for scrollables
+#define LIST_SCROLL_STEP 10
+
+// Top of item i in content coordinates, i may be the item count.
+int list_item_top(struct BGTK_Widget* w, int i) {
+	if (w->data.list.offsets) {
+		return w->data.list.offsets[i];
+	}
+	return i * w->data.list.source.row_height;
+}
+
+// The item under content y, clamped to the items. 0 for an empty list.
+static int list_item_at(struct BGTK_Widget* w, int y) {
+	int count = w->data.list.source.count;
+	if (count == 0) {
+		return 0;
+	}
+	int i;
+	if (w->data.list.offsets) {
+		// Last item starting at or above y
+		int lo = 0;
+		int hi = count - 1;
+		while (lo < hi) {
+			int mid = lo + (hi - lo + 1) / 2;
+			if (w->data.list.offsets[mid] <= y) {
+				lo = mid;
+			} else {
+				hi = mid - 1;
+			}
+		}
+		i = lo;
+	} else {
+		i = y / w->data.list.source.row_height;
+	}
+	return i < 0 ? 0 : i >= count ? count - 1 : i;
+}
+
+// Recomputes the item tops and the content height for count items. Only
+// lists with a height callback keep a table. Content taller than INT_MAX
+// pixels is refused and the list is left as it was.
+static int list_measure_items(struct BGTK_Widget* w, int count) {
+	struct BGTK_List_Source* src = &w->data.list.source;
+	if (src->row_height > 0) {
+		if (count > INT_MAX / src->row_height) {
+			fprintf(stderr, "BGTK list of %d rows is too tall\n",
+				count);
+			return -1;
+		}
+		mem_free(w->ctx, w->data.list.offsets);
+		w->data.list.offsets = NULL;
+		src->count = count;
+		w->data.list.content_height = count * src->row_height;
+		return 0;
+	}
+
+	int* offsets = mem_alloc(w->ctx, BGTK_MEM_WIDGETS,
+				 ((size_t)count + 1) * sizeof(int));
+	if (!offsets) {
+		perror("malloc");
+		return -1;
+	}
+	long long y = 0;
+	for (int i = 0; i < count; i++) {
+		offsets[i] = (int)y;
+		int height = src->height(i, src->user);
+		y += height > 0 ? height : 0;
+		if (y > INT_MAX) {
+			fprintf(stderr, "BGTK list of %d rows is too tall\n",
+				count);
+			mem_free(w->ctx, offsets);
+			return -1;
+		}
+	}
+	offsets[count] = (int)y;
+	mem_free(w->ctx, w->data.list.offsets);
+	w->data.list.offsets = offsets;
+	src->count = count;
+	w->data.list.content_height = (int)y;
+	return 0;
+}
+
+// Keeps the scroll position within the content.
+static void list_clamp(struct BGTK_Widget* w) {
+	int max = w->data.list.content_height - w->h;
+	if (w->data.list.scroll_y > max) {
+		w->data.list.scroll_y = max;
+	}
+	if (w->data.list.scroll_y < 0) {
+		w->data.list.scroll_y = 0;
+	}
+}
+
+// Frees every row for rebinding, the widgets stay in the pool.
+static void list_unbind_all(struct BGTK_Widget* w) {
+	for (int i = 0; i < w->data.list.row_count; i++) {
+		w->data.list.row_items[i] = -1;
+	}
+	w->data.list.first = 0;
+	w->data.list.last = 0;
+}
+
+// A pool slot that is not bound, growing the pool if all are. Returns -1
+// if no row could be made.
+static int list_free_row(struct BGTK_Widget* w) {
+	for (int i = 0; i < w->data.list.row_count; i++) {
+		if (w->data.list.row_items[i] < 0) {
+			return i;
+		}
+	}
+
+	struct BGTK_Context* ctx = w->ctx;
+	int n = w->data.list.row_count;
+	if (n == w->data.list.row_capacity) {
+		int capacity = n ? n * 2 : 16;
+		struct BGTK_Widget** rows =
+		    mem_realloc(ctx, BGTK_MEM_WIDGETS, w->data.list.rows,
+				capacity * sizeof(struct BGTK_Widget*));
+		if (!rows) {
+			perror("realloc");
+			return -1;
+		}
+		w->data.list.rows = rows;
+		int* items = mem_realloc(ctx, BGTK_MEM_WIDGETS,
+					 w->data.list.row_items,
+					 capacity * sizeof(int));
+		if (!items) {
+			perror("realloc");
+			return -1;
+		}
+		w->data.list.row_items = items;
+		w->data.list.row_capacity = capacity;
+	}
+
+	struct BGTK_List_Source* src = &w->data.list.source;
+	struct BGTK_Widget* row =
+	    src->create ? src->create(ctx, src->user)
+			: bgtk_label(ctx, "", (BGTK_Options){.padding = 2});
+	if (!row) {
+		return -1;
+	}
+	row->parent = w;
+	w->data.list.rows[n] = row;
+	w->data.list.row_items[n] = -1;
+	w->data.list.row_count++;
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "list row pool grew to %d", n + 1);
+	return n;
+}
+
+// Shows item index in a pooled row. Binding runs during layout, so what
+// the bind callback changes lands in the frame being laid out.
+static void list_bind(struct BGTK_Widget* w, int slot, int index) {
+	struct BGTK_List_Source* src = &w->data.list.source;
+	src->bind(w->data.list.rows[slot], index, src->user);
+	w->data.list.row_items[slot] = index;
+	w->data.list.rows[slot]->needs_layout = 1;
+}
+
+// Makes rows [first, last) bound, reusing the rows of items that scrolled
+// out. Items already bound keep their row untouched.
+static void list_bind_range(struct BGTK_Widget* w, int first, int last) {
+	int old_first = w->data.list.first;
+	int old_last = w->data.list.last;
+	for (int i = 0; i < w->data.list.row_count; i++) {
+		int item = w->data.list.row_items[i];
+		if (item >= 0 && (item < first || item >= last)) {
+			w->data.list.row_items[i] = -1;
+		}
+	}
+	for (int item = first; item < last; item++) {
+		if (item >= old_first && item < old_last) {
+			continue;
+		}
+		int slot = list_free_row(w);
+		if (slot < 0) {
+			last = item;
+			break;
+		}
+		list_bind(w, slot, item);
+	}
+	w->data.list.first = first;
+	w->data.list.last = last;
+}
+
+// The items overlapping the viewport at the current scroll position.
+static void list_visible(struct BGTK_Widget* w, int* first, int* last) {
+	if (w->data.list.source.count == 0) {
+		*first = 0;
+		*last = 0;
+		return;
+	}
+	*first = list_item_at(w, w->data.list.scroll_y);
+	*last = list_item_at(w, w->data.list.scroll_y + w->h - 1) + 1;
+}
+
+// Binds the rows the viewport needs plus overscan when the visible items
+// are no longer all bound. Returns 1 if the bound range changed.
+int list_update_rows(struct BGTK_Widget* w) {
+	list_clamp(w);
+	int first, last;
+	list_visible(w, &first, &last);
+	if (first == last) {
+		// Empty, nothing stays bound
+		int bound = w->data.list.last > w->data.list.first;
+		list_bind_range(w, 0, 0);
+		return bound;
+	}
+	if (first >= w->data.list.first && last <= w->data.list.last) {
+		return 0;
+	}
+	int count = w->data.list.source.count;
+	first = first > LIST_OVERSCAN ? first - LIST_OVERSCAN : 0;
+	last = last + LIST_OVERSCAN < count ? last + LIST_OVERSCAN : count;
+	list_bind_range(w, first, last);
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "list rows %d-%d bound", first, last);
+	return 1;
+}
+
+// Moves the viewport by dy pixels. Returns 1 if it moved.
+static int list_scroll(struct BGTK_Widget* w, int dy) {
+	int before = w->data.list.scroll_y;
+	w->data.list.scroll_y += dy;
+	list_clamp(w);
+	if (w->data.list.scroll_y == before) {
+		return 0;
+	}
+
+	// Within the bound rows only the window onto them moves
+	int first, last;
+	list_visible(w, &first, &last);
+	if (first < w->data.list.first || last > w->data.list.last) {
+		bgtk_invalidate_layout(w);
+	}
+	request_frame(w->ctx);
+	return 1;
+}
+
+int list_wheel(struct BGTK_Widget* w, int value) {
+	return list_scroll(w, -value * LIST_SCROLL_STEP);
+}
+
+// Wraps the off-screen buffer holding the bound rows in a surface. It is
+// at least as tall as the viewport, so a short list fills it.
+int list_content_surface(struct BGTK_Widget* w, struct BGTK_Surface* out) {
+	int height = list_item_top(w, w->data.list.last) -
+		     list_item_top(w, w->data.list.first);
+	if (height < w->h) {
+		height = w->h;
+	}
+	if (w->w <= 0 || height <= 0) {
+		return -1;
+	}
+
+	int bpp = pixel_size(w->ctx->format);
+	size_t bytes = (size_t)w->w * height * bpp;
+	if (w->data.list.tmp && mem_size(w->data.list.tmp) != bytes) {
+		mem_free(w->ctx, w->data.list.tmp);
+		w->data.list.tmp = NULL;
+	}
+	if (!w->data.list.tmp) {
+		w->data.list.tmp = mem_calloc(w->ctx, BGTK_MEM_SCROLL,
+					      (size_t)w->w * height, bpp);
+		if (!w->data.list.tmp) {
+			fprintf(stderr, "Failed to allocate list buffer\n");
+			return -1;
+		}
+		w->data.list.tmp_valid = 0;
+	}
+
+	*out = (struct BGTK_Surface){
+	    .pixels = w->data.list.tmp,
+	    .format = w->ctx->format,
+	    .width = w->w,
+	    .height = height,
+	    .stride = w->w,
+	};
+	return 0;
+}
+
+int list_init(struct BGTK_Widget* w, const struct BGTK_List_Source* source) {
+	if (!source->bind || source->count < 0 ||
+	    (source->row_height <= 0 && !source->height)) {
+		fprintf(stderr,
+			"BGTK list needs a bind callback and row heights\n");
+		return -1;
+	}
+	w->data.list.source = *source;
+	w->data.list.source.count = 0;
+	return list_measure_items(w, source->count);
+}
+
+void bgtk_list_set_count(struct BGTK_Widget* w, int count) {
+	if (list_measure_items(w, count < 0 ? 0 : count) != 0) {
+		return;
+	}
+	list_unbind_all(w);
+	list_clamp(w);
+	w->data.list.tmp_valid = 0;
+	bgtk_invalidate_layout(w);
+	request_frame(w->ctx);
+}
+
+void bgtk_list_refresh(struct BGTK_Widget* w) {
+	list_unbind_all(w);
+	w->data.list.tmp_valid = 0;
+	bgtk_invalidate_layout(w);
+	request_frame(w->ctx);
+}
+
+void bgtk_list_scroll_to(struct BGTK_Widget* w, int index) {
+	int count = w->data.list.source.count;
+	index = index < 0 ? 0 : index > count ? count : index;
+	list_scroll(w, list_item_top(w, index) - w->data.list.scroll_y);
+}
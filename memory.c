@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Every block carries its size and category in front of it, so a block
+// can be freed and measured without the caller knowing either
+union Mem_Header {
+	struct {
+		size_t size;
+		int category;
+	};
+	max_align_t align;
+};
+
+// Caches that can give memory back
+#define MEM_CACHES 8
+
+struct BGTK_Memory {
+	atomic_size_t bytes[BGTK_MEM_CATEGORIES];
+	atomic_size_t peak[BGTK_MEM_CATEGORIES];
+	atomic_size_t blocks[BGTK_MEM_CATEGORIES];
+	size_t budget[BGTK_MEM_CATEGORIES];  // 0 for none
+	atomic_size_t total;
+	size_t limit;	  // Cap on the total, 0 for none
+	atomic_int over;  // A budget was exceeded since the last trim
+
+	const struct Mem_Cache* caches[MEM_CACHES];
+	int cache_count;
+	_Atomic uint64_t evictions;
+};
+
+static const char* category_names[] = {
+    "widgets", "strings", "images", "scroll", "glyphs",
+    "layers",  "arenas",  "buffers",
+};
+
+int memory_init(struct BGTK_Context* ctx) {
+	ctx->memory = calloc(1, sizeof(struct BGTK_Memory));
+	if (!ctx->memory) {
+		perror("calloc");
+		return -1;
+	}
+	const char* limit = getenv("BGTK_MEMORY_LIMIT_MB");
+	if (limit && *limit) {
+		ctx->memory->limit = strtod(limit, NULL) * (1 << 20);
+	}
+	return 0;
+}
+
+void mem_register_cache(struct BGTK_Context* ctx,
+			const struct Mem_Cache* cache) {
+	struct BGTK_Memory* mem = ctx->memory;
+	if (mem->cache_count < MEM_CACHES) {
+		mem->caches[mem->cache_count++] = cache;
+	}
+}
+
+// Value of keeping an entry per byte: what rebuilding it costs, less the
+// longer it has gone unused. Entries with the lowest value go first.
+uint64_t mem_score(uint64_t cost, unsigned long age) {
+	return (cost << 16) / (age + 1);
+}
+
+void memory_free(struct BGTK_Context* ctx) {
+	struct BGTK_Memory* mem = ctx->memory;
+	if (!mem) {
+		return;
+	}
+	for (int i = 0; i < BGTK_MEM_CATEGORIES; i++) {
+		size_t bytes = atomic_load(&mem->bytes[i]);
+		if (bytes) {
+			BGTK_LOG(BGTK_LEVEL_DEBUG,
+				 "%zu bytes of %s still allocated at destroy",
+				 bytes, category_names[i]);
+		}
+	}
+	free(mem);
+	ctx->memory = NULL;
+}
+
+static void mem_account(struct BGTK_Context* ctx,
+			enum BGTK_Memory_Category category, ptrdiff_t delta) {
+	struct BGTK_Memory* mem = ctx->memory;
+	size_t bytes =
+	    atomic_fetch_add_explicit(&mem->bytes[category], (size_t)delta,
+				      memory_order_relaxed) +
+	    (size_t)delta;
+	size_t total = atomic_fetch_add_explicit(&mem->total, (size_t)delta,
+						 memory_order_relaxed) +
+		       (size_t)delta;
+	if (delta <= 0) {
+		return;
+	}
+	if (mem->limit && total > mem->limit) {
+		atomic_store_explicit(&mem->over, 1, memory_order_relaxed);
+	}
+	size_t peak = atomic_load_explicit(&mem->peak[category],
+					   memory_order_relaxed);
+	while (bytes > peak &&
+	       !atomic_compare_exchange_weak_explicit(
+		   &mem->peak[category], &peak, bytes, memory_order_relaxed,
+		   memory_order_relaxed)) {
+	}
+	if (mem->budget[category] && bytes > mem->budget[category]) {
+		atomic_store_explicit(&mem->over, 1, memory_order_relaxed);
+	}
+}
+
+// Accounts a block allocated outside of mem_alloc(), and its release.
+void mem_adopt(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+	       size_t size) {
+	atomic_fetch_add_explicit(&ctx->memory->blocks[category], 1,
+				  memory_order_relaxed);
+	mem_account(ctx, category, size);
+}
+
+void mem_disown(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+		size_t size) {
+	atomic_fetch_sub_explicit(&ctx->memory->blocks[category], 1,
+				  memory_order_relaxed);
+	mem_account(ctx, category, -(ptrdiff_t)size);
+}
+
+void* mem_alloc(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+		size_t size) {
+	union Mem_Header* h = malloc(sizeof(*h) + size);
+	if (!h) {
+		return NULL;
+	}
+	h->size = size;
+	h->category = category;
+	mem_adopt(ctx, category, size);
+	return h + 1;
+}
+
+void* mem_calloc(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+		 size_t count, size_t size) {
+	if (size && count > (SIZE_MAX - sizeof(union Mem_Header)) / size) {
+		return NULL;
+	}
+	void* p = mem_alloc(ctx, category, count * size);
+	if (p) {
+		memset(p, 0, count * size);
+	}
+	return p;
+}
+
+void* mem_realloc(struct BGTK_Context* ctx,
+		  enum BGTK_Memory_Category category, void* p, size_t size) {
+	if (!p) {
+		return mem_alloc(ctx, category, size);
+	}
+	union Mem_Header* h = (union Mem_Header*)p - 1;
+	size_t old = h->size;
+	h = realloc(h, sizeof(*h) + size);
+	if (!h) {
+		return NULL;
+	}
+	h->size = size;
+	mem_account(ctx, h->category, (ptrdiff_t)size - (ptrdiff_t)old);
+	return h + 1;
+}
+
+char* mem_strdup(struct BGTK_Context* ctx, enum BGTK_Memory_Category category,
+		 const char* s) {
+	size_t length = strlen(s) + 1;
+	char* copy = mem_alloc(ctx, category, length);
+	if (copy) {
+		memcpy(copy, s, length);
+	}
+	return copy;
+}
+
+void mem_free(struct BGTK_Context* ctx, void* p) {
+	if (!p) {
+		return;
+	}
+	union Mem_Header* h = (union Mem_Header*)p - 1;
+	mem_disown(ctx, h->category, h->size);
+	free(h);
+}
+
+size_t mem_size(const void* p) {
+	return p ? ((const union Mem_Header*)p - 1)->size : 0;
+}
+
+size_t mem_bytes(struct BGTK_Context* ctx,
+		 enum BGTK_Memory_Category category) {
+	return atomic_load_explicit(&ctx->memory->bytes[category],
+				    memory_order_relaxed);
+}
+
+// Evicts the least valuable cache entries, of one category or of any when
+// category is BGTK_MEM_CATEGORIES, until `bytes` were freed or nothing is
+// left to evict. Entries drawn in the last frame are kept unless `any`.
+static void mem_evict(struct BGTK_Context* ctx,
+		      enum BGTK_Memory_Category category, size_t bytes,
+		      int any) {
+	struct BGTK_Memory* mem = ctx->memory;
+	size_t freed = 0;
+	while (freed < bytes) {
+		const struct Mem_Cache* best = NULL;
+		struct Mem_Victim victim = {0};
+		for (int i = 0; i < mem->cache_count; i++) {
+			const struct Mem_Cache* cache = mem->caches[i];
+			struct Mem_Victim v;
+			if ((category != BGTK_MEM_CATEGORIES &&
+			     cache->category != category) ||
+			    !cache->victim(ctx, &v) || (v.in_use && !any)) {
+				continue;
+			}
+			if (!best || v.score < victim.score) {
+				best = cache;
+				victim = v;
+			}
+		}
+		if (!best) {
+			if (!any) {
+				BGTK_LOG(BGTK_LEVEL_DEBUG,
+					 "%zu bytes over budget are in use",
+					 bytes - freed);
+			}
+			return;
+		}
+		BGTK_LOG(BGTK_LEVEL_DEBUG, "evicting %zu bytes of %s",
+			 victim.bytes, best->name);
+		best->evict(ctx, victim.entry);
+		mem->evictions++;
+		freed += victim.bytes;
+	}
+}
+
+// Bytes the caches could give back
+static size_t cache_bytes(struct BGTK_Context* ctx) {
+	struct BGTK_Memory* mem = ctx->memory;
+	size_t bytes = 0;
+	for (int i = 0; i < mem->cache_count; i++) {
+		bytes += mem->caches[i]->size(ctx);
+	}
+	return bytes;
+}
+
+// Brings the categories over their budget, and the total over the limit,
+// back under them. Called by the UI thread between frames, when no raster
+// worker reads the caches.
+static void trim(struct BGTK_Context* ctx, int any) {
+	struct BGTK_Memory* mem = ctx->memory;
+	BGTK_TRACE_SCOPE("memory_trim");
+	for (int i = 0; i < BGTK_MEM_CATEGORIES; i++) {
+		size_t bytes = atomic_load(&mem->bytes[i]);
+		if (mem->budget[i] && bytes > mem->budget[i]) {
+			mem_evict(ctx, i, bytes - mem->budget[i], any);
+		}
+	}
+	size_t total = atomic_load(&mem->total);
+	if (mem->limit && total > mem->limit) {
+		mem_evict(ctx, BGTK_MEM_CATEGORIES, total - mem->limit, any);
+	}
+}
+
+// At the end of a frame, what it drew is kept: it would only be rebuilt
+// by the next one.
+void memory_trim(struct BGTK_Context* ctx) {
+	if (atomic_exchange_explicit(&ctx->memory->over, 0,
+				     memory_order_relaxed)) {
+		trim(ctx, 0);
+	}
+}
+
+void bgtk_set_memory_budget(struct BGTK_Context* ctx,
+			    enum BGTK_Memory_Category category, size_t bytes) {
+	ctx->memory->budget[category] = bytes;
+	if (category == BGTK_MEM_LAYERS) {
+		bgtk_set_layer_budget(ctx, bytes ? bytes
+						 : BGTK_DEFAULT_LAYER_BUDGET);
+	}
+	trim(ctx, 1);
+}
+
+void bgtk_set_memory_limit(struct BGTK_Context* ctx, size_t bytes) {
+	ctx->memory->limit = bytes;
+	trim(ctx, 1);
+}
+
+void bgtk_memory_pressure(struct BGTK_Context* ctx, int level) {
+	BGTK_TRACE_SCOPE("memory_pressure");
+	size_t cached = cache_bytes(ctx);
+	if (level >= BGTK_MEMORY_PRESSURE_CRITICAL) {
+		mem_evict(ctx, BGTK_MEM_CATEGORIES, SIZE_MAX, 1);
+	} else if (level == BGTK_MEMORY_PRESSURE_MODERATE) {
+		mem_evict(ctx, BGTK_MEM_CATEGORIES, cached / 2, 1);
+	}
+	BGTK_LOG(BGTK_LEVEL_INFO,
+		 "memory pressure %d: caches %zu -> %zu bytes", level, cached,
+		 cache_bytes(ctx));
+}
+
+struct BGTK_Memory_Stats bgtk_get_memory_stats(struct BGTK_Context* ctx) {
+	struct BGTK_Memory* mem = ctx->memory;
+	struct BGTK_Memory_Stats stats = {0};
+	for (int i = 0; i < BGTK_MEM_CATEGORIES; i++) {
+		stats.bytes[i] = atomic_load(&mem->bytes[i]);
+		stats.peak[i] = atomic_load(&mem->peak[i]);
+		stats.blocks[i] = atomic_load(&mem->blocks[i]);
+		stats.budget[i] =
+		    i == BGTK_MEM_LAYERS ? ctx->layer_budget : mem->budget[i];
+		stats.total += stats.bytes[i];
+	}
+	stats.limit = mem->limit;
+	stats.cached = cache_bytes(ctx);
+	stats.evictions = mem->evictions;
+	return stats;
+}
+
+size_t bgtk_widget_memory(struct BGTK_Widget* w) {
+	if (!w) {
+		return 0;
+	}
+	size_t bytes = mem_size(w) + layer_memory(w->layer);
+	switch (w->type) {
+		case BGTK_WIDGET_TEXT:
+			bytes += mem_size(w->data.text.text) +
+				 mem_size(w->data.text.spare) +
+				 mem_size(w->data.text.pen);
+			break;
+		case BGTK_WIDGET_LABEL:
+			bytes += bgtk_widget_memory(w->data.label.text);
+			break;
+		case BGTK_WIDGET_BUTTON:
+			bytes += bgtk_widget_memory(w->data.button.label);
+			break;
+		case BGTK_WIDGET_IMAGE:
+			bytes += mem_size(w->data.image.path);
+			if (w->data.image.pixels) {
+				bytes += (size_t)w->data.image.img_w *
+					 w->data.image.img_h * sizeof(uint32_t);
+			}
+			break;
+		case BGTK_WIDGET_SCROLLABLE:
+			bytes += mem_size(w->data.scrollable.widgets) +
+				 mem_size(w->data.scrollable.tmp);
+			for (int i = 0; i < w->data.scrollable.widget_count;
+			     i++) {
+				bytes += bgtk_widget_memory(
+				    w->data.scrollable.widgets[i]);
+			}
+			break;
+		case BGTK_WIDGET_BOX:
+			bytes += mem_size(w->data.box.widgets);
+			for (int i = 0; i < w->data.box.widget_count; i++) {
+				bytes +=
+				    bgtk_widget_memory(w->data.box.widgets[i]);
+			}
+			break;
+		case BGTK_WIDGET_LIST:
+			bytes += mem_size(w->data.list.rows) +
+				 mem_size(w->data.list.row_items) +
+				 mem_size(w->data.list.offsets) +
+				 mem_size(w->data.list.tmp);
+			for (int i = 0; i < w->data.list.row_count; i++) {
+				bytes +=
+				    bgtk_widget_memory(w->data.list.rows[i]);
+			}
+			break;
+	}
+	return bytes;
+}
+
+static const char* type_names[] = {
+    [BGTK_WIDGET_LABEL] = "label",
+    [BGTK_WIDGET_BUTTON] = "button",
+    [BGTK_WIDGET_TEXT] = "text",
+    [BGTK_WIDGET_SCROLLABLE] = "scrollable",
+    [BGTK_WIDGET_IMAGE] = "image",
+    [BGTK_WIDGET_BOX] = "box",
+    [BGTK_WIDGET_LIST] = "list",
+};
+
+// Children listed per container before the rest are summed up
+#define REPORT_CHILDREN 8
+
+static void report_widget(FILE* out, struct BGTK_Widget* w, int depth);
+
+static void report_children(FILE* out, struct BGTK_Widget** children,
+			    int count, int depth) {
+	size_t rest = 0;
+	for (int i = 0; i < count; i++) {
+		if (i < REPORT_CHILDREN) {
+			report_widget(out, children[i], depth);
+		} else {
+			rest += bgtk_widget_memory(children[i]);
+		}
+	}
+	if (count > REPORT_CHILDREN) {
+		fprintf(out, "  %10.1f  %*s(%d more)\n", rest / 1024.0,
+			depth * 2, "", count - REPORT_CHILDREN);
+	}
+}
+
+static void report_widget(FILE* out, struct BGTK_Widget* w, int depth) {
+	fprintf(out, "  %10.1f  %*s%s\n", bgtk_widget_memory(w) / 1024.0,
+		depth * 2, "", type_names[w->type]);
+	if (w->type == BGTK_WIDGET_SCROLLABLE) {
+		report_children(out, w->data.scrollable.widgets,
+				w->data.scrollable.widget_count, depth + 1);
+	} else if (w->type == BGTK_WIDGET_BOX) {
+		report_children(out, w->data.box.widgets,
+				w->data.box.widget_count, depth + 1);
+	} else if (w->type == BGTK_WIDGET_LIST) {
+		report_children(out, w->data.list.rows,
+				w->data.list.row_count, depth + 1);
+	}
+}
+
+void bgtk_memory_report(struct BGTK_Context* ctx, FILE* out) {
+	struct BGTK_Memory_Stats stats = bgtk_get_memory_stats(ctx);
+	fprintf(out, "memory (KiB):\n");
+	fprintf(out, "  category       bytes        peak    blocks     budget\n");
+	for (int i = 0; i < BGTK_MEM_CATEGORIES; i++) {
+		fprintf(out, "  %-8s  %10.1f  %10.1f  %8zu", category_names[i],
+			stats.bytes[i] / 1024.0, stats.peak[i] / 1024.0,
+			stats.blocks[i]);
+		if (stats.budget[i]) {
+			fprintf(out, "  %9.1f\n", stats.budget[i] / 1024.0);
+		} else {
+			fprintf(out, "          -\n");
+		}
+	}
+	fprintf(out, "  %-8s  %10.1f", "total", stats.total / 1024.0);
+	if (stats.limit) {
+		fprintf(out, "                        %9.1f", stats.limit / 1024.0);
+	}
+	fprintf(out, "\n");
+
+	struct BGTK_Memory* mem = ctx->memory;
+	fprintf(out, "caches (KiB, %llu evictions):\n",
+		(unsigned long long)stats.evictions);
+	for (int i = 0; i < mem->cache_count; i++) {
+		fprintf(out, "  %-8s  %10.1f\n", mem->caches[i]->name,
+			mem->caches[i]->size(ctx) / 1024.0);
+	}
+
+	if (ctx->root_widget) {
+		fprintf(out, "widgets (KiB, with their children):\n");
+		report_widget(out, ctx->root_widget, 0);
+	}
+}
@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Pixel formats. Each one names its storage type and how 8-bit channels
+// are packed into and unpacked from a pixel. The kernels below are
+// instantiated once per format (and per format pair for blits), so their
+// inner loops never look at the format.
+
+#define ARGB8888_TYPE uint32_t
+#define ARGB8888_PACK(r, g, b, a)                                          \
+	((uint32_t)(a) << 24 | (uint32_t)(r) << 16 | (uint32_t)(g) << 8 | \
+	 (uint32_t)(b))
+#define ARGB8888_UNPACK(p, r, g, b, a) \
+	((r) = (p) >> 16 & 0xFF, (g) = (p) >> 8 & 0xFF, (b) = (p) & 0xFF, \
+	 (a) = (p) >> 24)
+
+// Alpha is not stored, pixels read back as opaque
+#define XRGB8888_TYPE uint32_t
+#define XRGB8888_PACK(r, g, b, a)                                      \
+	((void)(a), 0xFF000000u | (uint32_t)(r) << 16 | (uint32_t)(g) << 8 | \
+			(uint32_t)(b))
+#define XRGB8888_UNPACK(p, r, g, b, a) \
+	((r) = (p) >> 16 & 0xFF, (g) = (p) >> 8 & 0xFF, (b) = (p) & 0xFF, \
+	 (a) = 0xFF)
+
+// Bytes R, G, B, A in memory on little-endian, as decoded images are
+#define ABGR8888_TYPE uint32_t
+#define ABGR8888_PACK(r, g, b, a)                                          \
+	((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(g) << 8 | \
+	 (uint32_t)(r))
+#define ABGR8888_UNPACK(p, r, g, b, a) \
+	((b) = (p) >> 16 & 0xFF, (g) = (p) >> 8 & 0xFF, (r) = (p) & 0xFF, \
+	 (a) = (p) >> 24)
+
+// Channels are widened by repeating their top bits, so 0x1F reads as 0xFF
+#define RGB565_TYPE uint16_t
+#define RGB565_PACK(r, g, b, a) \
+	((void)(a), (uint16_t)(((r) >> 3) << 11 | ((g) >> 2) << 5 | (b) >> 3))
+#define RGB565_UNPACK(p, r, g, b, a)                                     \
+	((r) = ((p) >> 11 & 0x1F) << 3 | (p) >> 13,                         \
+	 (g) = ((p) >> 5 & 0x3F) << 2 | ((p) >> 9 & 0x3),                   \
+	 (b) = ((p) & 0x1F) << 3 | ((p) >> 2 & 0x7), (a) = 0xFF)
+
+#define FORMATS(X) X(ARGB8888) X(XRGB8888) X(ABGR8888) X(RGB565)
+
+// Every source format with every destination format
+#define FORMAT_PAIRS_FROM(S)                                       \
+	PAIR(S, ARGB8888) PAIR(S, XRGB8888) PAIR(S, ABGR8888) \
+	    PAIR(S, RGB565)
+
+static const int format_bytes[BGTK_FORMATS] = {
+#define BYTES(F) [BGTK_FORMAT_##F] = sizeof(F##_TYPE),
+    FORMATS(BYTES)
+#undef BYTES
+};
+
+int pixel_size(int format) {
+	return format_bytes[format];
+}
+
+// Address of pixel (x, y) of a surface.
+static inline void* pixel_at(const struct BGTK_Surface* s, int x, int y) {
+	return (char*)s->pixels +
+	       ((size_t)y * s->stride + x) * format_bytes[s->format];
+}
+
+// Clamps [x1, x2) x [y1, y2) to the surface and its clip rectangle. A
+// zero-sized clip means the whole surface. Returns 0 if nothing is left.
+int clip_bounds(struct BGTK_Surface* dst, int* x1, int* y1, int* x2,
+		int* y2) {
+	int cx1 = 0;
+	int cy1 = 0;
+	int cx2 = dst->width;
+	int cy2 = dst->height;
+	if (dst->clip.w > 0 && dst->clip.h > 0) {
+		cx1 = dst->clip.x > 0 ? dst->clip.x : 0;
+		cy1 = dst->clip.y > 0 ? dst->clip.y : 0;
+		if (dst->clip.x + dst->clip.w < cx2) {
+			cx2 = dst->clip.x + dst->clip.w;
+		}
+		if (dst->clip.y + dst->clip.h < cy2) {
+			cy2 = dst->clip.y + dst->clip.h;
+		}
+	}
+	*x1 = *x1 < cx1 ? cx1 : *x1;
+	*y1 = *y1 < cy1 ? cy1 : *y1;
+	*x2 = *x2 > cx2 ? cx2 : *x2;
+	*y2 = *y2 > cy2 ? cy2 : *y2;
+	return *x1 < *x2 && *y1 < *y2;
+}
+
+// --- Blend modes ---
+
+// Pixels hold premultiplied alpha: each color channel is already scaled
+// by the alpha, so every mode is a multiply-add per channel, and fades
+// compose without dividing by alpha. Colors passed in as 0xAARRGGBB are
+// straight and premultiplied once per call.
+
+// x * y / 255, rounded, for 8-bit x and y
+static inline unsigned mul255(unsigned x, unsigned y) {
+	unsigned t = x * y + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static inline unsigned min255(unsigned v) {
+	return v > 255 ? 255 : v;
+}
+
+// Each mode says when a source alpha leaves the destination untouched
+// (SKIP), when the result is the source itself (STORE), and otherwise
+// how a premultiplied channel s combines with d (arguments a mode ignores
+// are cast to void). The same formula also gives the alpha channel. SKIP
+// and STORE are the fast paths that never read the destination.
+#define SRC_OVER_SKIP(sa) ((sa) == 0)
+#define SRC_OVER_STORE(sa) ((sa) == 0xFF)
+#define SRC_OVER_CHANNEL(s, d, sa, da) \
+	((void)(da), (s) + mul255(d, 255 - (sa)))
+
+#define COPY_SKIP(sa) 0
+#define COPY_STORE(sa) 1
+#define COPY_CHANNEL(s, d, sa, da) ((void)(d), (void)(da), (s))
+
+#define ADD_SKIP(sa) ((sa) == 0)
+#define ADD_STORE(sa) 0
+#define ADD_CHANNEL(s, d, sa, da) ((void)(da), min255((s) + (d)))
+
+// Source times destination where both are covered, each alone elsewhere
+#define MULTIPLY_SKIP(sa) ((sa) == 0)
+#define MULTIPLY_STORE(sa) 0
+#define MULTIPLY_CHANNEL(s, d, sa, da)                               \
+	min255(mul255(s, d) + mul255(s, 255 - (da)) + mul255(d, 255 - (sa)))
+
+#define BLEND_MODES(X, ...)                                       \
+	X(__VA_ARGS__, SRC_OVER) X(__VA_ARGS__, COPY)             \
+	X(__VA_ARGS__, ADD) X(__VA_ARGS__, MULTIPLY)
+
+// Composites premultiplied (r, g, b, a) onto the pixel *p of format F
+// with mode M.
+#define COMPOSITE(F, M, p, r, g, b, a)                                     \
+	do {                                                               \
+		if (M##_STORE(a)) {                                        \
+			*(p) = F##_PACK(r, g, b, a);                       \
+		} else if (!M##_SKIP(a)) {                                 \
+			unsigned dr, dg, db, da;                           \
+			F##_UNPACK(*(p), dr, dg, db, da);                  \
+			*(p) = F##_PACK(M##_CHANNEL(r, dr, a, da),         \
+					M##_CHANNEL(g, dg, a, da),         \
+					M##_CHANNEL(b, db, a, da),         \
+					M##_CHANNEL(a, da, a, da));        \
+		}                                                          \
+	} while (0)
+
+// --- Fill ---
+
+typedef void (*Fill_Fn)(struct BGTK_Surface* dst, int x1, int y1, int x2,
+			int y2, uint32_t color);
+
+// The color is premultiplied and packed once. An opaque color is a plain
+// store and a transparent one returns without touching a pixel.
+#define DEFINE_FILL(F, M)                                                  \
+	static void fill_##F##_##M(struct BGTK_Surface* dst, int x1, int y1, \
+				   int x2, int y2, uint32_t color) {       \
+		unsigned a = color >> 24;                                  \
+		unsigned r = mul255(color >> 16 & 0xFF, a);                \
+		unsigned g = mul255(color >> 8 & 0xFF, a);                 \
+		unsigned b = mul255(color & 0xFF, a);                      \
+		if (M##_SKIP(a)) {                                         \
+			return;                                            \
+		}                                                          \
+		if (M##_STORE(a)) {                                        \
+			F##_TYPE p = F##_PACK(r, g, b, a);                 \
+			for (int y = y1; y < y2; y++) {                    \
+				F##_TYPE* row = pixel_at(dst, 0, y);       \
+				for (int x = x1; x < x2; x++) {            \
+					row[x] = p;                        \
+				}                                          \
+			}                                                  \
+			return;                                            \
+		}                                                          \
+		for (int y = y1; y < y2; y++) {                            \
+			F##_TYPE* row = pixel_at(dst, 0, y);               \
+			for (int x = x1; x < x2; x++) {                    \
+				unsigned dr, dg, db, da;                   \
+				F##_UNPACK(row[x], dr, dg, db, da);        \
+				row[x] = F##_PACK(                         \
+				    M##_CHANNEL(r, dr, a, da),             \
+				    M##_CHANNEL(g, dg, a, da),             \
+				    M##_CHANNEL(b, db, a, da),             \
+				    M##_CHANNEL(a, da, a, da));            \
+			}                                                  \
+		}                                                          \
+	}
+#define FILLS_OF(F) BLEND_MODES(DEFINE_FILL, F)
+FORMATS(FILLS_OF)
+#undef FILLS_OF
+
+static const Fill_Fn fills[BGTK_FORMATS][BGTK_BLENDS] = {
+#define FILL_ENTRY(F, M) [BGTK_FORMAT_##F][BGTK_BLEND_##M] = fill_##F##_##M,
+#define FILLS_OF(F) BLEND_MODES(FILL_ENTRY, F)
+    FORMATS(FILLS_OF)
+#undef FILLS_OF
+#undef FILL_ENTRY
+};
+
+// Fills a rectangle with a straight-alpha color in the given mode.
+void draw_rect(struct BGTK_Surface* dst, int x, int y, int w, int h,
+	       uint32_t color, int mode) {
+	int x1 = x;
+	int y1 = y;
+	int x2 = x + w;
+	int y2 = y + h;
+	if (!clip_bounds(dst, &x1, &y1, &x2, &y2)) {
+		return;
+	}
+	fills[dst->format][mode](dst, x1, y1, x2, y2, color);
+}
+
+// --- Blits ---
+
+typedef void (*Convert_Fn)(struct BGTK_Surface* dst, int dx, int dy,
+			   const struct BGTK_Surface* src, int sx, int sy,
+			   int w, int h);
+
+typedef void (*Blend_Fn)(struct BGTK_Surface* dst, int dx, int dy,
+			 const struct BGTK_Surface* src, int sx, int sy, int w,
+			 int h, unsigned opacity);
+
+// Converts a block from format S to format D
+#define DEFINE_CONVERT(S, D)                                               \
+	static void convert_##S##_##D(struct BGTK_Surface* dst, int dx,    \
+				      int dy, const struct BGTK_Surface* src, \
+				      int sx, int sy, int w, int h) {      \
+		for (int row = 0; row < h; row++) {                        \
+			const S##_TYPE* in = pixel_at(src, sx, sy + row);  \
+			D##_TYPE* out = pixel_at(dst, dx, dy + row);       \
+			for (int i = 0; i < w; i++) {                      \
+				unsigned r, g, b, a;                       \
+				S##_UNPACK(in[i], r, g, b, a);             \
+				out[i] = D##_PACK(r, g, b, a);             \
+			}                                                  \
+		}                                                          \
+	}
+
+// Composites a block from format S onto format D with mode M, the source
+// first faded by opacity
+#define DEFINE_BLEND(S, D, M)                                              \
+	static void blend_##S##_##D##_##M(                                 \
+	    struct BGTK_Surface* dst, int dx, int dy,                      \
+	    const struct BGTK_Surface* src, int sx, int sy, int w, int h,  \
+	    unsigned opacity) {                                            \
+		for (int row = 0; row < h; row++) {                        \
+			const S##_TYPE* in = pixel_at(src, sx, sy + row);  \
+			D##_TYPE* out = pixel_at(dst, dx, dy + row);       \
+			for (int i = 0; i < w; i++) {                      \
+				unsigned r, g, b, a;                       \
+				S##_UNPACK(in[i], r, g, b, a);             \
+				if (opacity != 0xFF) {                     \
+					r = mul255(r, opacity);            \
+					g = mul255(g, opacity);            \
+					b = mul255(b, opacity);            \
+					a = mul255(a, opacity);            \
+				}                                          \
+				COMPOSITE(D, M, &out[i], r, g, b, a);      \
+			}                                                  \
+		}                                                          \
+	}
+
+#define PAIR(S, D) DEFINE_CONVERT(S, D) BLEND_MODES(DEFINE_BLEND, S, D)
+FORMATS(FORMAT_PAIRS_FROM)
+#undef PAIR
+
+static const Convert_Fn converts[BGTK_FORMATS][BGTK_FORMATS] = {
+#define PAIR(S, D) [BGTK_FORMAT_##S][BGTK_FORMAT_##D] = convert_##S##_##D,
+    FORMATS(FORMAT_PAIRS_FROM)
+#undef PAIR
+};
+
+static const Blend_Fn blends[BGTK_FORMATS][BGTK_FORMATS][BGTK_BLENDS] = {
+#define BLEND_ENTRY(S, D, M)                           \
+	[BGTK_FORMAT_##S][BGTK_FORMAT_##D][BGTK_BLEND_##M] = \
+	    blend_##S##_##D##_##M,
+#define PAIR(S, D) BLEND_MODES(BLEND_ENTRY, S, D)
+    FORMATS(FORMAT_PAIRS_FROM)
+#undef PAIR
+#undef BLEND_ENTRY
+};
+
+// Clips a w x h block from src at (sx, sy) to dst at (dx, dy) against the
+// source bounds and the destination clip. Returns 0 if nothing is left.
+static int clip_blit(struct BGTK_Surface* dst, int* dx, int* dy,
+		     const struct BGTK_Surface* src, int* sx, int* sy, int* w,
+		     int* h) {
+	// Clip the source first, shifting the destination along
+	if (*sx < 0) {
+		*dx -= *sx;
+		*w += *sx;
+		*sx = 0;
+	}
+	if (*sy < 0) {
+		*dy -= *sy;
+		*h += *sy;
+		*sy = 0;
+	}
+	if (*sx + *w > src->width) {
+		*w = src->width - *sx;
+	}
+	if (*sy + *h > src->height) {
+		*h = src->height - *sy;
+	}
+
+	int x1 = *dx;
+	int y1 = *dy;
+	int x2 = *dx + *w;
+	int y2 = *dy + *h;
+	if (!clip_bounds(dst, &x1, &y1, &x2, &y2)) {
+		return 0;
+	}
+	*sx += x1 - *dx;
+	*sy += y1 - *dy;
+	*dx = x1;
+	*dy = y1;
+	*w = x2 - x1;
+	*h = y2 - y1;
+	return 1;
+}
+
+// Copies a w x h block from src at (sx, sy) to dst at (dx, dy), converting
+// between formats, clipped to the source bounds and the destination clip.
+void copy_rect(struct BGTK_Surface* dst, int dx, int dy,
+	       struct BGTK_Surface* src, int sx, int sy, int w, int h) {
+	if (!clip_blit(dst, &dx, &dy, src, &sx, &sy, &w, &h)) {
+		return;
+	}
+	if (src->format != dst->format) {
+		converts[src->format][dst->format](dst, dx, dy, src, sx, sy, w,
+						   h);
+		return;
+	}
+	size_t row_bytes = (size_t)w * format_bytes[dst->format];
+	for (int row = 0; row < h; row++) {
+		memcpy(pixel_at(dst, dx, dy + row), pixel_at(src, sx, sy + row),
+		       row_bytes);
+	}
+}
+
+// Like copy_rect(), but composites src onto dst with a blend mode, the
+// source faded by opacity (0-255) first.
+void blend_rect(struct BGTK_Surface* dst, int dx, int dy,
+		struct BGTK_Surface* src, int sx, int sy, int w, int h,
+		int mode, unsigned opacity) {
+	if (opacity == 0 && mode != BGTK_BLEND_COPY) {
+		return;
+	}
+	if (!clip_blit(dst, &dx, &dy, src, &sx, &sy, &w, &h)) {
+		return;
+	}
+	blends[src->format][dst->format][mode](dst, dx, dy, src, sx, sy, w, h,
+					       opacity);
+}
+
+// --- Glyphs ---
+
+typedef void (*Glyph_Fn)(struct BGTK_Surface* dst, const uint8_t* coverage,
+			 int pitch, int x1, int y1, int x2, int y2,
+			 unsigned r, unsigned g, unsigned b, unsigned a);
+
+// Composites a premultiplied color through 8-bit coverage, coverage row 0
+// is at y1
+#define DEFINE_GLYPH(F, M)                                                 \
+	static void glyph_##F##_##M(                                       \
+	    struct BGTK_Surface* dst, const uint8_t* coverage, int pitch,  \
+	    int x1, int y1, int x2, int y2, unsigned r, unsigned g,        \
+	    unsigned b, unsigned a) {                                      \
+		for (int y = y1; y < y2; y++, coverage += pitch) {         \
+			F##_TYPE* row = pixel_at(dst, 0, y);               \
+			for (int x = x1; x < x2; x++) {                    \
+				unsigned c = coverage[x - x1];             \
+				if (c == 0) {                              \
+					continue;                          \
+				}                                          \
+				unsigned ca = mul255(a, c);                \
+				COMPOSITE(F, M, &row[x], mul255(r, c),     \
+					  mul255(g, c), mul255(b, c), ca); \
+			}                                                  \
+		}                                                          \
+	}
+#define GLYPHS_OF(F) BLEND_MODES(DEFINE_GLYPH, F)
+FORMATS(GLYPHS_OF)
+#undef GLYPHS_OF
+
+static const Glyph_Fn glyphs[BGTK_FORMATS][BGTK_BLENDS] = {
+#define GLYPH_ENTRY(F, M) [BGTK_FORMAT_##F][BGTK_BLEND_##M] = glyph_##F##_##M,
+#define GLYPHS_OF(F) BLEND_MODES(GLYPH_ENTRY, F)
+    FORMATS(GLYPHS_OF)
+#undef GLYPHS_OF
+#undef GLYPH_ENTRY
+};
+
+// Draws a glyph bitmap with its top-left corner at (gx, gy), in a
+// straight-alpha color and the given mode.
+void draw_glyph(struct BGTK_Surface* dst, const struct BGTK_Glyph* glyph,
+		int gx, int gy, uint32_t color, int mode) {
+	unsigned a = color >> 24;
+	if (a == 0 && mode != BGTK_BLEND_COPY) {
+		return;
+	}
+	int x1 = gx;
+	int y1 = gy;
+	int x2 = gx + glyph->width;
+	int y2 = gy + glyph->rows;
+	if (!clip_bounds(dst, &x1, &y1, &x2, &y2)) {
+		return;
+	}
+	const uint8_t* coverage =
+	    glyph->bitmap + (y1 - gy) * glyph->width + (x1 - gx);
+	glyphs[dst->format][mode](dst, coverage, glyph->width, x1, y1, x2, y2,
+				  mul255(color >> 16 & 0xFF, a),
+				  mul255(color >> 8 & 0xFF, a),
+				  mul255(color & 0xFF, a), a);
+}
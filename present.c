@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// A zeroed frame-sized buffer in the context's pixel format.
+static void* buffer_alloc(struct BGTK_Context* ctx, int width, int height) {
+	return mem_calloc(ctx, BGTK_MEM_BUFFERS, (size_t)width * height,
+			  pixel_size(ctx->format));
+}
+
+// Allocates the private back buffer all drawing goes to.
+// Returns 0 on success, -1 on failure.
+int present_init(struct BGTK_Context* ctx) {
+	ctx->back_buffer.pixels = buffer_alloc(ctx, ctx->width, ctx->height);
+	if (!ctx->back_buffer.pixels) {
+		perror("calloc");
+		return -1;
+	}
+	ctx->back_buffer.format = ctx->format;
+	ctx->back_buffer.width = ctx->width;
+	ctx->back_buffer.height = ctx->height;
+	ctx->back_buffer.stride = ctx->width;
+	ctx->damage = (struct BGTK_Rect){0};
+	return 0;
+}
+
+// Frees the buffers of a resize that was not switched to.
+static void resize_drop(struct BGTK_Context* ctx) {
+	if (ctx->headless) {
+		mem_free(ctx, ctx->resize_buffer);
+	}
+	mem_free(ctx, ctx->resize_back);
+	ctx->resize_buffer = NULL;
+	ctx->resize_back = NULL;
+}
+
+// The buffers are allocated here rather than at the switch, so a failure
+// reaches the caller while it still has the old buffer mapped.
+int bgtk_resize(struct BGTK_Context* ctx, void* buffer, int width,
+		int height) {
+	if (width <= 0 || height <= 0 || (!buffer && !ctx->headless)) {
+		fprintf(stderr, "BGTK bad resize to %dx%d\n", width, height);
+		return -1;
+	}
+	void* front = buffer;
+	if (ctx->headless) {
+		front = buffer_alloc(ctx, width, height);
+	}
+	void* back = buffer_alloc(ctx, width, height);
+	if (!front || !back) {
+		// Keep the previous buffer, or the pending one
+		perror("calloc");
+		if (ctx->headless) {
+			mem_free(ctx, front);
+		}
+		mem_free(ctx, back);
+		return -1;
+	}
+	resize_drop(ctx);
+	ctx->resize_buffer = front;
+	ctx->resize_back = back;
+	ctx->resize_width = width;
+	ctx->resize_height = height;
+	ctx->resize_pending++;
+	return 1;
+}
+
+// Switches to the buffers of the last bgtk_resize(), if any, and marks the
+// layout that depends on the window size. Caches are kept, the frame is
+// repainted from them. Returns 1 if the size changed.
+int present_resize(struct BGTK_Context* ctx) {
+	if (!ctx->resize_pending) {
+		return 0;
+	}
+	BGTK_TRACE_SCOPE("resize");
+	int width = ctx->resize_width;
+	int height = ctx->resize_height;
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "resizing to %dx%d, %d requests coalesced",
+		 width, height, ctx->resize_pending);
+	ctx->resize_pending = 0;
+
+	if (ctx->headless) {
+		mem_free(ctx, ctx->shm_buffer);
+	}
+	mem_free(ctx, ctx->back_buffer.pixels);
+
+	ctx->shm_buffer = ctx->resize_buffer;
+	ctx->width = width;
+	ctx->height = height;
+	ctx->back_buffer = (struct BGTK_Surface){.pixels = ctx->resize_back,
+						 .format = ctx->format,
+						 .width = width,
+						 .height = height,
+						 .stride = width};
+	ctx->resize_buffer = NULL;
+	ctx->resize_back = NULL;
+	ctx->damage = (struct BGTK_Rect){0};
+	layout_resize(ctx);
+	return 1;
+}
+
+int bgtk_set_pixel_format(struct BGTK_Context* ctx, int format) {
+	if (format < 0 || format >= BGTK_FORMATS || ctx->frame_count > 0 ||
+	    ctx->resize_pending) {
+		fprintf(stderr, "BGTK cannot switch to pixel format %d\n",
+			format);
+		return -1;
+	}
+	if (format == ctx->format) {
+		return 0;
+	}
+	int old = ctx->format;
+	ctx->format = format;
+	void* front = ctx->shm_buffer;
+	if (ctx->headless) {
+		front = buffer_alloc(ctx, ctx->width, ctx->height);
+	}
+	void* back = buffer_alloc(ctx, ctx->width, ctx->height);
+	if (!front || !back) {
+		perror("calloc");
+		if (ctx->headless) {
+			mem_free(ctx, front);
+		}
+		mem_free(ctx, back);
+		ctx->format = old;
+		return -1;
+	}
+	if (ctx->headless) {
+		mem_free(ctx, ctx->shm_buffer);
+		ctx->shm_buffer = front;
+	}
+	mem_free(ctx, ctx->back_buffer.pixels);
+	ctx->back_buffer.pixels = back;
+	ctx->back_buffer.format = format;
+	return 0;
+}
+
+// The shared buffer as a surface.
+struct BGTK_Surface front_buffer(struct BGTK_Context* ctx) {
+	return (struct BGTK_Surface){
+	    .pixels = ctx->shm_buffer,
+	    .format = ctx->format,
+	    .width = ctx->width,
+	    .height = ctx->height,
+	    .stride = ctx->width,
+	};
+}
+
+void present_free(struct BGTK_Context* ctx) {
+	resize_drop(ctx);
+	mem_free(ctx, ctx->back_buffer.pixels);
+	ctx->back_buffer.pixels = NULL;
+}
+
+// Grows the pending damage to include the given rectangle.
+void damage_rect(struct BGTK_Context* ctx, int x, int y, int w, int h) {
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > ctx->width) {
+		w = ctx->width - x;
+	}
+	if (y + h > ctx->height) {
+		h = ctx->height - y;
+	}
+	if (w <= 0 || h <= 0) {
+		return;
+	}
+
+	ctx->damage = rect_union(ctx->damage, (struct BGTK_Rect){x, y, w, h});
+}
+
+void bgtk_present(struct BGTK_Context* ctx) {
+	BGTK_TRACE_SCOPE("present");
+	if (present_resize(ctx)) {
+		// Repainted in full even inside an update, the old buffer may
+		// be gone
+		layout_widgets(ctx);
+		render_frame(ctx, 1);
+	}
+	struct BGTK_Rect d = ctx->damage;
+	if (d.w == 0 || d.h == 0) {
+		// Still ends the frame, an event may have cost time
+		frame_commit(ctx);
+		return;
+	}
+	struct Frame_Mark mark = frame_phase_begin(ctx);
+
+	struct BGTK_Surface front = front_buffer(ctx);
+	copy_rect(&front, d.x, d.y, &ctx->back_buffer, d.x, d.y, d.w, d.h);
+	ctx->damage = (struct BGTK_Rect){0};
+
+	// Time spent in bgce_draw is time the frame waits on the server
+	uint64_t start = now_ns();
+	if (!ctx->headless) {
+		BGTK_TRACE_SCOPE("bgce_draw");
+		bgce_draw(ctx->conn_fd);
+	}
+	uint64_t stall = now_ns() - start;
+	frame_drawn(ctx);
+
+	struct BGTK_Present_Stats* st = &ctx->present_stats;
+	st->frames++;
+	st->copied_pixels += (uint64_t)d.w * d.h;
+	st->last_stall_ns = stall;
+	st->total_stall_ns += stall;
+	if (stall > st->max_stall_ns) {
+		st->max_stall_ns = stall;
+	}
+
+	frame_phase_end(ctx, BGTK_PHASE_PRESENT, mark);
+	frame_commit(ctx);
+}
+
+struct BGTK_Present_Stats bgtk_get_present_stats(struct BGTK_Context* ctx) {
+	return ctx->present_stats;
+}
@@ -0,0 +1,305 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Tiles are square, small enough to balance work across the pool and large
+// enough that per-tile overhead stays negligible.
+#define TILE_SIZE 64
+
+struct Tile {
+	struct BGTK_Rect rect;
+	int first;  // Offset of this tile's entries in bins
+	int count;
+};
+
+// One parallel rasterization: the display list binned into tiles.
+struct Raster_Job {
+	struct BGTK_Context* ctx;
+	struct BGTK_Display_List* list;
+	struct BGTK_Surface* dst;
+	int* bins;  // Per-tile indexes into the list's prepared commands
+	struct Tile* tiles;
+	int tile_count;
+	atomic_int next_tile;
+};
+
+struct BGTK_Raster_Pool {
+	pthread_t* threads;
+	int thread_count;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long generation;
+	int busy;  // Workers still running the current job
+	int stop;
+	struct Raster_Job* job;
+
+	// Scratch storage reused between frames
+	int* bins;
+	int bin_capacity;
+	struct Tile* tiles;
+	int tile_capacity;
+};
+
+static void raster_tile(struct Raster_Job* job, struct Tile* tile) {
+	BGTK_TRACE_SCOPE("raster_tile");
+
+	// Each worker only touches the pixels of its own tile
+	struct BGTK_Surface dst = *job->dst;
+	dst.clip = tile->rect;
+	execute_commands(job->list, job->bins + tile->first, tile->count,
+			 &dst);
+}
+
+static void run_tiles(struct Raster_Job* job) {
+	int t;
+	while ((t = atomic_fetch_add(&job->next_tile, 1)) < job->tile_count) {
+		raster_tile(job, &job->tiles[t]);
+	}
+}
+
+static void* raster_worker(void* arg) {
+	struct BGTK_Raster_Pool* pool = arg;
+	unsigned long seen = 0;
+	trace_thread_name("raster");
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->generation == seen && !pool->stop) {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+		if (pool->stop) {
+			break;
+		}
+		seen = pool->generation;
+		struct Raster_Job* job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_tiles(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Starts the pool on first use. The calling thread always takes part in a
+// job, so n threads means n - 1 workers.
+static struct BGTK_Raster_Pool* raster_pool_get(struct BGTK_Context* ctx) {
+	if (ctx->raster_pool) {
+		return ctx->raster_pool;
+	}
+
+	struct BGTK_Raster_Pool* pool =
+	    calloc(1, sizeof(struct BGTK_Raster_Pool));
+	if (!pool) {
+		perror("calloc");
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	int threads = ctx->raster_threads;
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads > 1) {
+		pool->threads = calloc(threads - 1, sizeof(pthread_t));
+		if (!pool->threads) {
+			perror("calloc");
+			threads = 1;
+		}
+	}
+	for (int i = 0; i < threads - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL, raster_worker,
+				   pool) != 0) {
+			fprintf(stderr, "raster: could not start worker %d\n",
+				i);
+			break;
+		}
+		pool->thread_count++;
+	}
+
+	ctx->raster_pool = pool;
+	return pool;
+}
+
+void raster_free(struct BGTK_Context* ctx) {
+	struct BGTK_Raster_Pool* pool = ctx->raster_pool;
+	if (!pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->thread_count; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	mem_free(ctx, pool->bins);
+	mem_free(ctx, pool->tiles);
+	free(pool);
+	ctx->raster_pool = NULL;
+}
+
+void bgtk_set_paint_mode(struct BGTK_Context* ctx, int mode, int threads) {
+	ctx->paint_mode = mode;
+	if (threads != ctx->raster_threads) {
+		// Restarted with the new size on the next tiled frame
+		raster_free(ctx);
+		ctx->raster_threads = threads;
+	}
+}
+
+// Grows a scratch array to hold at least `needed` elements.
+static int reserve(struct BGTK_Context* ctx, void** array, int* capacity,
+		   int needed, size_t size) {
+	if (needed <= *capacity) {
+		return 0;
+	}
+	int new_capacity = *capacity ? *capacity : 64;
+	while (new_capacity < needed) {
+		new_capacity *= 2;
+	}
+	void* grown =
+	    mem_realloc(ctx, BGTK_MEM_ARENAS, *array, new_capacity * size);
+	if (!grown) {
+		perror("realloc");
+		return -1;
+	}
+	*array = grown;
+	*capacity = new_capacity;
+	return 0;
+}
+
+// Executes the prepared commands of list in the region of dst. The region
+// is split into tiles, each command is binned into the tiles its bounds
+// overlap and the tiles are rasterized in parallel.
+void raster_tiled(struct BGTK_Context* ctx, struct BGTK_Display_List* list,
+		  struct BGTK_Surface* dst, struct BGTK_Rect region) {
+	struct BGTK_Raster_Pool* pool = raster_pool_get(ctx);
+	if (!pool) {
+		return;
+	}
+
+	// Split the region into tiles
+	if (region.x < 0) {
+		region.w += region.x;
+		region.x = 0;
+	}
+	if (region.y < 0) {
+		region.h += region.y;
+		region.y = 0;
+	}
+	if (region.x + region.w > dst->width) {
+		region.w = dst->width - region.x;
+	}
+	if (region.y + region.h > dst->height) {
+		region.h = dst->height - region.y;
+	}
+	if (region.w <= 0 || region.h <= 0) {
+		return;
+	}
+	int cols = (region.w + TILE_SIZE - 1) / TILE_SIZE;
+	int rows = (region.h + TILE_SIZE - 1) / TILE_SIZE;
+	int tile_count = cols * rows;
+	if (reserve(ctx, (void**)&pool->tiles, &pool->tile_capacity, tile_count,
+		    sizeof(*pool->tiles)) != 0) {
+		return;
+	}
+	for (int t = 0; t < tile_count; t++) {
+		struct Tile* tile = &pool->tiles[t];
+		tile->rect.x = region.x + (t % cols) * TILE_SIZE;
+		tile->rect.y = region.y + (t / cols) * TILE_SIZE;
+		tile->rect.w = region.x + region.w - tile->rect.x;
+		tile->rect.h = region.y + region.h - tile->rect.y;
+		tile->rect.w = tile->rect.w > TILE_SIZE ? TILE_SIZE : tile->rect.w;
+		tile->rect.h = tile->rect.h > TILE_SIZE ? TILE_SIZE : tile->rect.h;
+		tile->count = 0;
+	}
+
+	// Bin the commands: count, prefix sum, then fill in paint order
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < list->exec_count; i++) {
+			struct BGTK_Rect b = list->exec[i].bounds;
+			int tx1 = (b.x - region.x) / TILE_SIZE;
+			int ty1 = (b.y - region.y) / TILE_SIZE;
+			int tx2 = (b.x + b.w - 1 - region.x) / TILE_SIZE;
+			int ty2 = (b.y + b.h - 1 - region.y) / TILE_SIZE;
+			if (b.w <= 0 || b.h <= 0 || b.x + b.w <= region.x ||
+			    b.y + b.h <= region.y || tx1 >= cols ||
+			    ty1 >= rows) {
+				continue;
+			}
+			tx1 = b.x < region.x ? 0 : tx1;
+			ty1 = b.y < region.y ? 0 : ty1;
+			tx2 = tx2 >= cols ? cols - 1 : tx2;
+			ty2 = ty2 >= rows ? rows - 1 : ty2;
+			for (int ty = ty1; ty <= ty2; ty++) {
+				for (int tx = tx1; tx <= tx2; tx++) {
+					struct Tile* tile =
+					    &pool->tiles[ty * cols + tx];
+					if (pass == 1) {
+						pool->bins[tile->first +
+							   tile->count] = i;
+					}
+					tile->count++;
+				}
+			}
+		}
+
+		if (pass == 0) {
+			int total = 0;
+			for (int t = 0; t < tile_count; t++) {
+				pool->tiles[t].first = total;
+				total += pool->tiles[t].count;
+				pool->tiles[t].count = 0;
+			}
+			if (reserve(ctx, (void**)&pool->bins, &pool->bin_capacity,
+				    total, sizeof(*pool->bins)) != 0) {
+				return;
+			}
+		}
+	}
+
+	struct Raster_Job job = {
+	    .ctx = ctx,
+	    .list = list,
+	    .dst = dst,
+	    .bins = pool->bins,
+	    .tiles = pool->tiles,
+	    .tile_count = tile_count,
+	};
+	atomic_init(&job.next_tile, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->job = &job;
+	pool->busy = pool->thread_count;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	run_tiles(&job);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pool->job = NULL;
+	pthread_mutex_unlock(&pool->lock);
+}
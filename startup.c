@@ -0,0 +1,179 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+#define STARTUP_EVENTS 64
+
+// A span of startup work, in nanoseconds since bgtk_init() began
+struct Startup_Event {
+	const char* name;
+	char detail[48];
+	uint64_t start, end;
+	int worker;  // Ran off the thread that called bgtk_init()
+};
+
+// Work started in the background by bgtk_init() and widget constructors.
+struct BGTK_Task {
+	pthread_t thread;
+	struct BGTK_Context* ctx;
+	void (*fn)(void* arg);
+	void* arg;
+	const char* name;
+	char detail[48];
+	int running;  // A thread was started and not joined yet
+	struct BGTK_Task* next;
+};
+
+struct BGTK_Startup {
+	pthread_mutex_t lock;
+	pthread_t main;
+	uint64_t origin;
+	struct Startup_Event events[STARTUP_EVENTS];
+	int count;
+	struct BGTK_Task* tasks;
+};
+
+// Keeps the end of detail, where the file name of a path is.
+static void copy_detail(char* out, size_t size, const char* detail) {
+	size_t length = detail ? strlen(detail) : 0;
+	if (length < size) {
+		snprintf(out, size, "%s", detail ? detail : "");
+	} else {
+		snprintf(out, size, "...%s", detail + length - (size - 4));
+	}
+}
+
+int startup_init(struct BGTK_Context* ctx) {
+	ctx->startup = calloc(1, sizeof(struct BGTK_Startup));
+	if (!ctx->startup) {
+		perror("calloc");
+		return -1;
+	}
+	pthread_mutex_init(&ctx->startup->lock, NULL);
+	ctx->startup->main = pthread_self();
+	ctx->startup->origin = now_ns();
+	return 0;
+}
+
+void startup_free(struct BGTK_Context* ctx) {
+	struct BGTK_Startup* st = ctx->startup;
+	if (!st) {
+		return;
+	}
+	struct BGTK_Task* task = st->tasks;
+	while (task) {
+		struct BGTK_Task* next = task->next;
+		task_wait(task);
+		free(task);
+		task = next;
+	}
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+	ctx->startup = NULL;
+}
+
+int startup_begin(struct BGTK_Context* ctx, const char* name,
+		  const char* detail) {
+	struct BGTK_Startup* st = ctx->startup;
+	pthread_mutex_lock(&st->lock);
+	int id = st->count < STARTUP_EVENTS ? st->count++ : -1;
+	if (id >= 0) {
+		struct Startup_Event* e = &st->events[id];
+		e->name = name;
+		copy_detail(e->detail, sizeof(e->detail), detail);
+		e->start = now_ns() - st->origin;
+		e->end = e->start;
+		e->worker = !pthread_equal(pthread_self(), st->main);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return id;
+}
+
+void startup_end(struct BGTK_Context* ctx, int id) {
+	struct BGTK_Startup* st = ctx->startup;
+	if (id < 0) {
+		return;
+	}
+	pthread_mutex_lock(&st->lock);
+	st->events[id].end = now_ns() - st->origin;
+	pthread_mutex_unlock(&st->lock);
+}
+
+static void* task_main(void* arg) {
+	struct BGTK_Task* task = arg;
+	trace_thread_name("startup");
+	BGTK_TRACE_SCOPE(task->name);
+	int id = startup_begin(task->ctx, task->name, task->detail);
+	task->fn(task->arg);
+	startup_end(task->ctx, id);
+	return NULL;
+}
+
+struct BGTK_Task* task_start(struct BGTK_Context* ctx, const char* name,
+			     const char* detail, void (*fn)(void* arg),
+			     void* arg) {
+	struct BGTK_Task* task = calloc(1, sizeof(struct BGTK_Task));
+	if (!task) {
+		// Do the work now rather than not at all
+		perror("calloc");
+		fn(arg);
+		return NULL;
+	}
+	task->ctx = ctx;
+	task->fn = fn;
+	task->arg = arg;
+	task->name = name;
+	copy_detail(task->detail, sizeof(task->detail), detail);
+
+	if (pthread_create(&task->thread, NULL, task_main, task) == 0) {
+		task->running = 1;
+	} else {
+		int id = startup_begin(ctx, name, task->detail);
+		fn(arg);
+		startup_end(ctx, id);
+	}
+
+	pthread_mutex_lock(&ctx->startup->lock);
+	task->next = ctx->startup->tasks;
+	ctx->startup->tasks = task;
+	pthread_mutex_unlock(&ctx->startup->lock);
+	return task;
+}
+
+void task_wait(struct BGTK_Task* task) {
+	if (task && task->running) {
+		pthread_join(task->thread, NULL);
+		task->running = 0;
+	}
+}
+
+static int event_cmp(const void* a, const void* b) {
+	const struct Startup_Event* ea = a;
+	const struct Startup_Event* eb = b;
+	return ea->start < eb->start ? -1 : ea->start > eb->start;
+}
+
+void bgtk_dump_startup(struct BGTK_Context* ctx, FILE* out) {
+	struct BGTK_Startup* st = ctx->startup;
+	struct Startup_Event events[STARTUP_EVENTS];
+	pthread_mutex_lock(&st->lock);
+	int count = st->count;
+	memcpy(events, st->events, count * sizeof(struct Startup_Event));
+	pthread_mutex_unlock(&st->lock);
+	qsort(events, count, sizeof(struct Startup_Event), event_cmp);
+
+	fprintf(out, "startup timeline (ms since bgtk_init):\n");
+	fprintf(out, "   start     end  duration  thread  step\n");
+	for (int i = 0; i < count; i++) {
+		struct Startup_Event* e = &events[i];
+		fprintf(out, "%8.3f %7.3f %9.3f  %-6s  %s%s%s\n",
+			e->start / 1e6, e->end / 1e6,
+			(e->end - e->start) / 1e6,
+			e->worker ? "worker" : "main", e->name,
+			e->detail[0] ? " " : "", e->detail);
+	}
+}
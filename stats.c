@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Recent frames kept for the histograms, a power of two
+#define FRAME_RING_SIZE 256
+
+// One finished frame. seq is odd while the UI thread rewrites the slot, so
+// a reader on another thread can tell a torn copy and drop it.
+struct Frame_Slot {
+	atomic_uint seq;
+	_Atomic uint64_t phase_ns[BGTK_PHASE_COUNT];
+	_Atomic uint64_t total_ns;
+	_Atomic uint64_t latency_ns;  // 0 when no input waited on the frame
+};
+
+struct BGTK_Frame_Ring {
+	struct Frame_Slot slots[FRAME_RING_SIZE];
+	atomic_uint_fast64_t head;  // Frames committed so far
+
+	// The frame being built, only touched by the UI thread
+	uint64_t start;
+	uint64_t phase_ns[BGTK_PHASE_COUNT];
+	uint64_t spent;	 // Sum of phase_ns
+
+	// Receive time of the oldest input the next frame answers, and its
+	// latency once the frame was drawn
+	uint64_t input_ns;
+	uint64_t latency_ns;
+	uint64_t latency_budget_ns;  // Warn above this, 0 for never
+};
+
+int frame_stats_init(struct BGTK_Context* ctx) {
+	ctx->frame_ring = calloc(1, sizeof(struct BGTK_Frame_Ring));
+	if (!ctx->frame_ring) {
+		perror("calloc");
+		return -1;
+	}
+	const char* budget = getenv("BGTK_LATENCY_BUDGET_MS");
+	if (budget && *budget) {
+		ctx->frame_ring->latency_budget_ns = strtod(budget, NULL) * 1e6;
+	}
+	return 0;
+}
+
+void frame_stats_free(struct BGTK_Context* ctx) {
+	free(ctx->frame_ring);
+	ctx->frame_ring = NULL;
+}
+
+struct Frame_Mark frame_phase_begin(struct BGTK_Context* ctx) {
+	struct BGTK_Frame_Ring* ring = ctx->frame_ring;
+	uint64_t now = now_ns();
+	if (!ring->start) {
+		ring->start = now;
+	}
+	return (struct Frame_Mark){now, ring->spent};
+}
+
+// Phases nest (an event lays out and paints), each one is charged only the
+// time not already charged to the phases inside it.
+void frame_phase_end(struct BGTK_Context* ctx, enum BGTK_Frame_Phase phase,
+		     struct Frame_Mark mark) {
+	struct BGTK_Frame_Ring* ring = ctx->frame_ring;
+	uint64_t elapsed = now_ns() - mark.start;
+	uint64_t nested = ring->spent - mark.spent;
+	frame_phase_add(ctx, phase, elapsed > nested ? elapsed - nested : 0);
+}
+
+void frame_phase_add(struct BGTK_Context* ctx, enum BGTK_Frame_Phase phase,
+		     uint64_t ns) {
+	struct BGTK_Frame_Ring* ring = ctx->frame_ring;
+	ring->phase_ns[phase] += ns;
+	ring->spent += ns;
+}
+
+void frame_input(struct BGTK_Context* ctx, uint64_t received) {
+	struct BGTK_Frame_Ring* ring = ctx->frame_ring;
+	if (!ring->input_ns || received < ring->input_ns) {
+		ring->input_ns = received;
+	}
+}
+
+void frame_input_done(struct BGTK_Context* ctx, uint64_t received,
+		      int redraw) {
+	struct BGTK_Frame_Ring* ring = ctx->frame_ring;
+	if (!redraw && ring->input_ns == received) {
+		ring->input_ns = 0;
+	}
+}
+
+void frame_drawn(struct BGTK_Context* ctx) {
+	struct BGTK_Frame_Ring* ring = ctx->frame_ring;
+	if (!ring->input_ns) {
+		return;
+	}
+	uint64_t now = now_ns();
+	ring->latency_ns = now > ring->input_ns ? now - ring->input_ns : 1;
+	ring->input_ns = 0;
+	if (ring->latency_budget_ns &&
+	    ring->latency_ns > ring->latency_budget_ns) {
+		trace_log(BGTK_LEVEL_INFO,
+			  "frame %llu: input latency %.2f ms over the %.2f ms "
+			  "budget",
+			  (unsigned long long)atomic_load_explicit(
+			      &ring->head, memory_order_relaxed),
+			  ring->latency_ns / 1e6,
+			  ring->latency_budget_ns / 1e6);
+	}
+}
+
+void bgtk_set_latency_budget(struct BGTK_Context* ctx, uint64_t ns) {
+	ctx->frame_ring->latency_budget_ns = ns;
+}
+
+void frame_commit(struct BGTK_Context* ctx) {
+	struct BGTK_Frame_Ring* ring = ctx->frame_ring;
+
+	// An input answered by a frame with nothing to draw has no latency
+	ring->input_ns = 0;
+	if (!ring->start) {
+		return;
+	}
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct Frame_Slot* slot = &ring->slots[head % FRAME_RING_SIZE];
+	unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for (int i = 0; i < BGTK_PHASE_COUNT; i++) {
+		atomic_store_explicit(&slot->phase_ns[i], ring->phase_ns[i],
+				      memory_order_relaxed);
+	}
+	atomic_store_explicit(&slot->total_ns, now_ns() - ring->start,
+			      memory_order_relaxed);
+	atomic_store_explicit(&slot->latency_ns, ring->latency_ns,
+			      memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	ring->start = 0;
+	ring->spent = 0;
+	ring->latency_ns = 0;
+	memset(ring->phase_ns, 0, sizeof(ring->phase_ns));
+}
+
+static int u64_cmp(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Sorts the samples and summarizes them.
+static struct BGTK_Frame_Histogram histogram(uint64_t* ns, int count) {
+	struct BGTK_Frame_Histogram h = {0};
+	if (count == 0) {
+		return h;
+	}
+	qsort(ns, count, sizeof(uint64_t), u64_cmp);
+	uint64_t sum = 0;
+	for (int i = 0; i < count; i++) {
+		sum += ns[i];
+	}
+	h.min = ns[0];
+	h.avg = sum / count;
+	h.p50 = ns[(count - 1) * 50 / 100];
+	h.p99 = ns[(count - 1) * 99 / 100];
+	h.max = ns[count - 1];
+	return h;
+}
+
+struct BGTK_Frame_Stats bgtk_get_frame_stats(struct BGTK_Context* ctx) {
+	struct BGTK_Frame_Ring* ring = ctx->frame_ring;
+	struct BGTK_Frame_Stats stats = {0};
+	uint64_t ns[BGTK_PHASE_COUNT + 1][FRAME_RING_SIZE];
+	uint64_t latency[FRAME_RING_SIZE];
+	int latency_count = 0;
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t first = head > FRAME_RING_SIZE ? head - FRAME_RING_SIZE : 0;
+	int count = 0;
+	for (uint64_t f = first; f < head; f++) {
+		struct Frame_Slot* slot = &ring->slots[f % FRAME_RING_SIZE];
+		unsigned seq =
+		    atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq & 1) {
+			continue;
+		}
+		for (int i = 0; i < BGTK_PHASE_COUNT; i++) {
+			ns[i][count] = atomic_load_explicit(
+			    &slot->phase_ns[i], memory_order_relaxed);
+		}
+		ns[BGTK_PHASE_COUNT][count] =
+		    atomic_load_explicit(&slot->total_ns, memory_order_relaxed);
+		latency[latency_count] =
+		    atomic_load_explicit(&slot->latency_ns, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+
+		// Rewritten while being read
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) !=
+		    seq) {
+			continue;
+		}
+		latency_count += latency[latency_count] != 0;
+		count++;
+	}
+
+	stats.frames = head;
+	stats.samples = count;
+	stats.event = histogram(ns[BGTK_PHASE_EVENT], count);
+	stats.layout = histogram(ns[BGTK_PHASE_LAYOUT], count);
+	stats.raster = histogram(ns[BGTK_PHASE_RASTER], count);
+	stats.scroll = histogram(ns[BGTK_PHASE_SCROLL], count);
+	stats.present = histogram(ns[BGTK_PHASE_PRESENT], count);
+	stats.total = histogram(ns[BGTK_PHASE_COUNT], count);
+	stats.latency_samples = latency_count;
+	stats.latency = histogram(latency, latency_count);
+	return stats;
+}
@@ -0,0 +1,189 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+// Scoped events kept per thread, the oldest are overwritten
+#define TRACE_RING_SIZE 16384
+
+struct Trace_Event {
+	const char* name;
+	uint64_t start;
+	uint64_t duration;
+};
+
+// Written only by its own thread. A thread whose ring is from before the
+// last trace_shutdown() starts a new one.
+struct Trace_Ring {
+	struct Trace_Event events[TRACE_RING_SIZE];
+	atomic_uint_fast64_t count;
+	int tid;
+	const char* thread_name;
+	struct Trace_Ring* next;
+};
+
+int trace_log_level;
+int trace_events_on;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Trace_Ring* trace_rings;
+static atomic_uint trace_generation;
+static int trace_next_tid;
+static uint64_t trace_origin;
+static const char* trace_path;
+static _Thread_local struct Trace_Ring* thread_ring;
+static _Thread_local unsigned thread_generation;
+
+static const char* level_names[] = {"none", "info", "debug", "trace"};
+
+// Reads BGTK_LOG (a level name or number) and BGTK_TRACE (the file the
+// Chrome trace JSON is written to at bgtk_destroy()).
+static void trace_read_env(void) {
+	trace_origin = now_ns();
+
+	const char* level = getenv("BGTK_LOG");
+	if (level && *level) {
+		for (int i = 0; i <= BGTK_LEVEL_TRACE; i++) {
+			if (strcmp(level, level_names[i]) == 0) {
+				trace_log_level = i;
+			}
+		}
+		if (*level >= '0' && *level <= '9') {
+			trace_log_level = atoi(level);
+		}
+	}
+
+	trace_path = getenv("BGTK_TRACE");
+	if (trace_path && *trace_path) {
+		if (BGTK_TRACE_LEVEL < BGTK_LEVEL_TRACE) {
+			fprintf(stderr,
+				"BGTK_TRACE ignored, built with "
+				"BGTK_TRACE_LEVEL=%d\n",
+				BGTK_TRACE_LEVEL);
+		} else {
+			trace_events_on = 1;
+		}
+	}
+}
+
+void trace_init(void) {
+	pthread_once(&trace_once, trace_read_env);
+}
+
+void trace_log(int level, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "bgtk %s: ", level_names[level]);
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+static struct Trace_Ring* trace_ring(void) {
+	unsigned generation = atomic_load(&trace_generation);
+	if (thread_ring && thread_generation == generation) {
+		return thread_ring;
+	}
+	struct Trace_Ring* ring = calloc(1, sizeof(struct Trace_Ring));
+	if (!ring) {
+		return NULL;
+	}
+	pthread_mutex_lock(&trace_lock);
+	ring->tid = ++trace_next_tid;
+	ring->next = trace_rings;
+	trace_rings = ring;
+	pthread_mutex_unlock(&trace_lock);
+	thread_ring = ring;
+	thread_generation = generation;
+	return ring;
+}
+
+void trace_thread_name(const char* name) {
+	if (!trace_events_on) {
+		return;
+	}
+	struct Trace_Ring* ring = trace_ring();
+	if (ring) {
+		ring->thread_name = name;
+	}
+}
+
+void trace_scope_end(struct Trace_Scope* scope) {
+	if (!scope->start) {
+		return;
+	}
+	struct Trace_Ring* ring = trace_ring();
+	if (!ring) {
+		return;
+	}
+	uint64_t n = atomic_load_explicit(&ring->count, memory_order_relaxed);
+	ring->events[n % TRACE_RING_SIZE] = (struct Trace_Event){
+	    scope->name,
+	    scope->start - trace_origin,
+	    now_ns() - scope->start,
+	};
+	atomic_store_explicit(&ring->count, n + 1, memory_order_release);
+}
+
+void bgtk_dump_trace(FILE* out) {
+	fprintf(out, "{\"traceEvents\":[");
+	int first = 1;
+	pthread_mutex_lock(&trace_lock);
+	for (struct Trace_Ring* ring = trace_rings; ring; ring = ring->next) {
+		if (ring->thread_name) {
+			fprintf(out,
+				"%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":1,\"tid\":%d,"
+				"\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",", ring->tid, ring->thread_name);
+			first = 0;
+		}
+
+		uint64_t count =
+		    atomic_load_explicit(&ring->count, memory_order_acquire);
+		uint64_t i = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE
+						      : 0;
+		for (; i < count; i++) {
+			struct Trace_Event* e =
+			    &ring->events[i % TRACE_RING_SIZE];
+			fprintf(out,
+				"%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+				"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				first ? "" : ",", e->name, ring->tid,
+				e->start / 1e3, e->duration / 1e3);
+			first = 0;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+void trace_shutdown(void) {
+	if (!trace_events_on) {
+		return;
+	}
+	FILE* f = fopen(trace_path, "w");
+	if (f) {
+		bgtk_dump_trace(f);
+		fclose(f);
+	} else {
+		perror(trace_path);
+	}
+
+	// The threads that drew into the rings are all joined by now
+	pthread_mutex_lock(&trace_lock);
+	struct Trace_Ring* ring = trace_rings;
+	while (ring) {
+		struct Trace_Ring* next = ring->next;
+		free(ring);
+		ring = next;
+	}
+	trace_rings = NULL;
+	atomic_fetch_add(&trace_generation, 1);
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "bgtk.h"
+#include "internal.h"
+
+#define UTF8_REPLACEMENT 0xFFFD
+
+// Returns whether the first length bytes of text are all ASCII.
+int utf8_is_ascii(const char* text, size_t length) {
+	// Eight bytes per step, any set high bit means a multi-byte sequence
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t chunk;
+		memcpy(&chunk, text + i, sizeof(chunk));
+		if (chunk & 0x8080808080808080ULL) {
+			return 0;
+		}
+	}
+	for (; i < length; i++) {
+		if ((unsigned char)text[i] & 0x80) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Decodes the code point at *p and moves *p past it. A malformed sequence
+// decodes to U+FFFD and only its first byte is consumed.
+uint32_t utf8_next(const char** p, const char* end) {
+	const unsigned char* s = (const unsigned char*)*p;
+	const unsigned char* e = (const unsigned char*)end;
+	if (s[0] < 0x80) {
+		*p += 1;
+		return s[0];
+	}
+
+	int length;
+	uint32_t cp;
+	uint32_t min;
+	if ((s[0] & 0xE0) == 0xC0) {
+		length = 2;
+		cp = s[0] & 0x1F;
+		min = 0x80;
+	} else if ((s[0] & 0xF0) == 0xE0) {
+		length = 3;
+		cp = s[0] & 0x0F;
+		min = 0x800;
+	} else if ((s[0] & 0xF8) == 0xF0) {
+		length = 4;
+		cp = s[0] & 0x07;
+		min = 0x10000;
+	} else {
+		*p += 1;
+		return UTF8_REPLACEMENT;
+	}
+
+	if (e - s < length) {
+		*p += 1;
+		return UTF8_REPLACEMENT;
+	}
+	for (int i = 1; i < length; i++) {
+		if ((s[i] & 0xC0) != 0x80) {
+			*p += 1;
+			return UTF8_REPLACEMENT;
+		}
+		cp = (cp << 6) | (s[i] & 0x3F);
+	}
+
+	// Overlong forms, surrogates and values past Unicode are malformed
+	if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+		*p += 1;
+		return UTF8_REPLACEMENT;
+	}
+	*p += length;
+	return cp;
+}
+
+// Moves i back to the first byte of the code point it points into.
+int utf8_boundary(const char* text, int i) {
+	while (i > 0 && ((unsigned char)text[i] & 0xC0) == 0x80) {
+		i--;
+	}
+	return i;
+}
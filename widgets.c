@@ -1,7 +1,9 @@
 #include <bgce.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "bgtk.h"
 #include "internal.h"
@@ -10,7 +12,7 @@
 static struct BGTK_Widget* widget_new(struct BGTK_Context* ctx,
 			      enum BGTK_Widget_Type type, BGTK_Options options) {
 	struct BGTK_Widget* widget =
-	    (struct BGTK_Widget*)calloc(1, sizeof(struct BGTK_Widget));
+	    mem_calloc(ctx, BGTK_MEM_WIDGETS, 1, sizeof(struct BGTK_Widget));
 	if (!widget) {
 		perror("calloc");
 		return NULL;
@@ -20,38 +22,277 @@ static struct BGTK_Widget* widget_new(struct BGTK_Context* ctx,
 	widget->flags = options.flags;
 	widget->padding = options.padding;
 	widget->margin = options.margin;
+	widget->flex = options.flex;
+	widget->opacity = 0xFF;
+	widget->blend = BGTK_BLEND_SRC_OVER;
+	widget->font = options.font;
+	widget->needs_layout = 1;
 	return widget;
 }
 
-void set_label(struct BGTK_Widget* widget, char* label) {
-	printf("BGTK: setting label: %s\n", label);
-	if (widget->data.label.text) {
-		free(widget->data.label.text->data.text.text);
-		free(widget->data.label.text);
+// Makes room for a string of length bytes in a text widget.
+static int text_reserve(struct BGTK_Widget* w, int length) {
+	if (length < w->data.text.capacity) {
+		return 0;
+	}
+
+	int capacity = w->data.text.capacity ? w->data.text.capacity : 16;
+	while (capacity <= length) {
+		capacity *= 2;
+	}
+	struct BGTK_Context* ctx = w->ctx;
+	char* text =
+	    mem_realloc(ctx, BGTK_MEM_STRINGS, w->data.text.text, capacity);
+	if (!text) {
+		perror("realloc");
+		return -1;
+	}
+	w->data.text.text = text;
+	char* spare =
+	    mem_realloc(ctx, BGTK_MEM_STRINGS, w->data.text.spare, capacity);
+	if (!spare) {
+		perror("realloc");
+		return -1;
+	}
+	w->data.text.spare = spare;
+	int* pen = mem_realloc(ctx, BGTK_MEM_STRINGS, w->data.text.pen,
+			       (capacity + 1) * sizeof(int));
+	if (!pen) {
+		perror("realloc");
+		return -1;
+	}
+	pen[0] = 0;
+	w->data.text.pen = pen;
+	w->data.text.capacity = capacity;
+	return 0;
+}
+
+// Copies src into a text widget. Pen positions from the first byte that
+// changed on are recomputed by the next text_advance().
+static int text_store(struct BGTK_Widget* w, const char* src, int length) {
+	if (text_reserve(w, length) != 0) {
+		return -1;
+	}
+
+	char* text = w->data.text.text;
+	int start = 0;
+	while (start < length && start < w->data.text.length &&
+	       text[start] == src[start]) {
+		start++;
+	}
+
+	// Restart at a code point that begins at the same byte in both
+	// strings. The bytes of a multi-byte code point share the pen
+	// position before it, the advance is added after its last byte.
+	if (start < w->data.text.length) {
+		start = utf8_boundary(text, start);
 	}
+	if (start < length) {
+		start = utf8_boundary(src, start);
+	}
+	memmove(text + start, src + start, length - start);
+	text[length] = '\0';
+	w->data.text.length = length;
+	if (w->data.text.pen_valid > start) {
+		w->data.text.pen_valid = start;
+	}
+	return 0;
+}
+
+// Advances the pen over the bytes stored since it was last computed and
+// returns the width of the string, in 26.6 units. This is the first
+// point a text widget needs its font.
+int text_advance(struct BGTK_Widget* w) {
+	char* text = w->data.text.text;
+	int* pen = w->data.text.pen;
+	int start = w->data.text.pen_valid;
+	int length = w->data.text.length;
+	if (start < length) {
+		struct BGTK_Text_Iter it;
+		text_iter_init(&it, widget_font(w), text + start,
+			       length - start);
+		const char* p = it.p;
+		const struct BGTK_Glyph* glyph;
+		while ((glyph = text_iter_next(&it))) {
+			int i = p - text;
+			int next = it.p - text;
+			for (int j = i + 1; j < next; j++) {
+				pen[j] = pen[i];
+			}
+			pen[next] = pen[i] + glyph->advance;
+			p = it.p;
+		}
+		w->data.text.pen_valid = length;
+	}
+	return pen[length];
+}
+
+void text_free(struct BGTK_Widget* w) {
+	mem_free(w->ctx, w->data.text.text);
+	mem_free(w->ctx, w->data.text.spare);
+	mem_free(w->ctx, w->data.text.pen);
+}
+
+// Frees w and everything it owns, children included. Its layer must be
+// released and the startup tasks joined first.
+void widget_free(struct BGTK_Widget* w) {
+	if (!w) {
+		return;
+	}
+	struct BGTK_Context* ctx = w->ctx;
+	switch (w->type) {
+		case BGTK_WIDGET_TEXT:
+			text_free(w);
+			break;
+		case BGTK_WIDGET_LABEL:
+			widget_free(w->data.label.text);
+			break;
+		case BGTK_WIDGET_BUTTON:
+			widget_free(w->data.button.label);
+			break;
+		case BGTK_WIDGET_IMAGE:
+			mem_free(ctx, w->data.image.path);
+			image_free(ctx, w->data.image.pixels,
+				   w->data.image.img_w, w->data.image.img_h);
+			break;
+		case BGTK_WIDGET_SCROLLABLE:
+			for (int i = 0; i < w->data.scrollable.widget_count;
+			     i++) {
+				widget_free(w->data.scrollable.widgets[i]);
+			}
+			mem_free(ctx, w->data.scrollable.widgets);
+			mem_free(ctx, w->data.scrollable.tmp);
+			break;
+		case BGTK_WIDGET_BOX:
+			for (int i = 0; i < w->data.box.widget_count; i++) {
+				widget_free(w->data.box.widgets[i]);
+			}
+			mem_free(ctx, w->data.box.widgets);
+			break;
+		case BGTK_WIDGET_LIST:
+			for (int i = 0; i < w->data.list.row_count; i++) {
+				widget_free(w->data.list.rows[i]);
+			}
+			mem_free(ctx, w->data.list.rows);
+			mem_free(ctx, w->data.list.row_items);
+			mem_free(ctx, w->data.list.offsets);
+			mem_free(ctx, w->data.list.tmp);
+			break;
+	}
+	mem_free(ctx, w);
+}
 
-	// Create a new text widget for the label
-	struct BGTK_Widget* text_widget = bgtk_text(widget->ctx, label, 0);
+// Finds the text widget that holds the string shown by w.
+static struct BGTK_Widget* text_of(struct BGTK_Widget* w) {
+	while (w) {
+		switch (w->type) {
+			case BGTK_WIDGET_TEXT:
+				return w;
+			case BGTK_WIDGET_LABEL:
+				w = w->data.label.text;
+				break;
+			case BGTK_WIDGET_BUTTON:
+				w = w->data.button.label;
+				break;
+			default:
+				return NULL;
+		}
+	}
+	return NULL;
+}
+
+// Stores the new string and requests a frame. Layout only runs again when
+// the width changed, which a fixed-width counter never does.
+static void update_text(struct BGTK_Widget* text, const char* src,
+			int length) {
+	struct BGTK_Context* ctx = text->ctx;
+	if (text_store(text, src, length) != 0) {
+		return;
+	}
+
+	int width = (text_advance(text) >> 6) + 2 * text->padding;
+	if (!text->measured.valid || width != text->measured.w) {
+		int height = text->measured.h;
+		int valid = text->measured.valid;
+		bgtk_invalidate_layout(text);
+		text->measured.valid = valid;
+		text->measured.w = width;
+		text->measured.h = height;
+	}
+
+	bgtk_invalidate_paint(text);
+	request_frame(ctx);
+}
+
+void bgtk_set_text(struct BGTK_Widget* widget, const char* text) {
+	struct BGTK_Widget* text_widget = text_of(widget);
 	if (!text_widget) {
-		perror(
-		    "BGTK Failed to create text widget for "
-		    "label");
+		fprintf(stderr, "BGTK widget has no text to set\n");
 		return;
 	}
+	update_text(text_widget, text, strlen(text));
+}
 
-	widget->data.label.text = text_widget;
+void bgtk_set_textf(struct BGTK_Widget* widget, const char* fmt, ...) {
+	struct BGTK_Widget* text = text_of(widget);
+	if (!text) {
+		fprintf(stderr, "BGTK widget has no text to set\n");
+		return;
+	}
 
-	// Calculate size based on text widget and padding
-	widget->w = text_widget->w + 2 * widget->padding;
-	widget->h = text_widget->h + 2 * widget->padding;
+	// Format into the spare buffer so the old string is still there to
+	// compare against, growing it only when the result does not fit
+	va_list args;
+	va_start(args, fmt);
+	int length = vsnprintf(text->data.text.spare, text->data.text.capacity,
+			       fmt, args);
+	va_end(args);
+	if (length < 0) {
+		return;
+	}
+	if (length >= text->data.text.capacity) {
+		if (text_reserve(text, length) != 0) {
+			return;
+		}
+		va_start(args, fmt);
+		vsnprintf(text->data.text.spare, text->data.text.capacity, fmt,
+			  args);
+		va_end(args);
+	}
+	update_text(text, text->data.text.spare, length);
+}
 
-	draw_widget(widget->ctx, widget, widget->ctx->shm_buffer);
-	printf("BGTK label set\n");
+void bgtk_set_opacity(struct BGTK_Widget* w, int opacity) {
+	opacity = opacity < 0 ? 0 : opacity > 0xFF ? 0xFF : opacity;
+	if (opacity == w->opacity) {
+		return;
+	}
+	w->opacity = opacity;
+	// Only what w is drawn into changes, its own layer stays valid
+	bgtk_invalidate_paint(w->parent);
+	request_frame(w->ctx);
+}
+
+void bgtk_set_blend_mode(struct BGTK_Widget* w, int mode) {
+	if (mode < 0 || mode >= BGTK_BLENDS) {
+		fprintf(stderr, "BGTK unknown blend mode %d\n", mode);
+		return;
+	}
+	if (mode == w->blend) {
+		return;
+	}
+	w->blend = mode;
+	bgtk_invalidate_paint(w->parent);
+	request_frame(w->ctx);
+}
+
+void set_label(struct BGTK_Widget* widget, char* label) {
+	bgtk_set_text(widget, label);
 }
 
 struct BGTK_Widget* bgtk_label(struct BGTK_Context* ctx, char* text, BGTK_Options options) {
 	struct BGTK_Widget* widget = widget_new(ctx, BGTK_WIDGET_LABEL, options);
-	printf("BGTK allocated label\n");
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "allocated label");
 	if (!widget) {
 		perror("BGTK Failed to create new widget");
 		return NULL;
@@ -60,44 +301,39 @@ struct BGTK_Widget* bgtk_label(struct BGTK_Context* ctx, char* text, BGTK_Option
 	widget->set_label = set_label;
 
 	// Create a text widget for the label
-	struct BGTK_Widget* text_widget = bgtk_text(ctx, text, (BGTK_Options){ .flags = 0 });
+	struct BGTK_Widget* text_widget =
+	    bgtk_text(ctx, text, (BGTK_Options){.font = options.font});
 	if (!text_widget) {
 		perror(
 		    "BGTK Failed to create text widget for "
 		    "label");
-		free(widget);
+		mem_free(ctx, widget);
 		return NULL;
 	}
 
+	// Sized by the first layout pass
+	text_widget->parent = widget;
 	widget->data.label.text = text_widget;
 
-	// Calculate size based on text widget and padding
-	widget->w = text_widget->w + 2 * widget->padding;
-	widget->h = text_widget->h + 2 * widget->padding;
-
 	return widget;
 }
 
 struct BGTK_Widget* bgtk_text(struct BGTK_Context* ctx, char* text, BGTK_Options options) {
-	printf("BGTK creating text widget\n");
-	struct BGTK_Widget* widget = widget_new(ctx, BGTK_WIDGET_TEXT, flags);
-	printf("BGTK allocated text widget\n");
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "creating text widget");
+	struct BGTK_Widget* widget = widget_new(ctx, BGTK_WIDGET_TEXT, options);
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "allocated text widget");
 	if (!widget) {
 		perror("BGTK Failed to create new widget");
 		return NULL;
 	}
 
-	char* ptr = calloc(1, strlen(text) + 1);
-	sprintf(ptr, "%s", text);
-	widget->data.text.text = ptr;
-
-	// Calculate size based on text
-	measure_text(widget->ctx->ft_face, widget->data.text.text, &widget->w,
-		     &widget->h);
-
-	// Add padding to the text widget
-	widget->w += 2 * widget->padding;
-	widget->h += 2 * widget->padding;
+	// Only the bytes are kept here. Glyphs are measured by the first
+	// layout pass, so building the tree never waits on the font.
+	if (text_store(widget, text, strlen(text)) != 0) {
+		text_free(widget);
+		mem_free(ctx, widget);
+		return NULL;
+	}
 
 	return widget;
 }
@@ -105,19 +341,17 @@ struct BGTK_Widget* bgtk_text(struct BGTK_Context* ctx, char* text, BGTK_Options
 struct BGTK_Widget* bgtk_button(struct BGTK_Context* ctx,
 				struct BGTK_Widget* label,
 			BGTK_Callback callback, BGTK_Options options) {
-	printf("BGTK creating button widget\n");
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "creating button widget");
 	struct BGTK_Widget* widget = widget_new(ctx, BGTK_WIDGET_BUTTON, options);
 	if (!widget) {
 		perror("BGTK Failed to create new widget");
 		return NULL;
 	}
 
+	// Sized by the first layout pass
 	widget->data.button.callback = callback;
 	widget->data.button.label = label;
-
-	// Calculate size based on label widget and padding
-	widget->w = label->w + 2 * widget->padding;
-	widget->h = label->h + 2 * widget->padding;
+	label->parent = widget;
 
 	return widget;
 }
@@ -125,7 +359,7 @@ struct BGTK_Widget* bgtk_button(struct BGTK_Context* ctx,
 struct BGTK_Widget* bgtk_scrollable(struct BGTK_Context* ctx,
 				    struct BGTK_Widget** items,
 			    int widget_count, BGTK_Options options) {
-	printf("BGTK creating scrollable widget\n");
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "creating scrollable widget");
 	struct BGTK_Widget* widget =
 	    widget_new(ctx, BGTK_WIDGET_SCROLLABLE, options);
 	if (!widget) {
@@ -133,56 +367,146 @@ struct BGTK_Widget* bgtk_scrollable(struct BGTK_Context* ctx,
 		return NULL;
 	}
 
-	widget->data.scrollable.widgets = (struct BGTK_Widget**)calloc(
-	    widget_count, sizeof(struct BGTK_Widget*));
-	if (!widget->data.scrollable.items) {
+	widget->data.scrollable.widgets = mem_calloc(
+	    ctx, BGTK_MEM_WIDGETS, widget_count, sizeof(struct BGTK_Widget*));
+	if (!widget->data.scrollable.widgets) {
 		perror("calloc");
-		free(widget);
+		mem_free(ctx, widget);
 		return NULL;
 	}
 
-	// Copy the input widgets into the scrollable container
+	// Copy the input widgets into the scrollable container, the
+	// content height is computed by the first layout pass
 	widget->data.scrollable.widget_count = widget_count;
+	widget->data.scrollable.widget_capacity = widget_count;
 	widget->data.scrollable.scroll_y = 0;
 	widget->data.scrollable.content_height = 0;
 	for (int i = 0; i < widget_count; i++) {
-		widget->data.scrollable.items[i] = items[i];
-		widget->data.scrollable.content_height +=
-		    items[i]->h + 5 + 2 * widget->margin;  // 5px spacing + margin
+		widget->data.scrollable.widgets[i] = items[i];
+		items[i]->parent = widget;
 	}
 
 	// Initialize tmp buffer to NULL, it will be allocated
 	// during drawing
 	widget->data.scrollable.tmp = NULL;
-	printf("BGTK allocated scrollable widget\n");
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "allocated scrollable widget");
 
 	return widget;
 }
 
+// Decodes the image of a widget on a startup worker.
+static void image_decode(void* arg) {
+	struct BGTK_Widget* w = arg;
+	uint32_t* pixels = NULL;
+	int img_w, img_h, opaque;
+	if (load_image(w->ctx, w->data.image.path, &pixels, &img_w, &img_h,
+		       &opaque) != 0) {
+		return;
+	}
+	w->data.image.pixels = pixels;
+	w->data.image.img_w = img_w;
+	w->data.image.img_h = img_h;
+	w->data.image.opaque = opaque;
+}
+
+// Waits for the decode started by bgtk_image() and sizes the widget to the
+// image unless the app already set a size. An image that failed to decode
+// stays empty.
+void image_wait(struct BGTK_Widget* w) {
+	if (!w->data.image.path) {
+		return;
+	}
+	task_wait(w->data.image.decode);
+	w->data.image.decode = NULL;
+	mem_free(w->ctx, w->data.image.path);
+	w->data.image.path = NULL;
+
+	if (w->w == 0 && w->h == 0) {
+		w->w = w->data.image.img_w + 2 * w->padding;
+		w->h = w->data.image.img_h + 2 * w->padding;
+	}
+}
+
 struct BGTK_Widget* bgtk_image(struct BGTK_Context* ctx, const char* path,
 		      BGTK_Options options) {
-	printf("BGTK creating image widget\n");
+	BGTK_LOG(BGTK_LEVEL_DEBUG, "creating image widget");
 	struct BGTK_Widget* widget = widget_new(ctx, BGTK_WIDGET_IMAGE, options);
 	if (!widget) {
 		perror("BGTK Failed to create image widget");
 		return NULL;
 	}
 
-	// Load the image into a pixel buffer
-	uint32_t* pixels = NULL;
-	int img_w, img_h;
-	if (load_image(path, &pixels, &img_w, &img_h) != 0) {
-		free(widget);
+	// Only a missing file fails here, the pixels are decoded in the
+	// background until the first layout pass needs the size
+	if (access(path, R_OK) != 0) {
+		perror(path);
+		mem_free(ctx, widget);
+		return NULL;
+	}
+	widget->data.image.path = mem_strdup(ctx, BGTK_MEM_STRINGS, path);
+	if (!widget->data.image.path) {
+		perror("strdup");
+		mem_free(ctx, widget);
 		return NULL;
 	}
+	widget->data.image.decode =
+	    task_start(ctx, "image decode", path, image_decode, widget);
+
+	return widget;
+}
 
-	widget->data.image.pixels = pixels;
-	widget->data.image.img_w = img_w;
-	widget->data.image.img_h = img_h;
+struct BGTK_Widget* bgtk_box(struct BGTK_Context* ctx, int orientation,
+			     struct BGTK_Widget** items, int widget_count,
+			     BGTK_Options options) {
+	struct BGTK_Widget* widget = widget_new(ctx, BGTK_WIDGET_BOX, options);
+	if (!widget) {
+		perror("BGTK Failed to create box widget");
+		return NULL;
+	}
 
-	// Add padding to the image widget
-	widget->w = img_w + 2 * widget->padding;
-	widget->h = img_h + 2 * widget->padding;
+	widget->data.box.widgets = mem_calloc(
+	    ctx, BGTK_MEM_WIDGETS, widget_count, sizeof(struct BGTK_Widget*));
+	if (!widget->data.box.widgets) {
+		perror("calloc");
+		mem_free(ctx, widget);
+		return NULL;
+	}
+
+	// Positions are assigned by the layout pass
+	widget->data.box.widget_count = widget_count;
+	widget->data.box.orientation = orientation;
+	for (int i = 0; i < widget_count; i++) {
+		widget->data.box.widgets[i] = items[i];
+		items[i]->parent = widget;
+	}
 
 	return widget;
 }
+
+// Rows are made on the first layout, once the list knows its height
+struct BGTK_Widget* bgtk_list(struct BGTK_Context* ctx,
+			      const struct BGTK_List_Source* source,
+			      BGTK_Options options) {
+	struct BGTK_Widget* widget = widget_new(ctx, BGTK_WIDGET_LIST, options);
+	if (!widget) {
+		perror("BGTK Failed to create list widget");
+		return NULL;
+	}
+	if (list_init(widget, source) != 0) {
+		widget_free(widget);
+		return NULL;
+	}
+	return widget;
+}
+
+struct BGTK_Widget* bgtk_vbox(struct BGTK_Context* ctx,
+			      struct BGTK_Widget** items, int widget_count,
+			      BGTK_Options options) {
+	return bgtk_box(ctx, BGTK_BOX_VERTICAL, items, widget_count, options);
+}
+
+struct BGTK_Widget* bgtk_hbox(struct BGTK_Context* ctx,
+			      struct BGTK_Widget** items, int widget_count,
+			      BGTK_Options options) {
+	return bgtk_box(ctx, BGTK_BOX_HORIZONTAL, items, widget_count, options);
+}